@@ -1,9 +1,17 @@
+#include <stdalign.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
 
 #ifndef CPU_H
     #define CPU_H
 
-    #define MEMORY_SIZE 65536
+    #define HALT_SKIP_MAX 70224 // one frame
+    #define APU_CLOCK 4194304
+    #define AUDIO_SAMPLE_RATE 44100
+    #define AUDIO_BUFFER_SIZE 1024 // stereo frames per output call
     #define THROW(msg, code) throw_error(msg, code, __FILE__, __LINE__)
 
 typedef enum e_error {
@@ -19,42 +27,116 @@ typedef enum e_flag {
     FLAG_C = (1 << 4)
 } flag_t;
 
-typedef struct cpu_s {
-    uint8_t memory[MEMORY_SIZE];
-    uint8_t *rom;
-    uint32_t rom_size;
+typedef enum e_event {
+    EVENT_PPU,
+    EVENT_TIMER,
+    EVENT_SERIAL,
+    EVENT_COUNT
+} event_type_t;
 
-    uint8_t cartridge_type;
-    uint16_t mbc1_bank_low;
-    uint8_t mbc1_bank_high;
-    uint8_t mbc1_rom_bank_high;
-    uint8_t ram_enabled;
-    uint8_t banking_mode;
-    uint8_t *external_ram;
+// Absolute cycle at which a peripheral next needs the CPU to stop
+typedef struct event_s {
+    uint64_t when;
+    uint8_t type;
+} event_t;
+
+struct cpu_s;
+
+// A ROM file mapped read-only, shared by every CPU that opens it
+typedef struct rom_image_s {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    size_t size;
+    uint8_t *data;
+    uint8_t mapped; // else read into memory
+    int refs;
+    struct rom_image_s *next;
+} rom_image_t;
+
+// Cartridge mapper: register writes plus SRAM accesses that can't be paged
+typedef struct mbc_s {
+    const char *name;
+    uint8_t multicart;
+    uint8_t rumble;
+    void (*write_rom)(struct cpu_s *cpu, uint16_t addr, uint8_t val);
+    uint8_t (*read_ram)(struct cpu_s *cpu, uint16_t addr);
+    void (*write_ram)(struct cpu_s *cpu, uint16_t addr, uint8_t val);
+} mbc_t;
 
+// Fields are grouped by how often they are touched. The first group is read
+// or written by nearly every instruction and takes 32 bytes at the start of
+// the struct, which is aligned to a cache line, so heap copies come from
+// aligned_alloc. Everything up to `framebuffer` is emulated state and makes
+// up a save state; the rest is output, host-side settings and pointers, and
+// is never serialized.
+typedef struct cpu_s {
+    alignas(64) struct {
+        union { struct { uint8_t f; uint8_t a; }; uint16_t af; };
+        union { struct { uint8_t c; uint8_t b; }; uint16_t bc; };
+        union { struct { uint8_t e; uint8_t d; }; uint16_t de; };
+        union { struct { uint8_t l; uint8_t h; }; uint16_t hl; };
+    } registers;
     uint16_t pc;
     uint16_t sp;
-
+    // Cycles run but not yet applied to the PPU/APU, and cycles applied to
+    // the peripherals so far
+    int pending_cycles;
+    uint64_t cycles;
     uint8_t ime_scheduled;
     uint8_t ime;
     uint8_t halted;
     uint8_t halt_bug;
-
+    uint8_t run_break;
+    uint8_t double_speed;
+    uint8_t cgb_mode;
     uint8_t joypad_state;
+
+    // Pending events sorted by deadline, at most one per type
+    event_t events[EVENT_COUNT];
+    uint8_t event_count;
     int serial_timer;
-    uint16_t div_counter;
+    int ppu_cycles;
+    // Timers are derived from the cycle counter: the cycle the 16-bit
+    // divider was last reset, and the cycle TIMA was last brought up to
+    uint64_t div_base;
+    uint64_t tima_cycle;
+    uint8_t window_line; // the window's own line counter
 
-    // CGB support
-    uint8_t cgb_mode;
+    // OAM, the unusable area, the I/O registers and HRAM (0xFE00-0xFFFF),
+    // accessed through IO()
+    uint8_t io[0x200];
+
+    // The only copy of video and work RAM. DMG uses VRAM bank 0 and WRAM
+    // banks 0 and 1, CGB pages the rest in through FF4F and FF70
+    uint8_t vram_bank;
+    uint8_t wram_bank;
+    uint8_t vram[2][0x2000];
+    uint8_t wram[8][0x1000];
+
+    // Mapper registers, only read when the game switches banks
+    uint8_t cartridge_type;
+    uint16_t rom_bank;
+    uint8_t ram_bank;
+    uint8_t ram_enabled;
+    uint8_t banking_mode;
+    uint8_t rumble;
+    uint32_t rom_offset[2];
+    uint32_t sram_offset;
+    uint8_t sram_mapped;
+
+    // MBC3 real-time clock
+    uint8_t rtc[5];
+    uint8_t rtc_latched[5];
+    uint8_t rtc_latch;
+    int64_t rtc_time;
+
+    // CGB palette memory, speed switch and HDMA
     uint8_t bg_palette_data[64];
     uint8_t obj_palette_data[64];
     uint8_t bcps;
     uint8_t ocps;
-    uint8_t vram_bank;
-    uint8_t vram_banks[2][0x2000];
-    uint8_t wram_bank;
-    uint8_t wram_banks[8][0x1000];
-    uint8_t double_speed;
     uint8_t speed_switch_armed;
     uint8_t hdma_src_hi, hdma_src_lo;
     uint8_t hdma_dst_hi, hdma_dst_lo;
@@ -62,23 +144,229 @@ typedef struct cpu_s {
     uint8_t hdma_active;
     uint16_t hdma_remaining;
 
-    struct {
-        union { struct { uint8_t f; uint8_t a; }; uint16_t af; };
-        union { struct { uint8_t c; uint8_t b; }; uint16_t bc; };
-        union { struct { uint8_t e; uint8_t d; }; uint16_t de; };
-        union { struct { uint8_t l; uint8_t h; }; uint16_t hl; };
-    } registers;
+    // Frame drawn one line at a time at the end of each line's mode 3
+    uint32_t framebuffer[160 * 144];
+    // When set, each line also goes here as 160 palette indices: colour
+    // index in bits 0-1, palette number in bits 2-4, bit 5 for sprites
+    uint8_t *index_frame;
+    // Palettes resolved to screen colours whenever their registers are
+    // written: the 8 CGB BG and OBJ palettes, or BGP and OBP0/OBP1
+    uint32_t bg_colors[8][4];
+    uint32_t obj_colors[8][4];
+    uint8_t color_correction;
+
+    // Cartridge memory, owned or shared by the host
+    uint8_t *rom;
+    uint32_t rom_size;
+    const rom_image_t *rom_image; // set when the ROM came from read_rom
+    const mbc_t *mbc;
+    uint8_t *external_ram;
+    uint32_t ram_size;
+
+    // Host page per 256-byte block, NULL means the access needs a handler
+    uint8_t *read_map[256];
+    uint8_t *write_map[256];
+
+    // Per-instance host state
+    struct block_cache_s *blocks;
+    struct tile_cache_s *tiles;
+    struct apu_s *apu;
+    FILE *serial_out; // link port bytes go here, NULL drops them
+    const char *rom_path;
 } cpu_t;
 
+_Static_assert(offsetof(cpu_t, joypad_state) < 64, "the hot group must fit in one cache line");
+
+// A byte of the 0xFE00-0xFFFF page
+    #define IO(cpu, address) ((cpu)->io[(address) & 0x1FF])
+
+    #define BLOCK_MAX_OPS 16
+    #define BLOCK_CACHE_SIZE 4096
+    #define IDLE_LOOP_MAX 64
+    #define TILE_COUNT 384
+
+typedef struct decoded_op_s {
+    uint16_t pc;
+    uint16_t imm;
+    uint8_t op;
+} decoded_op_t;
+
+// Straight-line run of decoded instructions, keyed by the host address of
+// its first byte so every ROM/WRAM bank gets its own blocks
+typedef struct block_s {
+    const uint8_t *key;
+    uint32_t gen;
+    uint16_t cycles;
+    uint8_t count;
+    // Idle loop kind and its slot in the loop report
+    uint8_t idle;
+    uint8_t idle_slot;
+    decoded_op_t ops[BLOCK_MAX_OPS];
+} block_t;
+
+typedef enum e_idle {
+    IDLE_NONE,
+    IDLE_POLL,
+    IDLE_DELAY,
+    IDLE_DELAY16
+} idle_kind_t;
+
+// A block that branches back to itself and can be fast-forwarded
+typedef struct idle_loop_s {
+    const uint8_t *key;
+    uint16_t pc;
+    uint16_t bank;
+    uint8_t kind;
+    uint64_t skips;
+    uint64_t cycles;
+} idle_loop_t;
+
+typedef struct block_stats_s {
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t compiled;
+    uint64_t invalidations;
+    uint32_t blocks;
+} block_stats_t;
+
+typedef struct block_cache_s {
+    block_t blocks[BLOCK_CACHE_SIZE];
+    decoded_op_t scratch;
+    block_stats_t stats;
+    // Last block returned, and the idle loop just re-entered (if any)
+    const block_t *last;
+    const block_t *idle;
+    idle_loop_t loops[IDLE_LOOP_MAX];
+    int loop_count;
+    // One bit per 64 bytes of cpu_t RAM holding cached code, and a
+    // generation per 256 bytes bumped when that code is overwritten
+    uint8_t code_lines[sizeof(cpu_t) / 512 + 1];
+    uint32_t page_gen[sizeof(cpu_t) / 256 + 1];
+} block_cache_t;
+
+// Every tile of both VRAM banks expanded to one colour index per pixel,
+// plain and x-flipped, decoded again only after a write to the tile
+typedef struct tile_cache_s {
+    uint8_t rows[2][TILE_COUNT][2][8][8];
+    uint8_t dirty[2][TILE_COUNT / 8];
+} tile_cache_t;
+
+// One implementation of the pixel hot loops (scalar, SSE2, AVX2, NEON),
+// picked at startup for the host CPU
+typedef struct pixel_kernels_s {
+    const char *name;
+    // 16 bytes of 2bpp tile data -> 8 rows of colour indices, plain and x-flipped
+    void (*decode_tile)(const uint8_t *data, uint8_t rows[2][8][8]);
+    // 8 colour indices -> 8 ARGB pixels through a 4-colour palette
+    void (*expand_row)(const uint8_t *pixels, const uint32_t *pal, uint32_t *out);
+} pixel_kernels_t;
+
+extern const pixel_kernels_t *pixel_kernels;
+extern const uint32_t palette[4];
+
+// Frames handed to the main thread and what it did with them
+typedef struct {
+    unsigned int presented;
+    unsigned int dropped;  // replaced by a newer frame before being shown
+    unsigned int repeated; // a refresh passed with no new frame
+} display_stats_t;
+
+// What the audio device's ring buffer has been through
+typedef struct {
+    unsigned int fill;      // frames waiting to be played
+    unsigned int size;      // frames the ring holds
+    unsigned int target;    // the fill rate control steers towards
+    unsigned int underruns; // device reads that ran dry and got silence
+    unsigned int overruns;  // blocks that didn't fit and were cut short
+    int rate;               // output rate the APU mixes at right now
+} audio_stats_t;
+
+// Scripted input: `buttons` are held from `frame` until the next step
+typedef struct input_step_s {
+    uint64_t frame;
+    uint8_t buttons;
+} input_step_t;
+
+typedef struct thread_pool_s thread_pool_t;
+typedef void (*pool_task_t)(void *ctx, int index, int worker);
+typedef struct audio_ring_s audio_ring_t;
+
+// How much of the APU runs (see set_audio_mode)
+typedef enum {
+    AUDIO_OFF,       // not clocked at all
+    AUDIO_REGISTERS, // length counters, sweep, envelopes and NR52, no samples
+    AUDIO_FULL       // waveforms too, mixed into the output
+} audio_mode_t;
+
+// Somewhere mixed audio goes (see audio_sink.c). `write` gets `frames`
+// interleaved left/right 16-bit pairs on the emulation thread and must
+// neither block nor allocate; `destroy` flushes and frees. Implementations
+// put this first in their own struct.
+typedef struct audio_sink_s audio_sink_t;
+struct audio_sink_s {
+    void (*write)(audio_sink_t *sink, const int16_t *samples, int frames);
+    void (*destroy)(audio_sink_t *sink);
+    audio_sink_t *next; // the APU's list, set by add_audio_sink
+};
+
+    #define BLIP_WIDTH 16 // output samples each amplitude step is spread over
+    #define BLIP_SIZE 4096 // samples a buffer holds between reads
+
+// One output channel of band-limited steps (see blip.c)
+typedef struct blip_s {
+    uint32_t rate; // output samples per second of APU clock
+    uint32_t phase; // where the frame starts within a sample, in 1/APU_CLOCK
+    int avail; // finished samples not read yet
+    int32_t integrator;
+    int32_t buf[BLIP_SIZE + BLIP_WIDTH];
+} blip_t;
+
 void throw_error(char *msg, error_t code, char *FILE, int LINE);
 void read_rom(const char *path, cpu_t *cpu);
+int load_rom_data(cpu_t *cpu, const uint8_t *data, size_t size);
+const rom_image_t *open_rom_image(const char *path);
+void close_rom_image(const rom_image_t *image);
+void close_rom(cpu_t *cpu);
 
 uint8_t read_8(cpu_t *cpu, uint16_t addr);
 void write_8(cpu_t *cpu, uint16_t addr, uint8_t val);
 uint16_t read_16(cpu_t *cpu, uint16_t addr);
 void write_16(cpu_t *cpu, uint16_t addr, uint16_t val);
 
+const mbc_t *get_mbc(cpu_t *cpu);
+void init_mbc(cpu_t *cpu);
+
+void init_memory_map(cpu_t *cpu);
+void map_rom(cpu_t *cpu);
+void map_sram(cpu_t *cpu);
+void map_vram(cpu_t *cpu);
+void map_wram(cpu_t *cpu);
+
+void init_cpu(cpu_t *cpu);
 int execute_instruction(cpu_t *cpu);
+int cpu_run(cpu_t *cpu, int budget);
+
+void init_block_cache(cpu_t *cpu);
+const decoded_op_t *get_block(cpu_t *cpu, const decoded_op_t **end);
+int page_has_code(cpu_t *cpu, const uint8_t *page);
+void invalidate_code(cpu_t *cpu, uint8_t *host);
+void get_block_stats(cpu_t *cpu, block_stats_t *stats);
+void detect_idle_loop(cpu_t *cpu, block_t *b);
+int skip_idle_loop(cpu_t *cpu, int budget);
+void print_idle_loops(cpu_t *cpu);
+
+void sync_cycles(cpu_t *cpu);
+void schedule_event(cpu_t *cpu, event_type_t type, uint64_t when);
+void cancel_event(cpu_t *cpu, event_type_t type);
+void reschedule_events(cpu_t *cpu);
+void reschedule_io(cpu_t *cpu, uint16_t address);
+void run_events(cpu_t *cpu);
+int cycles_to_next_event(cpu_t *cpu);
+int halt_cycles(cpu_t *cpu);
+void run_to_next_event(cpu_t *cpu);
+uint64_t run_frame(cpu_t *cpu, uint8_t *last_ly);
+int ppu_cycles_to_event(cpu_t *cpu);
+int timer_cycles_to_event(cpu_t *cpu);
 
 void cpu_add(cpu_t *cpu, uint8_t value);
 void cpu_add_hl(cpu_t *cpu, uint16_t val);
@@ -104,30 +392,82 @@ uint8_t cpu_res(uint8_t bit, uint8_t val);
 uint8_t cpu_set(uint8_t bit, uint8_t val);
 
 void update_graphics(cpu_t *cpu, int cycles);
-void render_background(cpu_t *cpu, uint32_t *pixels);
-void render_window(cpu_t *cpu, uint32_t *pixels);
-void render_sprites(cpu_t *cpu, uint32_t *pixels);
+void render_scanline(cpu_t *cpu, int ly);
+void init_tile_cache(cpu_t *cpu);
+void mark_tile_dirty(cpu_t *cpu, uint16_t address);
+const uint8_t *get_tile_row(cpu_t *cpu, int bank, int tile, int row, int flip);
+void update_cgb_palette(cpu_t *cpu, uint16_t address, uint8_t index);
+void update_dmg_palette(cpu_t *cpu, uint16_t address);
+void update_palettes(cpu_t *cpu);
+void set_color_correction(cpu_t *cpu, int on);
+int get_pixel_kernels(const pixel_kernels_t **list, int max);
+
+int run_headless(int argc, char **argv);
+input_step_t *load_input_script(const char *path, int *count);
+
+thread_pool_t *create_thread_pool(int workers);
+int thread_pool_size(thread_pool_t *pool);
+void run_thread_pool(thread_pool_t *pool, int count, pool_task_t task, void *ctx);
+void destroy_thread_pool(thread_pool_t *pool);
+audio_ring_t *create_audio_ring(int frames);
+void destroy_audio_ring(audio_ring_t *ring);
+int audio_ring_write(audio_ring_t *ring, const int16_t *samples, int frames);
+int audio_ring_read(audio_ring_t *ring, int16_t *out, int frames);
+int audio_ring_fill(audio_ring_t *ring);
+void get_audio_ring_stats(audio_ring_t *ring, audio_stats_t *stats);
 
 void init_display(void);
-void handle_interrupts(cpu_t *cpu);
+void cleanup_display(void);
+void get_display_stats(display_stats_t *stats);
 void update_display(cpu_t *cpu);
-void update_input(cpu_t *cpu);
+void present_display(void);
+void set_display_title(const char *text);
+int update_input(void);
+void apply_input(cpu_t *cpu);
+void set_turbo(cpu_t *cpu, uint8_t on);
+uint8_t get_turbo(void);
+
+void handle_interrupts(cpu_t *cpu);
+void set_joypad(cpu_t *cpu, uint8_t buttons);
 
-void update_timers(cpu_t *cpu, int cycles);
+void update_timers(cpu_t *cpu);
+uint8_t read_timer(cpu_t *cpu, uint16_t address);
+void write_timer(cpu_t *cpu, uint16_t address, uint8_t value);
+void update_serial(cpu_t *cpu, int cycles);
 void hdma_hblank_tick(cpu_t *cpu);
 
 void stack_push16(cpu_t *cpu, uint16_t value);
 uint16_t stack_pop16(cpu_t *cpu);
 
-void init_apu(void);
-void update_audio(int cycles);
+void init_apu(cpu_t *cpu);
+void update_audio(cpu_t *cpu, int cycles);
 void apu_write(cpu_t *cpu, uint16_t addr, uint8_t val);
-uint8_t apu_read(uint16_t addr);
-void cleanup_apu(void);
+uint8_t apu_read(cpu_t *cpu, uint16_t addr);
+void add_audio_sink(cpu_t *cpu, audio_sink_t *sink);
+void remove_audio_sink(cpu_t *cpu, audio_sink_t *sink);
+void set_audio_rate(cpu_t *cpu, int rate);
+void set_audio_mode(cpu_t *cpu, audio_mode_t mode);
+audio_mode_t get_audio_mode(cpu_t *cpu);
+void set_audio_mute(cpu_t *cpu, uint8_t mask);
+void init_audio_device(cpu_t *cpu);
+void cleanup_audio_device(cpu_t *cpu);
+void get_audio_stats(audio_stats_t *stats);
+void pause_audio_device(void);
+void blip_add_delta(blip_t *b, uint32_t time, int delta);
+void blip_end_frame(blip_t *b, uint32_t time);
+uint32_t blip_clocks_needed(const blip_t *b, int samples);
+int blip_read(blip_t *b, int16_t *out, int count, int stride);
+audio_sink_t *create_file_sink(const char *path, int wav);
+audio_sink_t *create_memory_sink(int frames);
+size_t read_memory_sink(audio_sink_t *sink, int16_t *out, size_t max_frames);
+void clear_memory_sink(audio_sink_t *sink);
+void destroy_audio_sink(audio_sink_t *sink);
 
 void init_save(const char *rom_path, cpu_t *cpu);
 void write_save(cpu_t *cpu);
 void save_state(cpu_t *cpu);
 void load_state(cpu_t *cpu);
+size_t serialize_state(cpu_t *cpu, void *buf, size_t size);
+int deserialize_state(cpu_t *cpu, const void *buf, size_t size);
 
 #endif
\ No newline at end of file
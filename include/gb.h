@@ -0,0 +1,125 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifndef GB_H
+    #define GB_H
+
+    #define GB_WIDTH 160
+    #define GB_HEIGHT 144
+    #define GB_SAMPLE_RATE 44100
+
+    // Buttons for gb_set_input, as bits of one byte
+    #define GB_RIGHT (1 << 0)
+    #define GB_LEFT (1 << 1)
+    #define GB_UP (1 << 2)
+    #define GB_DOWN (1 << 3)
+    #define GB_A (1 << 4)
+    #define GB_B (1 << 5)
+    #define GB_SELECT (1 << 6)
+    #define GB_START (1 << 7)
+
+// One emulated Game Boy. Instances share nothing mutable, so any number of
+// them can run at once as long as each is only used by one thread at a time.
+typedef struct gb_s gb_t;
+
+gb_t *gb_create(void);
+void gb_destroy(gb_t *gb);
+
+// Loads a ROM image (copied) and resets the console. Returns 0 on success.
+int gb_load_rom_from_memory(gb_t *gb, const void *data, size_t size);
+// Same, but the image is used in place: it is never written, so any number
+// of instances can share it, and it must outlive them.
+int gb_load_rom_shared(gb_t *gb, const void *data, size_t size);
+// Maps the file read-only; every instance in the process that loads the
+// same unchanged file shares the one mapping. The file must not be
+// rewritten in place while it is loaded, only replaced by a rename.
+int gb_load_rom_file(gb_t *gb, const char *path);
+
+// Runs until the next frame is complete. Returns the cycles it took.
+uint64_t gb_run_frame(gb_t *gb);
+void gb_set_input(gb_t *gb, uint8_t buttons);
+// GB_WIDTH * GB_HEIGHT ARGB8888 pixels, valid until the next gb_run_frame
+const uint32_t *gb_get_framebuffer(gb_t *gb);
+
+// Takes up to `max_frames` interleaved stereo 16-bit frames produced since
+// the last call. Returns how many were written; older ones are dropped if
+// they are not taken for a while.
+size_t gb_get_audio(gb_t *gb, int16_t *out, size_t max_frames);
+
+typedef enum {
+    GB_AUDIO_OFF,       // the APU isn't clocked: fastest, but games that
+                        // poll NR52 or wait on length counters may hang
+    GB_AUDIO_REGISTERS, // sound registers kept right, nothing mixed
+    GB_AUDIO_FULL       // the default
+} gb_audio_mode_t;
+
+void gb_set_audio_mode(gb_t *gb, gb_audio_mode_t mode);
+// Bit n silences channel n + 1; a silenced channel isn't synthesised
+void gb_set_audio_mute(gb_t *gb, uint8_t mask);
+
+// Save states. gb_serialize returns the size a state needs and only writes
+// it if `size` is enough, gb_deserialize returns 0 on success.
+size_t gb_serialize(gb_t *gb, void *buf, size_t size);
+int gb_deserialize(gb_t *gb, const void *buf, size_t size);
+
+// Cartridge RAM, NULL with a size of 0 when the cartridge has none
+uint8_t *gb_get_sram(gb_t *gb, size_t *size);
+// Link port output, dropped by default
+void gb_set_serial_output(gb_t *gb, FILE *out);
+
+// Lockstep batches for reinforcement learning: N consoles running one ROM,
+// all stepped together on a batch of actions. Audio is not mixed.
+typedef struct gb_vec_s gb_vec_t;
+
+typedef enum {
+    GB_OBS_GRAY,   // luma 0-255, averaged over each downsampled block
+    GB_OBS_PALETTE // colour index in bits 0-1, palette in 2-4, bit 5 for sprites
+} gb_obs_format_t;
+
+typedef struct {
+    int count;
+    int threads;          // 0 for one per core
+    int frame_skip;       // frames per step, the action held throughout (0 = 1)
+    int downsample;       // observations are 160/d x 144/d, d dividing 16
+    gb_obs_format_t format;
+    const uint16_t *reward_addresses; // bytes returned as rewards after each step
+    int reward_count;
+    // An episode ends after this many frames (0 for no limit), or when the
+    // byte at done_address (0 for none) equals done_value
+    uint64_t max_episode_frames;
+    uint16_t done_address;
+    uint8_t done_value;
+} gb_vec_config_t;
+
+// Where a step or reset writes its results. Instance i's observation rows
+// start at obs + i * obs_stride, obs_pitch bytes apart (0 for packed rows);
+// its rewards at rewards + i * reward_stride. Any pointer may be NULL.
+typedef struct {
+    uint8_t *obs;
+    ptrdiff_t obs_stride;
+    ptrdiff_t obs_pitch;
+    uint8_t *rewards;
+    ptrdiff_t reward_stride;
+    uint8_t *done; // one byte per instance
+} gb_vec_output_t;
+
+// The ROM image is shared by every instance and must outlive the batch.
+// NULL if the config or ROM is invalid.
+gb_vec_t *gb_vec_create(const void *rom, size_t size, const gb_vec_config_t *config);
+void gb_vec_destroy(gb_vec_t *vec);
+void gb_vec_obs_size(const gb_vec_t *vec, int *width, int *height);
+
+// Episodes start from this state (copied) instead of power-on. Returns 0
+// if it fits the ROM.
+int gb_vec_set_reset_state(gb_vec_t *vec, const void *state, size_t size);
+
+// Restarts every instance. The first observation is the frame after the
+// reset state, run with no buttons held.
+void gb_vec_reset(gb_vec_t *vec, const gb_vec_output_t *out);
+// Runs one step of every instance with its byte of `actions` (GB_* bits).
+// An instance whose episode ends reports done and is reset at once, so
+// its observation is already the first of the next episode.
+void gb_vec_step(gb_vec_t *vec, const uint8_t *actions, const gb_vec_output_t *out);
+
+#endif
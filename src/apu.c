@@ -1,11 +1,26 @@
-#include <SDL2/SDL.h>
+#include <stdlib.h>
 #include <string.h>
 #include "cpu.h"
 
-#define SAMPLE_RATE 44100
-#define BUFFER_SIZE 1024
-
-static SDL_AudioDeviceID audio_dev;
+// The APU runs on integer cycle counters and is only brought up to date
+// when it has to be: before an APU register is read or written, and when
+// enough cycles have gone by to fill the output block. update_audio itself
+// just adds to the cycles owed, so the common case costs nothing. Channels
+// don't produce samples: each change of the mixed level goes into a
+// band-limited step buffer at the cycle it happens, and the buffer is
+// resampled to the host rate when the output block is filled.
+// How much of this runs is up to the audio mode: nothing, the registers
+// only, or the waveforms and mixing too.
+
+#define SEQUENCER_PERIOD (APU_CLOCK / 512)
+#define LAZY_CYCLES (APU_CLOCK / 64) // how far behind the APU may fall with no sink
+#define MAX_AUDIO_RATE (AUDIO_SAMPLE_RATE * 4)
+
+// Every frame ends before the step buffers run out of room: a mixing one
+// once it completes the output block, any other after LAZY_CYCLES
+_Static_assert(AUDIO_BUFFER_SIZE + BLIP_WIDTH < BLIP_SIZE, "a block must fit in the step buffers");
+_Static_assert((uint64_t)LAZY_CYCLES * MAX_AUDIO_RATE / APU_CLOCK + BLIP_WIDTH < BLIP_SIZE,
+    "an unmixed frame must fit in the step buffers");
 
 static const uint8_t duty_table[4][8] = {
     {0, 0, 0, 0, 0, 0, 0, 1},
@@ -14,58 +29,62 @@ static const uint8_t duty_table[4][8] = {
     {0, 1, 1, 1, 1, 1, 1, 0},
 };
 
+static const uint8_t noise_divisors[8] = {8, 16, 32, 48, 64, 80, 96, 112};
+
+// Volume envelope shared by the pulse and noise channels
+typedef struct {
+    uint8_t volume;
+    uint8_t volume_init;
+    uint8_t dir;
+    uint8_t period;
+    uint8_t timer;
+} envelope_t;
+
 typedef struct {
     uint8_t enabled;
+    uint8_t dac_enable;
     uint8_t duty;
     uint8_t duty_pos;
     uint16_t freq;
-    float timer;
-    uint8_t volume;
-    uint8_t volume_init;
-    uint8_t envelope_dir;
-    uint8_t envelope_period;
-    float envelope_timer;
-    uint8_t length;
+    int timer; // cycles until the next duty step
+    envelope_t env;
+    uint16_t length; // steps left, clocked at 256 Hz
     uint8_t length_enable;
-    float length_timer;
+    // Channel 1 only
     uint8_t sweep_period;
     uint8_t sweep_dir;
     uint8_t sweep_shift;
-    float sweep_timer;
+    uint8_t sweep_timer;
+    uint8_t sweep_enabled;
     uint16_t sweep_freq;
 } channel_t;
 
 typedef struct {
     uint8_t enabled;
+    uint8_t dac_enable;
     uint16_t freq;
-    float timer;
+    int timer;
     uint8_t volume_shift;
     uint8_t sample_pos;
     uint8_t wave_ram[16]; // 32 4-bit samples packed into 16 bytes
     uint16_t length;
     uint8_t length_enable;
-    float length_timer;
-    uint8_t dac_enable;
 } wave_channel_t;
 
 typedef struct {
     uint8_t enabled;
-    float timer;
-    uint8_t volume;
-    uint8_t volume_init;
-    uint8_t envelope_dir;
-    uint8_t envelope_period;
-    float envelope_timer;
-    uint8_t length;
+    uint8_t dac_enable;
+    int timer;
+    envelope_t env;
+    uint16_t length;
     uint8_t length_enable;
-    float length_timer;
     uint8_t clock_shift;
     uint8_t width_mode; // 0=15-bit, 1=7-bit
     uint8_t divisor_code;
     uint16_t lfsr;
 } noise_channel_t;
 
-typedef struct {
+typedef struct apu_s {
     channel_t ch1;
     channel_t ch2;
     wave_channel_t ch3;
@@ -74,369 +93,613 @@ typedef struct {
     uint8_t left_volume;
     uint8_t right_volume;
     uint8_t ch_select;
+
+    // Cycles owed since the last catch-up, cycles run since the step
+    // buffers were last read, and the point at which they must be
+    int pending;
+    uint32_t clock;
+    uint32_t flush_at;
+    // 512 Hz frame sequencer driving length, sweep and envelope
+    int sequencer_timer;
+    uint8_t sequencer_step;
+
+    // Mixing: where samples go (none keeps the APU running without
+    // mixing), the step buffers, each channel's level and left/right gain
+    // as last put in them, and the block being filled
+    audio_sink_t *sinks;
+    int rate; // output rate taken up at the next flush
+    uint8_t mode; // an audio_mode_t
+    uint8_t mute; // bit n silences channel n + 1
+    blip_t left;
+    blip_t right;
+    int8_t level[4];
+    int16_t gain_left[4];
+    int16_t gain_right[4];
+    int16_t sample_buf[AUDIO_BUFFER_SIZE * 2];
+    int sample_pos;
 } apu_t;
 
-static apu_t apu;
+// Waveforms are only synthesised when there is somewhere for them to go
+static int is_mixing(apu_t *apu)
+{
+    return apu->mode == AUDIO_FULL && apu->sinks;
+}
+
+// When mixing, read the buffers back once they hold the rest of the block
+static void schedule_flush(apu_t *apu)
+{
+    if (is_mixing(apu))
+        apu->flush_at = blip_clocks_needed(&apu->left, AUDIO_BUFFER_SIZE - apu->sample_pos / 2);
+    else
+        apu->flush_at = LAZY_CYCLES;
+}
 
-void init_apu(void)
+void init_apu(cpu_t *cpu)
 {
-    memset(&apu, 0, sizeof(apu));
-    apu.master_enable = 1;
-    apu.left_volume = 7;
-    apu.right_volume = 7;
-    apu.ch4.lfsr = 0x7FFF;
+    if (!cpu->apu) {
+        cpu->apu = calloc(1, sizeof(apu_t));
+        if (!cpu->apu)
+            THROW("Failed to allocate the APU", INVALID_FILE);
+        cpu->apu->mode = AUDIO_FULL;
+    }
+    apu_t *apu = cpu->apu;
+    audio_sink_t *sinks = apu->sinks;
+    uint8_t mode = apu->mode;
+    uint8_t mute = apu->mute;
+
+    memset(apu, 0, sizeof(*apu));
+    apu->master_enable = 1;
+    apu->left_volume = 7;
+    apu->right_volume = 7;
+    apu->ch4.lfsr = 0x7FFF;
+    apu->sequencer_timer = SEQUENCER_PERIOD;
+    apu->sinks = sinks;
+    apu->mode = mode;
+    apu->mute = mute;
+    apu->rate = AUDIO_SAMPLE_RATE;
+    apu->left.rate = AUDIO_SAMPLE_RATE;
+    apu->right.rate = AUDIO_SAMPLE_RATE;
+    schedule_flush(apu);
+}
 
-    SDL_AudioSpec want = {0}, have;
-    want.freq = SAMPLE_RATE;
-    want.format = AUDIO_S16SYS;
-    want.channels = 2;
-    want.samples = BUFFER_SIZE;
-    want.callback = NULL;
+static void catch_up(apu_t *apu);
+static void update_mix(apu_t *apu, uint32_t time);
 
-    audio_dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
-    if (audio_dev)
-        SDL_PauseAudioDevice(audio_dev, 0);
+// Every sink added gets each mixed block, in the order they were added.
+// The caller keeps ownership.
+void add_audio_sink(cpu_t *cpu, audio_sink_t *sink)
+{
+    audio_sink_t **link;
+
+    catch_up(cpu->apu);
+    for (link = &cpu->apu->sinks; *link; link = &(*link)->next);
+    sink->next = NULL;
+    *link = sink;
+    schedule_flush(cpu->apu);
 }
 
-static void tick_channel(channel_t *ch, float dt)
+void remove_audio_sink(cpu_t *cpu, audio_sink_t *sink)
 {
-    if (!ch->enabled)
+    audio_sink_t **link;
+
+    catch_up(cpu->apu);
+    for (link = &cpu->apu->sinks; *link && *link != sink; link = &(*link)->next);
+    if (*link)
+        *link = sink->next;
+    schedule_flush(cpu->apu);
+}
+
+// AUDIO_OFF stops clocking the APU altogether, so length counters freeze
+// and NR52 keeps reporting channels that would have stopped. Games that
+// poll it need at least AUDIO_REGISTERS, which clocks the frame sequencer
+// but leaves the waveforms alone.
+void set_audio_mode(cpu_t *cpu, audio_mode_t mode)
+{
+    catch_up(cpu->apu);
+    cpu->apu->mode = mode;
+    schedule_flush(cpu->apu);
+}
+
+audio_mode_t get_audio_mode(cpu_t *cpu)
+{
+    return cpu->apu->mode;
+}
+
+// A muted channel still runs its length, sweep and envelope, but adds
+// nothing to the mix, so its waveform is never stepped
+void set_audio_mute(cpu_t *cpu, uint8_t mask)
+{
+    catch_up(cpu->apu);
+    cpu->apu->mute = mask & 0xF;
+    update_mix(cpu->apu, cpu->apu->clock);
+}
+
+// Mixes at `rate` samples per emulated second from the next block on,
+// for a consumer whose clock doesn't quite match AUDIO_SAMPLE_RATE. Safe to
+// call from a sink's write. Rates above MAX_AUDIO_RATE are ignored.
+void set_audio_rate(cpu_t *cpu, int rate)
+{
+    if (rate > 0 && rate <= MAX_AUDIO_RATE)
+        cpu->apu->rate = rate;
+}
+
+static void clock_envelope(envelope_t *env)
+{
+    if (env->period == 0 || --env->timer > 0)
         return;
-    if (ch->length_enable) {
-        ch->length_timer += dt;
-        if (ch->length_timer >= (64 - ch->length) / 256.0f) {
-            ch->enabled = 0;
-            return;
-        }
+    env->timer = env->period;
+    if (env->dir && env->volume < 15)
+        env->volume++;
+    else if (!env->dir && env->volume > 0)
+        env->volume--;
+}
+
+static void trigger_envelope(envelope_t *env)
+{
+    env->volume = env->volume_init;
+    env->timer = env->period;
+}
+
+// Frequency the sweep unit would move to next, past 2047 disables channel 1
+static uint16_t sweep_target(channel_t *ch)
+{
+    uint16_t delta = ch->sweep_freq >> ch->sweep_shift;
+    uint16_t freq = ch->sweep_dir ? ch->sweep_freq - delta : ch->sweep_freq + delta;
+
+    if (freq > 2047)
+        ch->enabled = 0;
+    return freq;
+}
+
+static void clock_sweep(channel_t *ch)
+{
+    if (--ch->sweep_timer > 0)
+        return;
+    ch->sweep_timer = ch->sweep_period ? ch->sweep_period : 8;
+    if (!ch->sweep_enabled || ch->sweep_period == 0)
+        return;
+    uint16_t freq = sweep_target(ch);
+    if (freq <= 2047 && ch->sweep_shift > 0) {
+        ch->sweep_freq = freq;
+        ch->freq = freq;
+        sweep_target(ch);
     }
-    if (ch->envelope_period > 0) {
-        ch->envelope_timer += dt;
-        float env_step = ch->envelope_period / 64.0f;
-        while (ch->envelope_timer >= env_step) {
-            ch->envelope_timer -= env_step;
-            if (ch->envelope_dir && ch->volume < 15)
-                ch->volume++;
-            else if (!ch->envelope_dir && ch->volume > 0)
-                ch->volume--;
-        }
+}
+
+static void clock_length(uint8_t *enabled, uint8_t length_enable, uint16_t *length)
+{
+    if (length_enable && *length && --*length == 0)
+        *enabled = 0;
+}
+
+// Steps 0, 2, 4 and 6 clock the length counters, 2 and 6 the sweep, 7 the
+// envelopes
+static void clock_sequencer(apu_t *apu)
+{
+    uint8_t step = apu->sequencer_step;
+
+    apu->sequencer_step = (step + 1) & 7;
+    if ((step & 1) == 0) {
+        clock_length(&apu->ch1.enabled, apu->ch1.length_enable, &apu->ch1.length);
+        clock_length(&apu->ch2.enabled, apu->ch2.length_enable, &apu->ch2.length);
+        clock_length(&apu->ch3.enabled, apu->ch3.length_enable, &apu->ch3.length);
+        clock_length(&apu->ch4.enabled, apu->ch4.length_enable, &apu->ch4.length);
     }
-    float period = (2048 - ch->freq) * 4.0f / 4194304.0f;
-    if (period > 0) {
-        ch->timer += dt;
-        while (ch->timer >= period) {
-            ch->timer -= period;
-            ch->duty_pos = (ch->duty_pos + 1) & 7;
-        }
+    if (step == 2 || step == 6)
+        clock_sweep(&apu->ch1);
+    if (step == 7) {
+        clock_envelope(&apu->ch1.env);
+        clock_envelope(&apu->ch2.env);
+        clock_envelope(&apu->ch4.env);
     }
 }
 
-static void tick_sweep(channel_t *ch, float dt)
+static int8_t sample_channel(channel_t *ch)
+{
+    if (!ch->enabled || ch->env.volume == 0)
+        return 0;
+    return duty_table[ch->duty][ch->duty_pos] ? ch->env.volume : -ch->env.volume;
+}
+
+static int8_t sample_wave(wave_channel_t *ch)
+{
+    if (!ch->enabled || ch->volume_shift == 0)
+        return 0;
+    uint8_t byte = ch->wave_ram[ch->sample_pos / 2];
+    uint8_t sample = (ch->sample_pos & 1) ? (byte & 0x0F) : (byte >> 4);
+    sample >>= (ch->volume_shift - 1);
+    return (int8_t)sample - 8;
+}
+
+static int8_t sample_noise(noise_channel_t *ch)
+{
+    if (!ch->enabled || ch->env.volume == 0)
+        return 0;
+    return (ch->lfsr & 1) ? -ch->env.volume : ch->env.volume;
+}
+
+// A waveform step moved channel `i` to `level` at `time`
+static void step_level(apu_t *apu, int i, uint32_t time, int level)
 {
-    if (ch->sweep_period == 0)
+    int delta = level - apu->level[i];
+
+    if (delta == 0)
         return;
-    ch->sweep_timer += dt;
-    float sweep_step = ch->sweep_period / 128.0f;
-    while (ch->sweep_timer >= sweep_step && ch->enabled) {
-        ch->sweep_timer -= sweep_step;
-        uint16_t delta = ch->sweep_freq >> ch->sweep_shift;
-        uint16_t new_freq = ch->sweep_dir ? ch->sweep_freq - delta : ch->sweep_freq + delta;
-        if (new_freq > 2047) {
-            ch->enabled = 0;
-        } else if (ch->sweep_shift > 0) {
-            ch->sweep_freq = new_freq;
-            ch->freq = new_freq;
-        }
+    apu->level[i] = level;
+    if (apu->gain_left[i])
+        blip_add_delta(&apu->left, time, delta * apu->gain_left[i]);
+    if (apu->gain_right[i])
+        blip_add_delta(&apu->right, time, delta * apu->gain_right[i]);
+}
+
+// Called whenever a channel's level or the mixer settings may have changed
+// at `time` other than by a waveform step: puts the change of each
+// channel's contribution to each side in the buffers
+static void update_mix(apu_t *apu, uint32_t time)
+{
+    int8_t levels[4] = {0};
+
+    if (apu->master_enable) {
+        levels[0] = sample_channel(&apu->ch1);
+        levels[1] = sample_channel(&apu->ch2);
+        levels[2] = sample_wave(&apu->ch3);
+        levels[3] = sample_noise(&apu->ch4);
+    }
+    for (int i = 0; i < 4; i++) {
+        int on = apu->master_enable && !(apu->mute & (1 << i));
+        int left = (on && (apu->ch_select & (0x10 << i))) ? (apu->left_volume + 1) * 48 : 0;
+        int right = (on && (apu->ch_select & (0x01 << i))) ? (apu->right_volume + 1) * 48 : 0;
+        int delta_left = levels[i] * left - apu->level[i] * apu->gain_left[i];
+        int delta_right = levels[i] * right - apu->level[i] * apu->gain_right[i];
+
+        if (delta_left)
+            blip_add_delta(&apu->left, time, delta_left);
+        if (delta_right)
+            blip_add_delta(&apu->right, time, delta_right);
+        apu->level[i] = levels[i];
+        apu->gain_left[i] = left;
+        apu->gain_right[i] = right;
     }
 }
 
-static void tick_wave(wave_channel_t *ch, float dt)
+// Each waveform timer holds the cycles to its next step and reloads from
+// the current frequency, so a frequency write takes effect at the end of
+// the running period. Only steps that change the output level reach the
+// mixer.
+
+// Steps `timer` over `cycles` in one go, returning how many steps it took
+static int skip_steps(int *timer, int period, int cycles)
+{
+    int steps;
+
+    *timer -= cycles;
+    if (*timer > 0)
+        return 0;
+    steps = -*timer / period + 1;
+    *timer += steps * period;
+    return steps;
+}
+
+// Volume and routing only change between spans, so a channel that is
+// silent at the start of one stays silent through it
+static int is_silent(apu_t *apu, int i, int volume)
+{
+    return volume == 0 || (!apu->gain_left[i] && !apu->gain_right[i]);
+}
+
+static void run_pulse(apu_t *apu, channel_t *ch, int i, uint32_t time, int cycles)
 {
-    if (!ch->enabled || !ch->dac_enable)
+    if (!ch->enabled)
+        return;
+    int period = (2048 - ch->freq) * 4;
+    if (is_silent(apu, i, ch->env.volume)) {
+        ch->duty_pos = (ch->duty_pos + skip_steps(&ch->timer, period, cycles)) & 7;
         return;
-    if (ch->length_enable) {
-        ch->length_timer += dt;
-        if (ch->length_timer >= (256 - ch->length) / 256.0f) {
-            ch->enabled = 0;
-            return;
-        }
     }
-    float period = (2048 - ch->freq) * 2.0f / 4194304.0f;
-    if (period > 0) {
-        ch->timer += dt;
-        while (ch->timer >= period) {
-            ch->timer -= period;
-            ch->sample_pos = (ch->sample_pos + 1) & 31;
-        }
+    while (cycles >= ch->timer) {
+        uint8_t high = duty_table[ch->duty][ch->duty_pos];
+        cycles -= ch->timer;
+        time += ch->timer;
+        ch->timer = period;
+        ch->duty_pos = (ch->duty_pos + 1) & 7;
+        if (duty_table[ch->duty][ch->duty_pos] != high)
+            step_level(apu, i, time, sample_channel(ch));
     }
+    ch->timer -= cycles;
 }
 
-static void tick_noise(noise_channel_t *ch, float dt)
+static void run_wave(apu_t *apu, wave_channel_t *ch, uint32_t time, int cycles)
 {
     if (!ch->enabled)
         return;
-    if (ch->length_enable) {
-        ch->length_timer += dt;
-        if (ch->length_timer >= (64 - ch->length) / 256.0f) {
-            ch->enabled = 0;
-            return;
-        }
+    int period = (2048 - ch->freq) * 2;
+    if (is_silent(apu, 2, ch->volume_shift)) {
+        ch->sample_pos = (ch->sample_pos + skip_steps(&ch->timer, period, cycles)) & 31;
+        return;
+    }
+    while (cycles >= ch->timer) {
+        cycles -= ch->timer;
+        time += ch->timer;
+        ch->timer = period;
+        ch->sample_pos = (ch->sample_pos + 1) & 31;
+        int8_t level = sample_wave(ch);
+        if (level != apu->level[2])
+            step_level(apu, 2, time, level);
+    }
+    ch->timer -= cycles;
+}
+
+// A silent noise channel keeps its timing but doesn't clock the LFSR
+static void run_noise(apu_t *apu, noise_channel_t *ch, uint32_t time, int cycles)
+{
+    if (!ch->enabled || ch->clock_shift >= 14)
+        return;
+    int period = noise_divisors[ch->divisor_code] << ch->clock_shift;
+    if (is_silent(apu, 3, ch->env.volume)) {
+        skip_steps(&ch->timer, period, cycles);
+        return;
+    }
+    while (cycles >= ch->timer) {
+        uint8_t out = ch->lfsr & 1;
+        uint8_t xor_bit = (ch->lfsr & 1) ^ ((ch->lfsr >> 1) & 1);
+        cycles -= ch->timer;
+        time += ch->timer;
+        ch->timer = period;
+        ch->lfsr = (ch->lfsr >> 1) | (xor_bit << 14);
+        if (ch->width_mode)
+            ch->lfsr = (ch->lfsr & ~(1 << 6)) | (xor_bit << 6);
+        if ((ch->lfsr & 1) != out)
+            step_level(apu, 3, time, sample_noise(ch));
     }
-    if (ch->envelope_period > 0) {
-        ch->envelope_timer += dt;
-        float env_step = ch->envelope_period / 64.0f;
-        while (ch->envelope_timer >= env_step) {
-            ch->envelope_timer -= env_step;
-            if (ch->envelope_dir && ch->volume < 15)
-                ch->volume++;
-            else if (!ch->envelope_dir && ch->volume > 0)
-                ch->volume--;
+    ch->timer -= cycles;
+}
+
+// Ends the step buffers' frame and moves the finished samples into the
+// output block, handing it over each time it fills
+static void flush_samples(apu_t *apu)
+{
+    blip_end_frame(&apu->left, apu->clock);
+    blip_end_frame(&apu->right, apu->clock);
+    apu->clock = 0;
+    if (!is_mixing(apu)) {
+        blip_read(&apu->left, NULL, BLIP_SIZE, 1);
+        blip_read(&apu->right, NULL, BLIP_SIZE, 1);
+    }
+    while (apu->left.avail > 0) {
+        int room = AUDIO_BUFFER_SIZE - apu->sample_pos / 2;
+        int n = blip_read(&apu->left, apu->sample_buf + apu->sample_pos, room, 2);
+        blip_read(&apu->right, apu->sample_buf + apu->sample_pos + 1, n, 2);
+        apu->sample_pos += n * 2;
+        if (apu->sample_pos >= AUDIO_BUFFER_SIZE * 2) {
+            for (audio_sink_t *sink = apu->sinks; sink; sink = sink->next)
+                sink->write(sink, apu->sample_buf, AUDIO_BUFFER_SIZE);
+            apu->sample_pos = 0;
         }
     }
-    static const uint8_t divisors[] = {8, 16, 32, 48, 64, 80, 96, 112};
-    float period = (divisors[ch->divisor_code] << ch->clock_shift) / 4194304.0f;
-    if (period > 0) {
-        ch->timer += dt;
-        while (ch->timer >= period) {
-            ch->timer -= period;
-            uint8_t xor_bit = (ch->lfsr & 1) ^ ((ch->lfsr >> 1) & 1);
-            ch->lfsr = (ch->lfsr >> 1) | (xor_bit << 14);
-            if (ch->width_mode)
-                ch->lfsr = (ch->lfsr & ~(1 << 6)) | (xor_bit << 6);
+    apu->left.rate = apu->rate;
+    apu->right.rate = apu->rate;
+    schedule_flush(apu);
+}
+
+// Runs the owed cycles in spans that end at a sequencer step or where the
+// buffers have to be read
+static void catch_up(apu_t *apu)
+{
+    int cycles = apu->pending;
+
+    apu->pending = 0;
+    if (apu->mode == AUDIO_OFF)
+        return;
+    while (cycles > 0) {
+        if (apu->clock >= apu->flush_at)
+            flush_samples(apu);
+        int span = cycles;
+        if (apu->master_enable && span > apu->sequencer_timer)
+            span = apu->sequencer_timer;
+        if ((uint32_t)span > apu->flush_at - apu->clock)
+            span = apu->flush_at - apu->clock;
+
+        // Without mixing, only the state registers can see is kept up to
+        // date
+        if (apu->master_enable && is_mixing(apu)) {
+            run_pulse(apu, &apu->ch1, 0, apu->clock, span);
+            run_pulse(apu, &apu->ch2, 1, apu->clock, span);
+            run_wave(apu, &apu->ch3, apu->clock, span);
+            run_noise(apu, &apu->ch4, apu->clock, span);
+        }
+        if (apu->master_enable)
+            apu->sequencer_timer -= span;
+        apu->clock += span;
+        cycles -= span;
+        if (apu->master_enable && apu->sequencer_timer == 0) {
+            apu->sequencer_timer = SEQUENCER_PERIOD;
+            clock_sequencer(apu);
+            update_mix(apu, apu->clock);
         }
     }
+    if (apu->clock >= apu->flush_at)
+        flush_samples(apu);
 }
 
-static int8_t sample_channel(channel_t *ch)
+void update_audio(cpu_t *cpu, int cycles)
 {
-    if (!ch->enabled || ch->volume == 0)
-        return 0;
-    return duty_table[ch->duty][ch->duty_pos] ? ch->volume : -ch->volume;
+    apu_t *apu = cpu->apu;
+
+    apu->pending += cycles;
+    if (apu->clock + apu->pending >= apu->flush_at)
+        catch_up(apu);
 }
 
-static int8_t sample_wave(wave_channel_t *ch)
+static void trigger_pulse(channel_t *ch)
 {
-    if (!ch->enabled || !ch->dac_enable || ch->volume_shift == 0)
-        return 0;
-    uint8_t byte = ch->wave_ram[ch->sample_pos / 2];
-    uint8_t sample = (ch->sample_pos & 1) ? (byte & 0x0F) : (byte >> 4);
-    sample >>= (ch->volume_shift - 1);
-    return (int8_t)sample - 8;
+    ch->enabled = ch->dac_enable;
+    if (ch->length == 0)
+        ch->length = 64;
+    ch->timer = (2048 - ch->freq) * 4;
+    trigger_envelope(&ch->env);
 }
 
-static int8_t sample_noise(noise_channel_t *ch)
+static void write_envelope(envelope_t *env, uint8_t *enabled, uint8_t *dac_enable, uint8_t val)
 {
-    if (!ch->enabled || ch->volume == 0)
-        return 0;
-    return (ch->lfsr & 1) ? -ch->volume : ch->volume;
+    env->volume_init = (val >> 4) & 0xF;
+    env->dir = (val >> 3) & 1;
+    env->period = val & 7;
+    // The DAC is off when the top five bits are clear, which silences the
+    // channel until it is triggered again
+    *dac_enable = (val & 0xF8) != 0;
+    if (!*dac_enable)
+        *enabled = 0;
 }
 
 void apu_write(cpu_t *cpu, uint16_t addr, uint8_t val)
 {
-    (void)cpu;
+    apu_t *apu = cpu->apu;
+
+    catch_up(apu);
     switch (addr) {
     // Channel 1 - Sweep
     case 0xFF10:
-        apu.ch1.sweep_period = (val >> 4) & 7;
-        apu.ch1.sweep_dir = (val >> 3) & 1;
-        apu.ch1.sweep_shift = val & 7;
+        apu->ch1.sweep_period = (val >> 4) & 7;
+        apu->ch1.sweep_dir = (val >> 3) & 1;
+        apu->ch1.sweep_shift = val & 7;
         break;
     case 0xFF11:
-        apu.ch1.duty = (val >> 6) & 3;
-        apu.ch1.length = val & 0x3F;
+        apu->ch1.duty = (val >> 6) & 3;
+        apu->ch1.length = 64 - (val & 0x3F);
         break;
     case 0xFF12:
-        apu.ch1.volume_init = (val >> 4) & 0xF;
-        apu.ch1.envelope_dir = (val >> 3) & 1;
-        apu.ch1.envelope_period = val & 7;
+        write_envelope(&apu->ch1.env, &apu->ch1.enabled, &apu->ch1.dac_enable, val);
         break;
     case 0xFF13:
-        apu.ch1.freq = (apu.ch1.freq & 0x700) | val;
+        apu->ch1.freq = (apu->ch1.freq & 0x700) | val;
         break;
     case 0xFF14:
-        apu.ch1.freq = (apu.ch1.freq & 0xFF) | ((val & 7) << 8);
-        apu.ch1.length_enable = (val >> 6) & 1;
+        apu->ch1.freq = (apu->ch1.freq & 0xFF) | ((val & 7) << 8);
+        apu->ch1.length_enable = (val >> 6) & 1;
         if (val & 0x80) {
-            apu.ch1.enabled = 1;
-            apu.ch1.volume = apu.ch1.volume_init;
-            apu.ch1.envelope_timer = 0;
-            apu.ch1.length_timer = 0;
-            apu.ch1.sweep_freq = apu.ch1.freq;
-            apu.ch1.sweep_timer = 0;
+            trigger_pulse(&apu->ch1);
+            apu->ch1.sweep_freq = apu->ch1.freq;
+            apu->ch1.sweep_timer = apu->ch1.sweep_period ? apu->ch1.sweep_period : 8;
+            apu->ch1.sweep_enabled = apu->ch1.sweep_period || apu->ch1.sweep_shift;
+            if (apu->ch1.sweep_shift)
+                sweep_target(&apu->ch1);
         }
         break;
     // Channel 2
     case 0xFF16:
-        apu.ch2.duty = (val >> 6) & 3;
-        apu.ch2.length = val & 0x3F;
+        apu->ch2.duty = (val >> 6) & 3;
+        apu->ch2.length = 64 - (val & 0x3F);
         break;
     case 0xFF17:
-        apu.ch2.volume_init = (val >> 4) & 0xF;
-        apu.ch2.envelope_dir = (val >> 3) & 1;
-        apu.ch2.envelope_period = val & 7;
+        write_envelope(&apu->ch2.env, &apu->ch2.enabled, &apu->ch2.dac_enable, val);
         break;
     case 0xFF18:
-        apu.ch2.freq = (apu.ch2.freq & 0x700) | val;
+        apu->ch2.freq = (apu->ch2.freq & 0x700) | val;
         break;
     case 0xFF19:
-        apu.ch2.freq = (apu.ch2.freq & 0xFF) | ((val & 7) << 8);
-        apu.ch2.length_enable = (val >> 6) & 1;
-        if (val & 0x80) {
-            apu.ch2.enabled = 1;
-            apu.ch2.volume = apu.ch2.volume_init;
-            apu.ch2.envelope_timer = 0;
-            apu.ch2.length_timer = 0;
-        }
+        apu->ch2.freq = (apu->ch2.freq & 0xFF) | ((val & 7) << 8);
+        apu->ch2.length_enable = (val >> 6) & 1;
+        if (val & 0x80)
+            trigger_pulse(&apu->ch2);
         break;
     // Channel 3 - Wave
     case 0xFF1A:
-        apu.ch3.dac_enable = (val >> 7) & 1;
-        if (!apu.ch3.dac_enable) apu.ch3.enabled = 0;
+        apu->ch3.dac_enable = (val >> 7) & 1;
+        if (!apu->ch3.dac_enable) apu->ch3.enabled = 0;
         break;
     case 0xFF1B:
-        apu.ch3.length = val;
+        apu->ch3.length = 256 - val;
         break;
     case 0xFF1C:
-        apu.ch3.volume_shift = (val >> 5) & 3; // 0=mute, 1=100%, 2=50%, 3=25%
+        apu->ch3.volume_shift = (val >> 5) & 3; // 0=mute, 1=100%, 2=50%, 3=25%
         break;
     case 0xFF1D:
-        apu.ch3.freq = (apu.ch3.freq & 0x700) | val;
+        apu->ch3.freq = (apu->ch3.freq & 0x700) | val;
         break;
     case 0xFF1E:
-        apu.ch3.freq = (apu.ch3.freq & 0xFF) | ((val & 7) << 8);
-        apu.ch3.length_enable = (val >> 6) & 1;
+        apu->ch3.freq = (apu->ch3.freq & 0xFF) | ((val & 7) << 8);
+        apu->ch3.length_enable = (val >> 6) & 1;
         if (val & 0x80) {
-            apu.ch3.enabled = apu.ch3.dac_enable;
-            apu.ch3.length_timer = 0;
-            apu.ch3.sample_pos = 0;
-            apu.ch3.timer = 0;
+            apu->ch3.enabled = apu->ch3.dac_enable;
+            if (apu->ch3.length == 0)
+                apu->ch3.length = 256;
+            apu->ch3.sample_pos = 0;
+            apu->ch3.timer = (2048 - apu->ch3.freq) * 2;
         }
         break;
     // Channel 4 - Noise
     case 0xFF20:
-        apu.ch4.length = val & 0x3F;
+        apu->ch4.length = 64 - (val & 0x3F);
         break;
     case 0xFF21:
-        apu.ch4.volume_init = (val >> 4) & 0xF;
-        apu.ch4.envelope_dir = (val >> 3) & 1;
-        apu.ch4.envelope_period = val & 7;
+        write_envelope(&apu->ch4.env, &apu->ch4.enabled, &apu->ch4.dac_enable, val);
         break;
     case 0xFF22:
-        apu.ch4.clock_shift = (val >> 4) & 0xF;
-        apu.ch4.width_mode = (val >> 3) & 1;
-        apu.ch4.divisor_code = val & 7;
+        apu->ch4.clock_shift = (val >> 4) & 0xF;
+        apu->ch4.width_mode = (val >> 3) & 1;
+        apu->ch4.divisor_code = val & 7;
         break;
     case 0xFF23:
-        apu.ch4.length_enable = (val >> 6) & 1;
+        apu->ch4.length_enable = (val >> 6) & 1;
         if (val & 0x80) {
-            apu.ch4.enabled = 1;
-            apu.ch4.volume = apu.ch4.volume_init;
-            apu.ch4.envelope_timer = 0;
-            apu.ch4.length_timer = 0;
-            apu.ch4.lfsr = 0x7FFF;
-            apu.ch4.timer = 0;
+            apu->ch4.enabled = apu->ch4.dac_enable;
+            if (apu->ch4.length == 0)
+                apu->ch4.length = 64;
+            trigger_envelope(&apu->ch4.env);
+            apu->ch4.lfsr = 0x7FFF;
+            apu->ch4.timer = noise_divisors[apu->ch4.divisor_code] << apu->ch4.clock_shift;
         }
         break;
     // Master control
     case 0xFF24:
-        apu.left_volume = (val >> 4) & 7;
-        apu.right_volume = val & 7;
+        apu->left_volume = (val >> 4) & 7;
+        apu->right_volume = val & 7;
         break;
     case 0xFF25:
-        apu.ch_select = val;
+        apu->ch_select = val;
         break;
     case 0xFF26:
-        apu.master_enable = (val >> 7) & 1;
-        if (!apu.master_enable) {
-            apu.ch1.enabled = 0;
-            apu.ch2.enabled = 0;
-            apu.ch3.enabled = 0;
-            apu.ch4.enabled = 0;
+        if ((val & 0x80) && !apu->master_enable) {
+            // Powering on restarts the frame sequencer
+            apu->sequencer_timer = SEQUENCER_PERIOD;
+            apu->sequencer_step = 0;
+        }
+        apu->master_enable = (val >> 7) & 1;
+        if (!apu->master_enable) {
+            apu->ch1.enabled = 0;
+            apu->ch2.enabled = 0;
+            apu->ch3.enabled = 0;
+            apu->ch4.enabled = 0;
         }
         break;
     default:
         // Wave RAM (0xFF30-0xFF3F)
         if (addr >= 0xFF30 && addr <= 0xFF3F)
-            apu.ch3.wave_ram[addr - 0xFF30] = val;
+            apu->ch3.wave_ram[addr - 0xFF30] = val;
         break;
     }
+    update_mix(apu, apu->clock);
 }
 
-uint8_t apu_read(uint16_t addr)
+uint8_t apu_read(cpu_t *cpu, uint16_t addr)
 {
+    apu_t *apu = cpu->apu;
+
+    catch_up(apu);
     switch (addr) {
     case 0xFF26: {
-        uint8_t status = (apu.master_enable << 7) | 0x70;
-        if (apu.ch1.enabled) status |= 0x01;
-        if (apu.ch2.enabled) status |= 0x02;
-        if (apu.ch3.enabled) status |= 0x04;
-        if (apu.ch4.enabled) status |= 0x08;
+        uint8_t status = (apu->master_enable << 7) | 0x70;
+        if (apu->ch1.enabled) status |= 0x01;
+        if (apu->ch2.enabled) status |= 0x02;
+        if (apu->ch3.enabled) status |= 0x04;
+        if (apu->ch4.enabled) status |= 0x08;
         return status;
     }
-    case 0xFF25: return apu.ch_select;
-    case 0xFF24: return (apu.left_volume << 4) | apu.right_volume;
+    case 0xFF25: return apu->ch_select;
+    case 0xFF24: return (apu->left_volume << 4) | apu->right_volume;
     default:
         if (addr >= 0xFF30 && addr <= 0xFF3F)
-            return apu.ch3.wave_ram[addr - 0xFF30];
+            return apu->ch3.wave_ram[addr - 0xFF30];
         return 0xFF;
     }
 }
-
-void update_audio(int cycles)
-{
-    if (!audio_dev || !apu.master_enable)
-        return;
-
-    float dt = cycles / 4194304.0f;
-
-    tick_channel(&apu.ch1, dt);
-    tick_sweep(&apu.ch1, dt);
-    tick_channel(&apu.ch2, dt);
-    tick_wave(&apu.ch3, dt);
-    tick_noise(&apu.ch4, dt);
-
-    static float sample_timer = 0;
-    static int16_t sample_buf[BUFFER_SIZE * 2];
-    static int sample_pos = 0;
-
-    sample_timer += dt;
-    float sample_period = 1.0f / SAMPLE_RATE;
-
-    while (sample_timer >= sample_period) {
-        sample_timer -= sample_period;
-
-        int8_t s1 = sample_channel(&apu.ch1);
-        int8_t s2 = sample_channel(&apu.ch2);
-        int8_t s3 = sample_wave(&apu.ch3);
-        int8_t s4 = sample_noise(&apu.ch4);
-
-        int16_t left = 0, right = 0;
-        if (apu.ch_select & 0x10) left += s1;
-        if (apu.ch_select & 0x01) right += s1;
-        if (apu.ch_select & 0x20) left += s2;
-        if (apu.ch_select & 0x02) right += s2;
-        if (apu.ch_select & 0x40) left += s3;
-        if (apu.ch_select & 0x04) right += s3;
-        if (apu.ch_select & 0x80) left += s4;
-        if (apu.ch_select & 0x08) right += s4;
-
-        left = left * (apu.left_volume + 1) * 48;
-        right = right * (apu.right_volume + 1) * 48;
-
-        sample_buf[sample_pos++] = left;
-        sample_buf[sample_pos++] = right;
-
-        if (sample_pos >= BUFFER_SIZE * 2) {
-            if (SDL_GetQueuedAudioSize(audio_dev) < BUFFER_SIZE * 4 * 4)
-                SDL_QueueAudio(audio_dev, sample_buf, sample_pos * sizeof(int16_t));
-            sample_pos = 0;
-        }
-    }
-}
-
-void cleanup_apu(void)
-{
-    if (audio_dev) {
-        SDL_CloseAudioDevice(audio_dev);
-        audio_dev = 0;
-    }
-}
@@ -0,0 +1,158 @@
+#include <SDL2/SDL.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+
+// Mixed audio goes from the emulation thread to SDL's callback through a
+// lock-free ring. Neither side waits on the other: the device's clock never
+// quite matches the emulated one, so instead of dropping blocks the APU is
+// asked to mix slightly faster or slower, in proportion to how far the
+// ring's fill is from the latency target (GB_AUDIO_LATENCY, in ms).
+#define DEFAULT_LATENCY_MS 40
+#define DEVICE_FRAMES 512 // asked of the ring per callback
+#define MAX_RATE_DELTA 0.005 // at most half a percent, about 9 cents of pitch
+
+static SDL_AudioDeviceID audio_dev;
+static audio_ring_t *ring = NULL;
+static int target_fill;
+static int started = 0;
+static atomic_int current_rate = AUDIO_SAMPLE_RATE;
+
+static void play_samples(void *data, Uint8 *stream, int len)
+{
+    (void)data;
+    audio_ring_read(ring, (int16_t *)stream, len / (2 * sizeof(int16_t)));
+}
+
+// Device sink: the producer end of the ring, and the rate control
+typedef struct {
+    audio_sink_t sink;
+    cpu_t *cpu;
+} device_sink_t;
+
+static device_sink_t device_sink;
+static audio_sink_t *recording = NULL;
+
+static void queue_samples(audio_sink_t *sink, const int16_t *samples, int frames)
+{
+    cpu_t *cpu = ((device_sink_t *)sink)->cpu;
+
+    audio_ring_write(ring, samples, frames);
+
+    // The device starts once the ring holds the target, so it doesn't
+    // begin with a string of underruns
+    int fill = audio_ring_fill(ring);
+    if (!started && fill >= target_fill) {
+        SDL_PauseAudioDevice(audio_dev, 0);
+        started = 1;
+    }
+    if (!started)
+        return;
+
+    // Fill sawtooths by a block as blocks land; steer its midpoint
+    double error = (double)(target_fill - (fill - frames / 2)) / target_fill;
+    if (error > 1)
+        error = 1;
+    if (error < -1)
+        error = -1;
+    int rate = AUDIO_SAMPLE_RATE * (1 + MAX_RATE_DELTA * error) + 0.5;
+    set_audio_rate(cpu, rate);
+    atomic_store_explicit(&current_rate, rate, memory_order_relaxed);
+}
+
+static int latency_frames(void)
+{
+    const char *env = getenv("GB_AUDIO_LATENCY");
+    int ms = env ? atoi(env) : DEFAULT_LATENCY_MS;
+    int frames = (int64_t)ms * AUDIO_SAMPLE_RATE / 1000;
+
+    // Blocks land AUDIO_BUFFER_SIZE frames at a time, so a lower target
+    // couldn't be held
+    if (frames < AUDIO_BUFFER_SIZE + DEVICE_FRAMES)
+        frames = AUDIO_BUFFER_SIZE + DEVICE_FRAMES;
+    return frames;
+}
+
+// GB_AUDIO_RECORD=FILE also writes everything that is mixed to FILE, as
+// WAV if the name ends in .wav and raw PCM otherwise. Rate control applies
+// to it too, so headless --dump-audio is the one for exact comparisons.
+static void start_recording(cpu_t *cpu)
+{
+    const char *path = getenv("GB_AUDIO_RECORD");
+    size_t len = path ? strlen(path) : 0;
+
+    if (!path || !*path)
+        return;
+    recording = create_file_sink(path, len >= 4 && strcmp(path + len - 4, ".wav") == 0);
+    if (recording)
+        add_audio_sink(cpu, recording);
+    else
+        fprintf(stderr, "%s: couldn't start recording\n", path);
+}
+
+void init_audio_device(cpu_t *cpu)
+{
+    SDL_AudioSpec want = {0}, have;
+
+    start_recording(cpu);
+
+    target_fill = latency_frames();
+    ring = create_audio_ring(target_fill * 2 + AUDIO_BUFFER_SIZE);
+    if (!ring)
+        return;
+    want.freq = AUDIO_SAMPLE_RATE;
+    want.format = AUDIO_S16SYS;
+    want.channels = 2;
+    want.samples = DEVICE_FRAMES;
+    want.callback = play_samples;
+
+    audio_dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
+    if (audio_dev) {
+        device_sink.sink.write = queue_samples;
+        device_sink.cpu = cpu;
+        add_audio_sink(cpu, &device_sink.sink);
+    } else {
+        destroy_audio_ring(ring);
+        ring = NULL;
+    }
+}
+
+void cleanup_audio_device(cpu_t *cpu)
+{
+    if (recording) {
+        remove_audio_sink(cpu, recording);
+        destroy_audio_sink(recording);
+        recording = NULL;
+    }
+    if (audio_dev) {
+        remove_audio_sink(cpu, &device_sink.sink);
+        set_audio_rate(cpu, AUDIO_SAMPLE_RATE);
+        SDL_CloseAudioDevice(audio_dev);
+        audio_dev = 0;
+        started = 0;
+        destroy_audio_ring(ring);
+        ring = NULL;
+    }
+}
+
+// Stops playback, as when nothing is being mixed for a while; it starts
+// again once the ring is back up to the target
+void pause_audio_device(void)
+{
+    if (audio_dev && started) {
+        SDL_PauseAudioDevice(audio_dev, 1);
+        started = 0;
+    }
+}
+
+void get_audio_stats(audio_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    if (!ring)
+        return;
+    get_audio_ring_stats(ring, stats);
+    stats->target = target_fill;
+    stats->rate = atomic_load_explicit(&current_rate, memory_order_relaxed);
+}
@@ -0,0 +1,241 @@
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+
+// Audio sinks that don't need SDL: a file writer for capturing the exact
+// mixed output, and an in-memory buffer for the library to read from. The
+// device sink lives in audio_sdl.c.
+
+// The file sink hands blocks to a writer thread through a lock-free ring,
+// so a slow disk never stalls the emulation, and writes them out
+// CHUNK_FRAMES at a time. The ring holds about 6 s of audio; a headless
+// run outpacing the disk by more than that loses blocks, and says so.
+#define CHUNK_FRAMES 16384
+#define FILE_RING_FRAMES (1 << 18)
+#define WAV_HEADER_SIZE 44
+
+typedef struct {
+    audio_sink_t sink;
+    FILE *file;
+    char *path;
+    int wav;
+    uint64_t frames_written; // by the writer thread
+    audio_ring_t *ring;
+    pthread_t writer;
+    sem_t wake;
+    atomic_int stop;
+    int16_t chunk[CHUNK_FRAMES * 2];
+} file_sink_t;
+
+static void put_u16(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put_u32(uint8_t *p, uint32_t v)
+{
+    put_u16(p, v);
+    put_u16(p + 2, v >> 16);
+}
+
+// 16-bit stereo PCM at AUDIO_SAMPLE_RATE, holding `frames`
+static void make_wav_header(uint8_t *h, uint64_t frames)
+{
+    uint64_t bytes = frames * 4;
+    uint32_t data = bytes > UINT32_MAX - 36 ? UINT32_MAX - 36 : bytes;
+
+    memcpy(h, "RIFF", 4);
+    put_u32(h + 4, 36 + data);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    put_u32(h + 16, 16);
+    put_u16(h + 20, 1);
+    put_u16(h + 22, 2);
+    put_u32(h + 24, AUDIO_SAMPLE_RATE);
+    put_u32(h + 28, AUDIO_SAMPLE_RATE * 4);
+    put_u16(h + 32, 4);
+    put_u16(h + 34, 16);
+    memcpy(h + 36, "data", 4);
+    put_u32(h + 40, data);
+}
+
+static void *write_file_sink(void *arg)
+{
+    file_sink_t *fs = arg;
+
+    for (;;) {
+        sem_wait(&fs->wake);
+        int stop = atomic_load(&fs->stop);
+        int fill = audio_ring_fill(fs->ring);
+        // Only whole chunks until the end, when the rest goes too
+        while (fill >= CHUNK_FRAMES || (stop && fill > 0)) {
+            int n = fill < CHUNK_FRAMES ? fill : CHUNK_FRAMES;
+            audio_ring_read(fs->ring, fs->chunk, n);
+            fwrite(fs->chunk, 4, n, fs->file);
+            fs->frames_written += n;
+            fill -= n;
+        }
+        if (stop)
+            return NULL;
+    }
+}
+
+static void file_sink_write(audio_sink_t *sink, const int16_t *samples, int frames)
+{
+    file_sink_t *fs = (file_sink_t *)sink;
+
+    audio_ring_write(fs->ring, samples, frames);
+    if (audio_ring_fill(fs->ring) >= CHUNK_FRAMES)
+        sem_post(&fs->wake);
+}
+
+static void file_sink_destroy(audio_sink_t *sink)
+{
+    file_sink_t *fs = (file_sink_t *)sink;
+    audio_stats_t stats;
+
+    atomic_store(&fs->stop, 1);
+    sem_post(&fs->wake);
+    pthread_join(fs->writer, NULL);
+    if (fs->wav) {
+        uint8_t header[WAV_HEADER_SIZE];
+        make_wav_header(header, fs->frames_written);
+        fseek(fs->file, 0, SEEK_SET);
+        fwrite(header, 1, sizeof(header), fs->file);
+    }
+    get_audio_ring_stats(fs->ring, &stats);
+    if (stats.overruns)
+        fprintf(stderr, "%s: the disk fell behind, %u blocks were cut short\n",
+            fs->path, stats.overruns);
+    fclose(fs->file);
+    sem_destroy(&fs->wake);
+    destroy_audio_ring(fs->ring);
+    free(fs->path);
+    free(fs);
+}
+
+// Writes 16-bit little-endian stereo at AUDIO_SAMPLE_RATE, as a WAV file
+// or, with `wav` clear, raw. NULL if the file can't be created.
+audio_sink_t *create_file_sink(const char *path, int wav)
+{
+    file_sink_t *fs = calloc(1, sizeof(file_sink_t));
+
+    if (!fs)
+        return NULL;
+    fs->wav = wav;
+    fs->path = strdup(path);
+    fs->file = fopen(path, "wb");
+    fs->ring = create_audio_ring(FILE_RING_FRAMES);
+    if (!fs->path || !fs->file || !fs->ring || sem_init(&fs->wake, 0, 0) != 0) {
+        if (fs->file)
+            fclose(fs->file);
+        destroy_audio_ring(fs->ring);
+        free(fs->path);
+        free(fs);
+        return NULL;
+    }
+    // Sizes are filled in when the sink is destroyed
+    if (wav) {
+        uint8_t header[WAV_HEADER_SIZE];
+        make_wav_header(header, 0);
+        fwrite(header, 1, sizeof(header), fs->file);
+    }
+    if (pthread_create(&fs->writer, NULL, write_file_sink, fs) != 0) {
+        fclose(fs->file);
+        sem_destroy(&fs->wake);
+        destroy_audio_ring(fs->ring);
+        free(fs->path);
+        free(fs);
+        return NULL;
+    }
+    fs->sink.write = file_sink_write;
+    fs->sink.destroy = file_sink_destroy;
+    return &fs->sink;
+}
+
+// The memory sink keeps the latest `size` frames for whoever reads them on
+// the same thread, dropping the oldest when it is not read for a while
+typedef struct {
+    audio_sink_t sink;
+    int16_t *data;
+    size_t size;
+    size_t head;
+    size_t count;
+} memory_sink_t;
+
+static void memory_sink_write(audio_sink_t *sink, const int16_t *samples, int frames)
+{
+    memory_sink_t *ms = (memory_sink_t *)sink;
+    size_t n = frames;
+
+    if (n > ms->size) {
+        samples += (n - ms->size) * 2;
+        n = ms->size;
+    }
+    size_t tail = (ms->head + ms->count) % ms->size;
+    size_t first = ms->size - tail < n ? ms->size - tail : n;
+    memcpy(ms->data + tail * 2, samples, first * 4);
+    memcpy(ms->data, samples + first * 2, (n - first) * 4);
+    ms->count += n;
+    if (ms->count > ms->size) {
+        ms->head = (ms->head + ms->count - ms->size) % ms->size;
+        ms->count = ms->size;
+    }
+}
+
+static void memory_sink_destroy(audio_sink_t *sink)
+{
+    memory_sink_t *ms = (memory_sink_t *)sink;
+
+    free(ms->data);
+    free(ms);
+}
+
+audio_sink_t *create_memory_sink(int frames)
+{
+    memory_sink_t *ms = calloc(1, sizeof(memory_sink_t));
+
+    if (!ms)
+        return NULL;
+    ms->data = malloc((size_t)frames * 4);
+    if (!ms->data) {
+        free(ms);
+        return NULL;
+    }
+    ms->size = frames;
+    ms->sink.write = memory_sink_write;
+    ms->sink.destroy = memory_sink_destroy;
+    return &ms->sink;
+}
+
+// Takes up to `max_frames` of the oldest frames. Returns how many.
+size_t read_memory_sink(audio_sink_t *sink, int16_t *out, size_t max_frames)
+{
+    memory_sink_t *ms = (memory_sink_t *)sink;
+    size_t n = ms->count < max_frames ? ms->count : max_frames;
+    size_t first = ms->size - ms->head < n ? ms->size - ms->head : n;
+
+    memcpy(out, ms->data + ms->head * 2, first * 4);
+    memcpy(out + first * 2, ms->data, (n - first) * 4);
+    ms->head = (ms->head + n) % ms->size;
+    ms->count -= n;
+    return n;
+}
+
+void clear_memory_sink(audio_sink_t *sink)
+{
+    memory_sink_t *ms = (memory_sink_t *)sink;
+
+    ms->head = 0;
+    ms->count = 0;
+}
+
+void destroy_audio_sink(audio_sink_t *sink)
+{
+    if (sink)
+        sink->destroy(sink);
+}
@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "cpu.h"
+#include "gb.h"
+
+// Runs a manifest of short sessions across every core, each on its own
+// console, and reports a result line per job:
+//   ./emulator-batch [-j threads] [-o dir] manifest
+// Manifest lines are "<rom> <frames> [state=FILE] [input=FILE]", '#' starts
+// a comment. Each ROM is mapped once and shared by every job that runs it.
+// With -o, each job's cartridge RAM and link port output are written to
+// dir/job-N.sram and dir/job-N.serial.
+
+typedef struct {
+    int line;
+    char *path;
+    const rom_image_t *rom; // NULL if it couldn't be opened
+    uint64_t frames;
+    char *state_path;
+    char *input_path;
+
+    // Results
+    uint64_t hash;
+    uint64_t cycles;
+    double seconds;
+    double cpu_seconds; // less than `seconds` when threads share a core
+    const char *error;
+} job_t;
+
+typedef struct {
+    job_t *jobs;
+    int job_count;
+    gb_t **consoles; // one per worker, reused from job to job
+    const char *out_dir;
+} batch_t;
+
+static double now_seconds(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint8_t *read_file(const char *path, size_t *size)
+{
+    FILE *f = fopen(path, "rb");
+    uint8_t *data = NULL;
+
+    if (!f)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if (len > 0 && (data = malloc(len)) && fread(data, 1, len, f) != (size_t)len) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    *size = len > 0 ? len : 0;
+    return data;
+}
+
+static void write_file(const char *path, const void *data, size_t size)
+{
+    FILE *f = fopen(path, "wb");
+
+    if (f) {
+        fwrite(data, 1, size, f);
+        fclose(f);
+    }
+}
+
+// FNV-1a over the ARGB pixels
+static uint64_t hash_frame(const uint32_t *fb)
+{
+    uint64_t h = 1469598103934665603ULL;
+
+    for (int i = 0; i < GB_WIDTH * GB_HEIGHT; i++) {
+        h ^= fb[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Jobs of one ROM share a single mapping, held until the end of the batch
+static const rom_image_t *get_rom(const char *path)
+{
+    const rom_image_t *rom = open_rom_image(path);
+
+    if (!rom)
+        fprintf(stderr, "%s: couldn't read the ROM\n", path);
+    return rom;
+}
+
+static int load_manifest(batch_t *b, const char *path)
+{
+    FILE *f = fopen(path, "r");
+    char buf[1024];
+    int line = 0;
+
+    if (!f) {
+        fprintf(stderr, "%s: couldn't read the manifest\n", path);
+        return 0;
+    }
+    while (fgets(buf, sizeof(buf), f)) {
+        char *save, *rom = strtok_r(buf, " \t\r\n", &save);
+        char *frames = strtok_r(NULL, " \t\r\n", &save);
+
+        line++;
+        if (!rom || rom[0] == '#')
+            continue;
+        if (!frames || strtoull(frames, NULL, 10) == 0) {
+            fprintf(stderr, "%s:%d: expected \"<rom> <frames> [state=FILE] [input=FILE]\"\n", path, line);
+            fclose(f);
+            return 0;
+        }
+        b->jobs = realloc(b->jobs, (b->job_count + 1) * sizeof(job_t));
+        if (!b->jobs)
+            THROW("Failed to allocate the job list", INVALID_FILE);
+        job_t *job = &b->jobs[b->job_count++];
+        memset(job, 0, sizeof(*job));
+        job->line = line;
+        job->path = strdup(rom);
+        job->rom = get_rom(rom);
+        job->frames = strtoull(frames, NULL, 10);
+        for (char *opt = strtok_r(NULL, " \t\r\n", &save); opt; opt = strtok_r(NULL, " \t\r\n", &save)) {
+            if (strncmp(opt, "state=", 6) == 0)
+                job->state_path = strdup(opt + 6);
+            else if (strncmp(opt, "input=", 6) == 0)
+                job->input_path = strdup(opt + 6);
+            else
+                fprintf(stderr, "%s:%d: ignoring '%s'\n", path, line, opt);
+        }
+    }
+    fclose(f);
+    return 1;
+}
+
+static const char *run_job(batch_t *b, job_t *job, gb_t *gb, int index)
+{
+    const rom_image_t *rom = job->rom;
+    char path[1024];
+    FILE *serial = NULL;
+    input_step_t *steps = NULL;
+    int step_count = 0, next_step = 0;
+
+    if (!rom || gb_load_rom_shared(gb, rom->data, rom->size) != 0)
+        return "bad rom";
+    if (job->state_path) {
+        size_t size;
+        uint8_t *state = read_file(job->state_path, &size);
+        int failed = !state || gb_deserialize(gb, state, size) != 0;
+        free(state);
+        if (failed)
+            return "bad state";
+    }
+    if (job->input_path) {
+        steps = load_input_script(job->input_path, &step_count);
+        if (step_count < 0)
+            return "bad input";
+    }
+    if (b->out_dir) {
+        snprintf(path, sizeof(path), "%s/job-%d.serial", b->out_dir, index);
+        serial = fopen(path, "wb");
+    }
+    gb_set_serial_output(gb, serial);
+
+    for (uint64_t frame = 0; frame < job->frames; frame++) {
+        while (next_step < step_count && steps[next_step].frame <= frame)
+            gb_set_input(gb, steps[next_step++].buttons);
+        job->cycles += gb_run_frame(gb);
+    }
+    job->hash = hash_frame(gb_get_framebuffer(gb));
+
+    if (b->out_dir) {
+        size_t size;
+        uint8_t *sram = gb_get_sram(gb, &size);
+        snprintf(path, sizeof(path), "%s/job-%d.sram", b->out_dir, index);
+        if (sram)
+            write_file(path, sram, size);
+    }
+    gb_set_serial_output(gb, NULL);
+    if (serial)
+        fclose(serial);
+    free(steps);
+    return NULL;
+}
+
+static void job_task(void *ctx, int index, int worker)
+{
+    batch_t *b = ctx;
+    job_t *job = &b->jobs[index];
+
+    if (!b->consoles[worker])
+        b->consoles[worker] = gb_create();
+    if (!b->consoles[worker]) {
+        job->error = "out of memory";
+        return;
+    }
+    double start = now_seconds(CLOCK_MONOTONIC);
+    double cpu_start = now_seconds(CLOCK_THREAD_CPUTIME_ID);
+    job->error = run_job(b, job, b->consoles[worker], index);
+    job->seconds = now_seconds(CLOCK_MONOTONIC) - start;
+    job->cpu_seconds = now_seconds(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+}
+
+int main(int argc, char **argv)
+{
+    batch_t b = {0};
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+
+    while ((opt = getopt(argc, argv, "j:o:")) != -1) {
+        if (opt == 'j')
+            threads = atoi(optarg);
+        else if (opt == 'o')
+            b.out_dir = optarg;
+        else
+            optind = argc + 1;
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-j threads] [-o dir] manifest\n", argv[0]);
+        return 1;
+    }
+    if (!load_manifest(&b, argv[optind]))
+        return 1;
+
+    thread_pool_t *pool = create_thread_pool(threads < 1 ? 1 : threads);
+    if (!pool)
+        THROW("Failed to start the thread pool", INVALID_FILE);
+    threads = thread_pool_size(pool);
+    b.consoles = calloc(threads, sizeof(gb_t *));
+    if (!b.consoles)
+        THROW("Failed to allocate the consoles", INVALID_FILE);
+
+    double start = now_seconds(CLOCK_MONOTONIC);
+    run_thread_pool(pool, b.job_count, job_task, &b);
+    double wall = now_seconds(CLOCK_MONOTONIC) - start;
+
+    uint64_t total_frames = 0;
+    double busy = 0;
+    int failed = 0;
+    printf("%-5s %-24s %8s %-16s %9s %8s\n", "job", "rom", "frames", "hash", "wall_ms", "fps");
+    for (int i = 0; i < b.job_count; i++) {
+        job_t *job = &b.jobs[i];
+        const char *name = strrchr(job->path, '/');
+
+        name = name ? name + 1 : job->path;
+        if (job->error) {
+            printf("%-5d %-24s %8llu %s (manifest line %d)\n", i, name,
+                (unsigned long long)job->frames, job->error, job->line);
+            failed++;
+            continue;
+        }
+        printf("%-5d %-24s %8llu %016llx %9.1f %8.0f\n", i, name,
+            (unsigned long long)job->frames, (unsigned long long)job->hash,
+            job->seconds * 1000, job->frames / job->seconds);
+        total_frames += job->frames;
+        busy += job->cpu_seconds;
+    }
+    fprintf(stderr, "%d jobs (%d failed), %llu frames in %.3fs on %d threads: "
+        "%.0f FPS, %.2f cores busy\n", b.job_count, failed,
+        (unsigned long long)total_frames, wall, threads,
+        total_frames / wall, busy / wall);
+
+    for (int i = 0; i < threads; i++)
+        gb_destroy(b.consoles[i]);
+    free(b.consoles);
+    for (int i = 0; i < b.job_count; i++) {
+        close_rom_image(b.jobs[i].rom);
+        free(b.jobs[i].path);
+        free(b.jobs[i].state_path);
+        free(b.jobs[i].input_path);
+    }
+    free(b.jobs);
+    destroy_thread_pool(pool);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,106 @@
+#include <assert.h>
+#include <string.h>
+#include "cpu.h"
+
+// Band-limited step buffer. The APU adds amplitude changes at the cycle
+// they happen, each one spread over BLIP_WIDTH output samples by a
+// windowed-sinc step, and reads the running sum back at the host rate.
+// Nothing is point-sampled, so square edges alias far less.
+// The host rate can change from one frame to the next, which is how the
+// output gets stretched to keep up with an audio device's clock.
+
+#define CLOCK_BITS 22 // APU_CLOCK is 1 << CLOCK_BITS
+#define PHASE_BITS 5
+#define DELTA_BITS 14
+
+_Static_assert(APU_CLOCK == 1 << CLOCK_BITS, "the APU clock must be a power of two");
+
+// Step derivative for each of 32 sub-sample positions, each row summing to
+// 1 << DELTA_BITS: a sinc cut off at 0.8 of Nyquist under a Blackman
+// window, integrated over each output sample
+static const int16_t blip_kernel[1 << PHASE_BITS][BLIP_WIDTH] = {
+    {-2, -6, 72, -226, 373, -185, -990, 9156, 9156, -990, -185, 373, -226, 72, -6, -2},
+    {-2, -8, 73, -217, 336, -98, -1132, 8830, 9470, -832, -275, 410, -234, 70, -5, -2},
+    {-1, -9, 73, -208, 299, -14, -1258, 8493, 9768, -659, -367, 445, -240, 68, -3, -3},
+    {-1, -10, 72, -197, 261, 66, -1369, 8145, 10052, -469, -462, 479, -245, 66, -1, -3},
+    {-1, -11, 72, -186, 223, 142, -1464, 7788, 10319, -264, -557, 511, -248, 62, 1, -3},
+    {-1, -11, 70, -174, 186, 214, -1544, 7423, 10570, -44, -654, 542, -250, 58, 3, -4},
+    {0, -12, 69, -161, 149, 281, -1610, 7052, 10800, 192, -750, 570, -251, 54, 5, -4},
+    {0, -12, 67, -149, 113, 343, -1661, 6675, 11013, 443, -846, 596, -249, 48, 8, -5},
+    {0, -12, 64, -135, 78, 400, -1699, 6295, 11205, 708, -941, 619, -246, 42, 11, -5},
+    {0, -12, 62, -122, 44, 452, -1723, 5912, 11378, 987, -1034, 638, -241, 35, 14, -6},
+    {0, -12, 59, -109, 12, 498, -1734, 5529, 11527, 1280, -1125, 655, -234, 28, 17, -7},
+    {0, -12, 55, -95, -19, 539, -1734, 5145, 11658, 1585, -1212, 667, -225, 19, 20, -7},
+    {0, -12, 52, -82, -49, 575, -1721, 4763, 11763, 1902, -1295, 676, -213, 10, 23, -8},
+    {0, -11, 49, -69, -76, 606, -1698, 4384, 11842, 2231, -1373, 680, -200, 0, 27, -8},
+    {0, -11, 45, -57, -102, 631, -1665, 4008, 11905, 2569, -1446, 680, -185, -10, 31, -9},
+    {0, -10, 41, -44, -126, 651, -1623, 3638, 11940, 2917, -1512, 675, -167, -21, 34, -9},
+    {0, -10, 38, -32, -147, 665, -1571, 3274, 11950, 3274, -1571, 665, -147, -32, 38, -10},
+    {0, -9, 34, -21, -167, 675, -1512, 2917, 11940, 3638, -1623, 651, -126, -44, 41, -10},
+    {0, -9, 31, -10, -185, 680, -1446, 2569, 11905, 4008, -1665, 631, -102, -57, 45, -11},
+    {0, -8, 27, 0, -200, 680, -1373, 2231, 11842, 4384, -1698, 606, -76, -69, 49, -11},
+    {0, -8, 23, 10, -213, 676, -1295, 1902, 11763, 4763, -1721, 575, -49, -82, 52, -12},
+    {0, -7, 20, 19, -225, 667, -1212, 1585, 11658, 5145, -1734, 539, -19, -95, 55, -12},
+    {0, -7, 17, 28, -234, 655, -1125, 1280, 11527, 5529, -1734, 498, 12, -109, 59, -12},
+    {0, -6, 14, 35, -241, 638, -1034, 987, 11378, 5912, -1723, 452, 44, -122, 62, -12},
+    {0, -5, 11, 42, -246, 619, -941, 708, 11205, 6295, -1699, 400, 78, -135, 64, -12},
+    {0, -5, 8, 48, -249, 596, -846, 443, 11013, 6675, -1661, 343, 113, -149, 67, -12},
+    {0, -4, 5, 54, -251, 570, -750, 192, 10800, 7052, -1610, 281, 149, -161, 69, -12},
+    {0, -4, 3, 58, -250, 542, -654, -44, 10569, 7423, -1544, 214, 186, -174, 70, -11},
+    {0, -3, 1, 62, -248, 511, -557, -264, 10318, 7788, -1464, 142, 223, -186, 72, -11},
+    {0, -3, -1, 66, -245, 479, -462, -469, 10051, 8145, -1369, 66, 261, -197, 72, -10},
+    {0, -3, -3, 68, -240, 445, -367, -659, 9767, 8493, -1258, -14, 299, -208, 73, -9},
+    {0, -2, -5, 70, -234, 410, -275, -832, 9468, 8830, -1132, -98, 336, -217, 73, -8},
+};
+
+// `time` is in APU cycles since the last blip_end_frame. The APU ends each
+// frame before its samples could pass BLIP_SIZE.
+void blip_add_delta(blip_t *b, uint32_t time, int delta)
+{
+    uint64_t pos = (uint64_t)time * b->rate + b->phase;
+    int index = b->avail + (pos >> CLOCK_BITS);
+    const int16_t *kernel = blip_kernel[(pos >> (CLOCK_BITS - PHASE_BITS)) & ((1 << PHASE_BITS) - 1)];
+
+    assert(index < BLIP_SIZE);
+    for (int i = 0; i < BLIP_WIDTH; i++)
+        b->buf[index + i] += delta * kernel[i];
+}
+
+// Closes the frame at `time`: the samples it completed become readable and
+// the next frame's times count from there
+void blip_end_frame(blip_t *b, uint32_t time)
+{
+    uint64_t pos = (uint64_t)time * b->rate + b->phase;
+
+    b->avail += pos >> CLOCK_BITS;
+    b->phase = pos & ((1 << CLOCK_BITS) - 1);
+}
+
+// APU cycles the current frame must last to complete `samples` more
+uint32_t blip_clocks_needed(const blip_t *b, int samples)
+{
+    uint64_t pos = ((uint64_t)samples << CLOCK_BITS) - b->phase;
+
+    return (pos + b->rate - 1) / b->rate;
+}
+
+// Moves up to `count` finished samples to `out`, `stride` apart, or drops
+// them if `out` is NULL. Returns how many were taken.
+int blip_read(blip_t *b, int16_t *out, int count, int stride)
+{
+    if (count > b->avail)
+        count = b->avail;
+    for (int i = 0; i < count; i++) {
+        b->integrator += b->buf[i];
+        int sample = b->integrator >> DELTA_BITS;
+        if (sample > 32767) sample = 32767;
+        if (sample < -32768) sample = -32768;
+        if (out)
+            out[i * stride] = sample;
+    }
+    int left = b->avail - count + BLIP_WIDTH;
+    memmove(b->buf, b->buf + count, left * sizeof(b->buf[0]));
+    memset(b->buf + left, 0, count * sizeof(b->buf[0]));
+    b->avail -= count;
+    return count;
+}
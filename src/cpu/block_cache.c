@@ -0,0 +1,231 @@
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+
+// Instruction length, 0x10 (STOP) skips its padding byte
+static const uint8_t op_length[256] = {
+    1, 3, 1, 1, 1, 1, 2, 1, 3, 1, 1, 1, 1, 1, 2, 1,
+    2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1,
+    2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1,
+    2, 3, 1, 1, 1, 1, 2, 1, 2, 1, 1, 1, 1, 1, 2, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 3, 3, 3, 1, 2, 1, 1, 1, 3, 2, 3, 3, 2, 1,
+    1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 1, 2, 1,
+    2, 1, 1, 1, 1, 1, 2, 1, 2, 1, 3, 1, 1, 1, 2, 1,
+    2, 1, 1, 1, 1, 1, 2, 1, 2, 1, 3, 1, 1, 1, 2, 1,
+};
+
+// Cycles when no branch is taken
+static const uint8_t op_cycles[256] = {
+     4, 12,  8,  8,  4,  4,  8,  4, 20,  8,  8,  8,  4,  4,  8,  4,
+     4, 12,  8,  8,  4,  4,  8,  4, 12,  8,  8,  8,  4,  4,  8,  4,
+     8, 12,  8,  8,  4,  4,  8,  4,  8,  8,  8,  8,  4,  4,  8,  4,
+     8, 12,  8,  8, 12, 12, 12,  4,  8,  8,  8,  8,  4,  4,  8,  4,
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+     8,  8,  8,  8,  8,  8,  4,  8,  4,  4,  4,  4,  4,  4,  8,  4,
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+     4,  4,  4,  4,  4,  4,  8,  4,  4,  4,  4,  4,  4,  4,  8,  4,
+     8, 12, 12, 16, 12, 16,  8, 16,  8, 16, 12,  8, 12, 24,  8, 16,
+     8, 12, 12,  4, 12, 16,  8, 16,  8, 16, 12,  4, 12,  4,  8, 16,
+    12, 12,  8,  4,  4, 16,  8, 16, 16,  4, 16,  4,  4,  4,  8, 16,
+    12, 12,  8,  4,  4, 16,  8, 16, 12,  8, 16,  4,  4,  4,  8, 16,
+};
+
+// Jumps, calls, returns, RST, HALT, STOP and EI end a block
+static int ends_block(uint8_t op)
+{
+    switch (op) {
+        case 0x10: case 0x18: case 0x20: case 0x28: case 0x30: case 0x38:
+        case 0x76: case 0xC0: case 0xC2: case 0xC3: case 0xC4: case 0xC7:
+        case 0xC8: case 0xC9: case 0xCA: case 0xCC: case 0xCD: case 0xCF:
+        case 0xD0: case 0xD2: case 0xD4: case 0xD7: case 0xD8: case 0xD9:
+        case 0xDA: case 0xDC: case 0xDF: case 0xE7: case 0xE9: case 0xEF:
+        case 0xF7: case 0xFB: case 0xFF:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Offset of a host pointer inside cpu_t, -1 for ROM and other buffers
+static long ram_offset(cpu_t *cpu, const uint8_t *host)
+{
+    uintptr_t off = (uintptr_t)host - (uintptr_t)cpu;
+
+    return (off < sizeof(cpu_t)) ? (long)off : -1;
+}
+
+static int line_is_code(block_cache_t *bc, long off)
+{
+    return (bc->code_lines[off >> 9] >> ((off >> 6) & 7)) & 1;
+}
+
+// Code can be cached from ROM, WRAM/echo and HRAM
+static int is_cacheable(uint16_t pc)
+{
+    return pc < 0x8000 || (pc >= 0xC000 && pc < 0xFE00) || (pc >= 0xFF80 && pc < 0xFFFF);
+}
+
+void init_block_cache(cpu_t *cpu)
+{
+    if (!cpu->blocks) {
+        cpu->blocks = malloc(sizeof(block_cache_t));
+        if (!cpu->blocks)
+            THROW("Failed to allocate the block cache", INVALID_FILE);
+    }
+    memset(cpu->blocks, 0, sizeof(block_cache_t));
+}
+
+int page_has_code(cpu_t *cpu, const uint8_t *page)
+{
+    long off = ram_offset(cpu, page);
+
+    if (!cpu->blocks || off < 0)
+        return 0;
+    for (long o = off & ~0x3FL; o < off + 0x100; o += 0x40) {
+        if (line_is_code(cpu->blocks, o))
+            return 1;
+    }
+    return 0;
+}
+
+// Writes to RAM pages holding cached code end up here (WRAM through the
+// slow path of write_8, HRAM through the I/O handler)
+void invalidate_code(cpu_t *cpu, uint8_t *host)
+{
+    block_cache_t *bc = cpu->blocks;
+    long off = ram_offset(cpu, host);
+
+    if (!bc || off < 0 || !line_is_code(bc, off))
+        return;
+    // Any block covering this line starts in this 256-byte bucket or the one before
+    bc->code_lines[off >> 9] &= ~(1 << ((off >> 6) & 7));
+    bc->page_gen[off >> 8]++;
+    if (off >= 0x100)
+        bc->page_gen[(off >> 8) - 1]++;
+    bc->stats.invalidations++;
+    cpu->run_break = 1;
+    // Give pages with no code left their direct stores back
+    map_wram(cpu);
+}
+
+static void protect_code(cpu_t *cpu, const uint8_t *start, int len)
+{
+    block_cache_t *bc = cpu->blocks;
+    long off = ram_offset(cpu, start);
+
+    for (long o = off & ~0x3FL; o < off + len; o += 0x40)
+        bc->code_lines[o >> 9] |= 1 << ((o >> 6) & 7);
+    // Send stores to the page through write_8 so they can invalidate
+    for (int i = 0; i < 256; i++) {
+        if (cpu->write_map[i] && page_has_code(cpu, cpu->write_map[i]))
+            cpu->write_map[i] = NULL;
+    }
+}
+
+static void decode_block(cpu_t *cpu, block_t *b, const uint8_t *key, uint16_t pc)
+{
+    const uint8_t *page = cpu->read_map[pc >> 8];
+    uint16_t addr = pc;
+
+    b->key = key;
+    b->count = 0;
+    b->cycles = 0;
+    while (b->count < BLOCK_MAX_OPS && (addr >> 8) == (pc >> 8)) {
+        uint8_t op = page[addr & 0xFF];
+        int len = op_length[op];
+
+        // Keep every byte of the block inside one page
+        if ((addr & 0xFF) + len > 0x100)
+            break;
+        decoded_op_t *d = &b->ops[b->count++];
+        d->pc = addr;
+        d->op = op;
+        d->imm = (len > 1) ? page[(addr + 1) & 0xFF] : 0;
+        if (len > 2)
+            d->imm |= page[(addr + 2) & 0xFF] << 8;
+        b->cycles += op_cycles[op];
+        addr += len;
+        if (ends_block(op))
+            break;
+    }
+
+    detect_idle_loop(cpu, b);
+
+    long off = ram_offset(cpu, key);
+    b->gen = (off >= 0) ? cpu->blocks->page_gen[off >> 8] : 0;
+    if (off >= 0)
+        protect_code(cpu, key, addr - pc);
+}
+
+// Single instruction decoded through read_8 for code outside cacheable memory
+static const decoded_op_t *decode_uncached(cpu_t *cpu, const decoded_op_t **end)
+{
+    decoded_op_t *d = &cpu->blocks->scratch;
+    uint16_t pc = cpu->pc;
+
+    d->pc = pc;
+    d->op = read_8(cpu, pc);
+    d->imm = 0;
+    if (op_length[d->op] > 1)
+        d->imm = read_8(cpu, pc + 1);
+    if (op_length[d->op] > 2)
+        d->imm |= read_8(cpu, pc + 2) << 8;
+    *end = d + 1;
+    return d;
+}
+
+const decoded_op_t *get_block(cpu_t *cpu, const decoded_op_t **end)
+{
+    block_cache_t *bc = cpu->blocks;
+    uint16_t pc = cpu->pc;
+    const uint8_t *page = cpu->read_map[pc >> 8];
+
+    // Instructions straddling two pages are decoded one at a time
+    if (!page || !is_cacheable(pc) || (pc & 0xFF) + op_length[page[pc & 0xFF]] > 0x100) {
+        bc->last = NULL;
+        bc->idle = NULL;
+        return decode_uncached(cpu, end);
+    }
+
+    const uint8_t *key = page + (pc & 0xFF);
+    long off = ram_offset(cpu, key);
+    uint32_t gen = (off >= 0) ? bc->page_gen[off >> 8] : 0;
+    block_t *b = &bc->blocks[((uintptr_t)key ^ ((uintptr_t)key >> 12)) & (BLOCK_CACHE_SIZE - 1)];
+
+    bc->stats.lookups++;
+    bc->idle = NULL;
+    if (b->key != key || b->gen != gen || b->ops[0].pc != pc) {
+        if (!b->key)
+            bc->stats.blocks++;
+        bc->stats.compiled++;
+        decode_block(cpu, b, key, pc);
+    } else {
+        bc->stats.hits++;
+        // Only a loop that just ran a full pass of itself in this run (so
+        // with no event since) can be skipped
+        if (b->idle && b == bc->last)
+            bc->idle = b;
+    }
+    bc->last = b;
+    *end = b->ops + b->count;
+    return b->ops;
+}
+
+void get_block_stats(cpu_t *cpu, block_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    if (cpu->blocks)
+        *stats = cpu->blocks->stats;
+}
@@ -1,127 +1,261 @@
 #include <stddef.h>
 #include "cpu.h"
 
-static void execute_cb(cpu_t *cpu, uint8_t opcode)
+// Direct-threaded dispatch through a label table when the compiler supports
+// computed goto, plain switch otherwise. Build with -DNO_COMPUTED_GOTO to
+// force the fallback.
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+    #define USE_COMPUTED_GOTO
+#endif
+
+#ifdef USE_COMPUTED_GOTO
+    #define OP(n) op_##n:
+    #define OP_DEFAULT op_default:
+    #define DISPATCH() goto *dispatch[op];
+    #define NEXT() do { RETIRE(); FETCH(); DISPATCH(); } while (0)
+    #define CB_OP(name, n) cb_##name:
+    #define CB_GROUP(name, n) cb_##name:
+    #define CB_DISPATCH(group) goto *cb_dispatch[group];
+#else
+    #define OP(n) case n:
+    #define OP_DEFAULT default:
+    #define DISPATCH() switch (op)
+    #define NEXT() goto retire
+    #define CB_OP(name, n) case n:
+    #define CB_GROUP(name, n) case n: case n + 1: case n + 2: case n + 3: \
+        case n + 4: case n + 5: case n + 6: case n + 7:
+    #define CB_DISPATCH(group) switch (group)
+#endif
+
+// Start of an instruction: EI delay, then the next pre-decoded op. A new
+// block is looked up whenever execution leaves the current one, and idle
+// loops are fast-forwarded towards the deadline.
+#define FETCH() \
+    do { \
+        if (cpu->ime_scheduled > 0) { \
+            if (cpu->ime_scheduled == 1) cpu->ime = 1; \
+            cpu->ime_scheduled--; \
+        } \
+        if (ip == ip_end || ip->pc != cpu->pc) { \
+            ip = get_block(cpu, &ip_end); \
+            if (cpu->blocks->idle) \
+                cycles += skip_idle_loop(cpu, budget - cycles); \
+        } \
+        op = ip->op; \
+        imm = ip->imm; \
+        ip++; \
+        c = 4; \
+    } while (0)
+
+// Operands come from the decoded op instead of memory
+#define IMM8 ((uint8_t)imm)
+#define IMM16 (imm)
+
+// End of an instruction: leave the run at the deadline or whenever the
+// caller has to step in (HALT, I/O write, interrupt ready to fire)
+#define RETIRE() \
+    do { \
+        if (cpu->halt_bug) { \
+            cpu->pc--; \
+            cpu->halt_bug = 0; \
+        } \
+        cycles += c; \
+        cpu->pending_cycles += c; \
+        if (cycles >= budget || cpu->halted || cpu->run_break \
+            || (cpu->ime && (IO(cpu, 0xFF0F) & IO(cpu, 0xFFFF) & 0x1F))) \
+            return cycles; \
+    } while (0)
+
+#define LD_R_R(n, d, s) \
+    OP(n) cpu->registers.d = cpu->registers.s; cpu->pc++; NEXT();
+#define LD_R_HL(n, d) \
+    OP(n) cpu->registers.d = fetch_8(cpu, cpu->registers.hl); cpu->pc++; c = 8; NEXT();
+#define LD_HL_R(n, s) \
+    OP(n) store_8(cpu, cpu->registers.hl, cpu->registers.s); cpu->pc++; c = 8; NEXT();
+#define ALU_R(n, f, s) \
+    OP(n) cpu_##f(cpu, cpu->registers.s); cpu->pc++; NEXT();
+#define ALU_HL(n, f) \
+    OP(n) cpu_##f(cpu, fetch_8(cpu, cpu->registers.hl)); cpu->pc++; c = 8; NEXT();
+
+// CB operand index -> register, (HL) is handled separately
+static const size_t cb_reg[8] = {
+    offsetof(cpu_t, registers.b), offsetof(cpu_t, registers.c),
+    offsetof(cpu_t, registers.d), offsetof(cpu_t, registers.e),
+    offsetof(cpu_t, registers.h), offsetof(cpu_t, registers.l),
+    0, offsetof(cpu_t, registers.a)
+};
+
+#define CB_REG(cpu, i) (((uint8_t *)(cpu))[cb_reg[i]])
+
+// Page-table fast paths, inlined so ROM/RAM accesses skip the call
+static inline uint8_t fetch_8(cpu_t *cpu, uint16_t addr)
 {
-    uint8_t *r[] = {
-        &cpu->registers.b, &cpu->registers.c,
-        &cpu->registers.d, &cpu->registers.e,
-        &cpu->registers.h, &cpu->registers.l,
-        NULL, &cpu->registers.a
-    };
-    int i = opcode & 7;
-    uint8_t v = (i == 6) ? read_8(cpu, cpu->registers.hl) : *r[i];
-    uint8_t res = 0;
+    const uint8_t *page = cpu->read_map[addr >> 8];
 
-    switch (opcode >> 3) {
-        case 0: res = cpu_rlc(cpu, v); break;
-        case 1: res = cpu_rrc(cpu, v); break;
-        case 2: res = cpu_rl(cpu, v); break;
-        case 3: res = cpu_rr(cpu, v); break;
-        case 4: res = cpu_sla(cpu, v); break;
-        case 5: res = cpu_sra(cpu, v); break;
-        case 6: res = cpu_swap(cpu, v); break;
-        case 7: res = cpu_srl(cpu, v); break;
-        case 8 ... 15: cpu_bit(cpu, (opcode >> 3) & 7, v); return;
-        case 16 ... 23: res = cpu_res((opcode >> 3) & 7, v); break;
-        case 24 ... 31: res = cpu_set((opcode >> 3) & 7, v); break;
-    }
-    if (i == 6)
-        write_8(cpu, cpu->registers.hl, res);
+    return page ? page[addr & 0xFF] : read_8(cpu, addr);
+}
+
+static inline void store_8(cpu_t *cpu, uint16_t addr, uint8_t val)
+{
+    uint8_t *page = cpu->write_map[addr >> 8];
+
+    if (page)
+        page[addr & 0xFF] = val;
     else
-        *r[i] = res;
+        write_8(cpu, addr, val);
 }
 
-int execute_instruction(cpu_t *cpu)
+// Runs instructions until at least `budget` cycles have elapsed or the
+// caller needs control back. Elapsed cycles are also added to
+// cpu->pending_cycles for the peripherals to catch up on.
+int cpu_run(cpu_t *cpu, int budget)
 {
-    uint8_t op = read_8(cpu, cpu->pc);
-    int c = 4;
+#ifdef USE_COMPUTED_GOTO
+    static const void *const dispatch[256] = {
+        &&op_0x00, &&op_0x01, &&op_0x02, &&op_0x03, &&op_0x04, &&op_0x05, &&op_0x06, &&op_0x07,
+        &&op_0x08, &&op_0x09, &&op_0x0A, &&op_0x0B, &&op_0x0C, &&op_0x0D, &&op_0x0E, &&op_0x0F,
+        &&op_0x10, &&op_0x11, &&op_0x12, &&op_0x13, &&op_0x14, &&op_0x15, &&op_0x16, &&op_0x17,
+        &&op_0x18, &&op_0x19, &&op_0x1A, &&op_0x1B, &&op_0x1C, &&op_0x1D, &&op_0x1E, &&op_0x1F,
+        &&op_0x20, &&op_0x21, &&op_0x22, &&op_0x23, &&op_0x24, &&op_0x25, &&op_0x26, &&op_0x27,
+        &&op_0x28, &&op_0x29, &&op_0x2A, &&op_0x2B, &&op_0x2C, &&op_0x2D, &&op_0x2E, &&op_0x2F,
+        &&op_0x30, &&op_0x31, &&op_0x32, &&op_0x33, &&op_0x34, &&op_0x35, &&op_0x36, &&op_0x37,
+        &&op_0x38, &&op_0x39, &&op_0x3A, &&op_0x3B, &&op_0x3C, &&op_0x3D, &&op_0x3E, &&op_0x3F,
+        &&op_0x40, &&op_0x41, &&op_0x42, &&op_0x43, &&op_0x44, &&op_0x45, &&op_0x46, &&op_0x47,
+        &&op_0x48, &&op_0x49, &&op_0x4A, &&op_0x4B, &&op_0x4C, &&op_0x4D, &&op_0x4E, &&op_0x4F,
+        &&op_0x50, &&op_0x51, &&op_0x52, &&op_0x53, &&op_0x54, &&op_0x55, &&op_0x56, &&op_0x57,
+        &&op_0x58, &&op_0x59, &&op_0x5A, &&op_0x5B, &&op_0x5C, &&op_0x5D, &&op_0x5E, &&op_0x5F,
+        &&op_0x60, &&op_0x61, &&op_0x62, &&op_0x63, &&op_0x64, &&op_0x65, &&op_0x66, &&op_0x67,
+        &&op_0x68, &&op_0x69, &&op_0x6A, &&op_0x6B, &&op_0x6C, &&op_0x6D, &&op_0x6E, &&op_0x6F,
+        &&op_0x70, &&op_0x71, &&op_0x72, &&op_0x73, &&op_0x74, &&op_0x75, &&op_0x76, &&op_0x77,
+        &&op_0x78, &&op_0x79, &&op_0x7A, &&op_0x7B, &&op_0x7C, &&op_0x7D, &&op_0x7E, &&op_0x7F,
+        &&op_0x80, &&op_0x81, &&op_0x82, &&op_0x83, &&op_0x84, &&op_0x85, &&op_0x86, &&op_0x87,
+        &&op_0x88, &&op_0x89, &&op_0x8A, &&op_0x8B, &&op_0x8C, &&op_0x8D, &&op_0x8E, &&op_0x8F,
+        &&op_0x90, &&op_0x91, &&op_0x92, &&op_0x93, &&op_0x94, &&op_0x95, &&op_0x96, &&op_0x97,
+        &&op_0x98, &&op_0x99, &&op_0x9A, &&op_0x9B, &&op_0x9C, &&op_0x9D, &&op_0x9E, &&op_0x9F,
+        &&op_0xA0, &&op_0xA1, &&op_0xA2, &&op_0xA3, &&op_0xA4, &&op_0xA5, &&op_0xA6, &&op_0xA7,
+        &&op_0xA8, &&op_0xA9, &&op_0xAA, &&op_0xAB, &&op_0xAC, &&op_0xAD, &&op_0xAE, &&op_0xAF,
+        &&op_0xB0, &&op_0xB1, &&op_0xB2, &&op_0xB3, &&op_0xB4, &&op_0xB5, &&op_0xB6, &&op_0xB7,
+        &&op_0xB8, &&op_0xB9, &&op_0xBA, &&op_0xBB, &&op_0xBC, &&op_0xBD, &&op_0xBE, &&op_0xBF,
+        &&op_0xC0, &&op_0xC1, &&op_0xC2, &&op_0xC3, &&op_0xC4, &&op_0xC5, &&op_0xC6, &&op_0xC7,
+        &&op_0xC8, &&op_0xC9, &&op_0xCA, &&op_0xCB, &&op_0xCC, &&op_0xCD, &&op_0xCE, &&op_0xCF,
+        &&op_0xD0, &&op_0xD1, &&op_0xD2, &&op_default, &&op_0xD4, &&op_0xD5, &&op_0xD6, &&op_0xD7,
+        &&op_0xD8, &&op_0xD9, &&op_0xDA, &&op_default, &&op_0xDC, &&op_default, &&op_0xDE, &&op_0xDF,
+        &&op_0xE0, &&op_0xE1, &&op_0xE2, &&op_default, &&op_default, &&op_0xE5, &&op_0xE6, &&op_0xE7,
+        &&op_0xE8, &&op_0xE9, &&op_0xEA, &&op_default, &&op_default, &&op_default, &&op_0xEE, &&op_0xEF,
+        &&op_0xF0, &&op_0xF1, &&op_0xF2, &&op_0xF3, &&op_default, &&op_0xF5, &&op_0xF6, &&op_0xF7,
+        &&op_0xF8, &&op_0xF9, &&op_0xFA, &&op_0xFB, &&op_default, &&op_default, &&op_0xFE, &&op_0xFF,
+    };
+    static const void *const cb_dispatch[32] = {
+        &&cb_rlc, &&cb_rrc, &&cb_rl, &&cb_rr, &&cb_sla, &&cb_sra, &&cb_swap, &&cb_srl,
+        &&cb_bit, &&cb_bit, &&cb_bit, &&cb_bit, &&cb_bit, &&cb_bit, &&cb_bit, &&cb_bit,
+        &&cb_res, &&cb_res, &&cb_res, &&cb_res, &&cb_res, &&cb_res, &&cb_res, &&cb_res,
+        &&cb_set, &&cb_set, &&cb_set, &&cb_set, &&cb_set, &&cb_set, &&cb_set, &&cb_set,
+    };
+#endif
+    int cycles = 0;
+    int c;
+    uint8_t op;
+    uint16_t imm;
+    const decoded_op_t *ip = NULL;
+    const decoded_op_t *ip_end = NULL;
+    uint8_t cb = 0, cb_idx = 0, v = 0;
 
-    switch (op) {
+    cpu->run_break = 0;
+    // Events may have changed what an idle loop polls since its last pass
+    cpu->blocks->last = NULL;
+    FETCH();
+#ifndef USE_COMPUTED_GOTO
+decode:
+#endif
+    DISPATCH() {
 
     // -- 0x00: NOP --
-    case 0x00: cpu->pc++; break;
+    OP(0x00) cpu->pc++; NEXT();
 
     // -- 0x01-0x0F --
-    case 0x01: cpu->registers.bc = read_16(cpu, cpu->pc + 1); cpu->pc += 3; c = 12; break;
-    case 0x02: write_8(cpu, cpu->registers.bc, cpu->registers.a); cpu->pc++; c = 8; break;
-    case 0x03: cpu->registers.bc++; cpu->pc++; c = 8; break;
-    case 0x04: cpu_inc(cpu, &cpu->registers.b); cpu->pc++; break;
-    case 0x05: cpu_dec(cpu, &cpu->registers.b); cpu->pc++; break;
-    case 0x06: cpu->registers.b = read_8(cpu, cpu->pc + 1); cpu->pc += 2; c = 8; break;
-    case 0x07: {
+    OP(0x01) cpu->registers.bc = IMM16; cpu->pc += 3; c = 12; NEXT();
+    OP(0x02) store_8(cpu, cpu->registers.bc, cpu->registers.a); cpu->pc++; c = 8; NEXT();
+    OP(0x03) cpu->registers.bc++; cpu->pc++; c = 8; NEXT();
+    OP(0x04) cpu_inc(cpu, &cpu->registers.b); cpu->pc++; NEXT();
+    OP(0x05) cpu_dec(cpu, &cpu->registers.b); cpu->pc++; NEXT();
+    OP(0x06) cpu->registers.b = IMM8; cpu->pc += 2; c = 8; NEXT();
+    OP(0x07) {
         uint8_t a = cpu->registers.a, cy = a >> 7;
         cpu->registers.a = (a << 1) | cy;
         cpu->registers.f = cy << 4;
-        cpu->pc++; break;
+        cpu->pc++; NEXT();
     }
-    case 0x08: {
-        uint16_t addr = read_16(cpu, cpu->pc + 1);
-        write_8(cpu, addr, cpu->sp & 0xFF);
-        write_8(cpu, addr + 1, cpu->sp >> 8);
-        cpu->pc += 3; c = 20; break;
+    OP(0x08) {
+        uint16_t addr = IMM16;
+        store_8(cpu, addr, cpu->sp & 0xFF);
+        store_8(cpu, addr + 1, cpu->sp >> 8);
+        cpu->pc += 3; c = 20; NEXT();
     }
-    case 0x09: cpu_add_hl(cpu, cpu->registers.bc); cpu->pc++; c = 8; break;
-    case 0x0A: cpu->registers.a = read_8(cpu, cpu->registers.bc); cpu->pc++; c = 8; break;
-    case 0x0B: cpu->registers.bc--; cpu->pc++; c = 8; break;
-    case 0x0C: cpu_inc(cpu, &cpu->registers.c); cpu->pc++; break;
-    case 0x0D: cpu_dec(cpu, &cpu->registers.c); cpu->pc++; break;
-    case 0x0E: cpu->registers.c = read_8(cpu, cpu->pc + 1); cpu->pc += 2; c = 8; break;
-    case 0x0F: {
+    OP(0x09) cpu_add_hl(cpu, cpu->registers.bc); cpu->pc++; c = 8; NEXT();
+    OP(0x0A) cpu->registers.a = fetch_8(cpu, cpu->registers.bc); cpu->pc++; c = 8; NEXT();
+    OP(0x0B) cpu->registers.bc--; cpu->pc++; c = 8; NEXT();
+    OP(0x0C) cpu_inc(cpu, &cpu->registers.c); cpu->pc++; NEXT();
+    OP(0x0D) cpu_dec(cpu, &cpu->registers.c); cpu->pc++; NEXT();
+    OP(0x0E) cpu->registers.c = IMM8; cpu->pc += 2; c = 8; NEXT();
+    OP(0x0F) {
         uint8_t a = cpu->registers.a, cy = a & 1;
         cpu->registers.a = (a >> 1) | (cy << 7);
         cpu->registers.f = cy << 4;
-        cpu->pc++; break;
+        cpu->pc++; NEXT();
     }
 
     // -- 0x10-0x1F --
-    case 0x10:
+    OP(0x10)
         if (cpu->cgb_mode && cpu->speed_switch_armed) {
+            // Everything up to the switch ran at the old speed
+            sync_cycles(cpu);
             cpu->double_speed ^= 1;
             cpu->speed_switch_armed = 0;
+            reschedule_events(cpu);
+            cpu->run_break = 1;
         }
-        cpu->pc += 2; break;
-    case 0x11: cpu->registers.de = read_16(cpu, cpu->pc + 1); cpu->pc += 3; c = 12; break;
-    case 0x12: write_8(cpu, cpu->registers.de, cpu->registers.a); cpu->pc++; c = 8; break;
-    case 0x13: cpu->registers.de++; cpu->pc++; c = 8; break;
-    case 0x14: cpu_inc(cpu, &cpu->registers.d); cpu->pc++; break;
-    case 0x15: cpu_dec(cpu, &cpu->registers.d); cpu->pc++; break;
-    case 0x16: cpu->registers.d = read_8(cpu, cpu->pc + 1); cpu->pc += 2; c = 8; break;
-    case 0x17: {
+        cpu->pc += 2; NEXT();
+    OP(0x11) cpu->registers.de = IMM16; cpu->pc += 3; c = 12; NEXT();
+    OP(0x12) store_8(cpu, cpu->registers.de, cpu->registers.a); cpu->pc++; c = 8; NEXT();
+    OP(0x13) cpu->registers.de++; cpu->pc++; c = 8; NEXT();
+    OP(0x14) cpu_inc(cpu, &cpu->registers.d); cpu->pc++; NEXT();
+    OP(0x15) cpu_dec(cpu, &cpu->registers.d); cpu->pc++; NEXT();
+    OP(0x16) cpu->registers.d = IMM8; cpu->pc += 2; c = 8; NEXT();
+    OP(0x17) {
         uint8_t a = cpu->registers.a;
         uint8_t oc = (cpu->registers.f & FLAG_C) ? 1 : 0;
         cpu->registers.a = (a << 1) | oc;
         cpu->registers.f = (a >> 7) << 4;
-        cpu->pc++; break;
+        cpu->pc++; NEXT();
     }
-    case 0x18: { int8_t o = (int8_t)read_8(cpu, cpu->pc + 1); cpu->pc += 2 + o; c = 12; break; }
-    case 0x19: cpu_add_hl(cpu, cpu->registers.de); cpu->pc++; c = 8; break;
-    case 0x1A: cpu->registers.a = read_8(cpu, cpu->registers.de); cpu->pc++; c = 8; break;
-    case 0x1B: cpu->registers.de--; cpu->pc++; c = 8; break;
-    case 0x1C: cpu_inc(cpu, &cpu->registers.e); cpu->pc++; break;
-    case 0x1D: cpu_dec(cpu, &cpu->registers.e); cpu->pc++; break;
-    case 0x1E: cpu->registers.e = read_8(cpu, cpu->pc + 1); cpu->pc += 2; c = 8; break;
-    case 0x1F: {
+    OP(0x18) { int8_t o = (int8_t)IMM8; cpu->pc += 2 + o; c = 12; NEXT(); }
+    OP(0x19) cpu_add_hl(cpu, cpu->registers.de); cpu->pc++; c = 8; NEXT();
+    OP(0x1A) cpu->registers.a = fetch_8(cpu, cpu->registers.de); cpu->pc++; c = 8; NEXT();
+    OP(0x1B) cpu->registers.de--; cpu->pc++; c = 8; NEXT();
+    OP(0x1C) cpu_inc(cpu, &cpu->registers.e); cpu->pc++; NEXT();
+    OP(0x1D) cpu_dec(cpu, &cpu->registers.e); cpu->pc++; NEXT();
+    OP(0x1E) cpu->registers.e = IMM8; cpu->pc += 2; c = 8; NEXT();
+    OP(0x1F) {
         uint8_t a = cpu->registers.a;
         uint8_t oc = (cpu->registers.f & FLAG_C) ? 1 : 0;
         cpu->registers.a = (a >> 1) | (oc << 7);
         cpu->registers.f = (a & 1) << 4;
-        cpu->pc++; break;
+        cpu->pc++; NEXT();
     }
 
     // -- 0x20-0x2F --
-    case 0x20: {
-        int8_t o = (int8_t)read_8(cpu, cpu->pc + 1); cpu->pc += 2;
+    OP(0x20) {
+        int8_t o = (int8_t)IMM8; cpu->pc += 2;
         if (!(cpu->registers.f & FLAG_Z)) { cpu->pc += o; c = 12; } else c = 8;
-        break;
+        NEXT();
     }
-    case 0x21: cpu->registers.hl = read_16(cpu, cpu->pc + 1); cpu->pc += 3; c = 12; break;
-    case 0x22: write_8(cpu, cpu->registers.hl++, cpu->registers.a); cpu->pc++; c = 8; break;
-    case 0x23: cpu->registers.hl++; cpu->pc++; c = 8; break;
-    case 0x24: cpu_inc(cpu, &cpu->registers.h); cpu->pc++; break;
-    case 0x25: cpu_dec(cpu, &cpu->registers.h); cpu->pc++; break;
-    case 0x26: cpu->registers.h = read_8(cpu, cpu->pc + 1); cpu->pc += 2; c = 8; break;
-    case 0x27: {
+    OP(0x21) cpu->registers.hl = IMM16; cpu->pc += 3; c = 12; NEXT();
+    OP(0x22) store_8(cpu, cpu->registers.hl++, cpu->registers.a); cpu->pc++; c = 8; NEXT();
+    OP(0x23) cpu->registers.hl++; cpu->pc++; c = 8; NEXT();
+    OP(0x24) cpu_inc(cpu, &cpu->registers.h); cpu->pc++; NEXT();
+    OP(0x25) cpu_dec(cpu, &cpu->registers.h); cpu->pc++; NEXT();
+    OP(0x26) cpu->registers.h = IMM8; cpu->pc += 2; c = 8; NEXT();
+    OP(0x27) {
         uint8_t u = 0;
         if ((cpu->registers.f & FLAG_H) || (!(cpu->registers.f & FLAG_N) && (cpu->registers.a & 0xF) > 9))
             u = 6;
@@ -132,210 +266,341 @@ int execute_instruction(cpu_t *cpu)
         cpu->registers.a += (cpu->registers.f & FLAG_N) ? -u : u;
         cpu->registers.f &= ~(FLAG_H | FLAG_Z);
         if (cpu->registers.a == 0) cpu->registers.f |= FLAG_Z;
-        cpu->pc++; break;
+        cpu->pc++; NEXT();
     }
-    case 0x28: {
-        int8_t o = (int8_t)read_8(cpu, cpu->pc + 1); cpu->pc += 2;
+    OP(0x28) {
+        int8_t o = (int8_t)IMM8; cpu->pc += 2;
         if (cpu->registers.f & FLAG_Z) { cpu->pc += o; c = 12; } else c = 8;
-        break;
+        NEXT();
     }
-    case 0x29: cpu_add_hl(cpu, cpu->registers.hl); cpu->pc++; c = 8; break;
-    case 0x2A: cpu->registers.a = read_8(cpu, cpu->registers.hl++); cpu->pc++; c = 8; break;
-    case 0x2B: cpu->registers.hl--; cpu->pc++; c = 8; break;
-    case 0x2C: cpu_inc(cpu, &cpu->registers.l); cpu->pc++; break;
-    case 0x2D: cpu_dec(cpu, &cpu->registers.l); cpu->pc++; break;
-    case 0x2E: cpu->registers.l = read_8(cpu, cpu->pc + 1); cpu->pc += 2; c = 8; break;
-    case 0x2F: cpu->registers.a = ~cpu->registers.a; cpu->registers.f |= 0x60; cpu->pc++; break;
+    OP(0x29) cpu_add_hl(cpu, cpu->registers.hl); cpu->pc++; c = 8; NEXT();
+    OP(0x2A) cpu->registers.a = fetch_8(cpu, cpu->registers.hl++); cpu->pc++; c = 8; NEXT();
+    OP(0x2B) cpu->registers.hl--; cpu->pc++; c = 8; NEXT();
+    OP(0x2C) cpu_inc(cpu, &cpu->registers.l); cpu->pc++; NEXT();
+    OP(0x2D) cpu_dec(cpu, &cpu->registers.l); cpu->pc++; NEXT();
+    OP(0x2E) cpu->registers.l = IMM8; cpu->pc += 2; c = 8; NEXT();
+    OP(0x2F) cpu->registers.a = ~cpu->registers.a; cpu->registers.f |= 0x60; cpu->pc++; NEXT();
 
     // -- 0x30-0x3F --
-    case 0x30: {
-        int8_t o = (int8_t)read_8(cpu, cpu->pc + 1); cpu->pc += 2;
+    OP(0x30) {
+        int8_t o = (int8_t)IMM8; cpu->pc += 2;
         if (!(cpu->registers.f & FLAG_C)) { cpu->pc += o; c = 12; } else c = 8;
-        break;
+        NEXT();
     }
-    case 0x31: cpu->sp = read_16(cpu, cpu->pc + 1); cpu->pc += 3; c = 12; break;
-    case 0x32: write_8(cpu, cpu->registers.hl--, cpu->registers.a); cpu->pc++; c = 8; break;
-    case 0x33: cpu->sp++; cpu->pc++; c = 8; break;
-    case 0x34: {
-        uint8_t v = read_8(cpu, cpu->registers.hl);
+    OP(0x31) cpu->sp = IMM16; cpu->pc += 3; c = 12; NEXT();
+    OP(0x32) store_8(cpu, cpu->registers.hl--, cpu->registers.a); cpu->pc++; c = 8; NEXT();
+    OP(0x33) cpu->sp++; cpu->pc++; c = 8; NEXT();
+    OP(0x34) {
+        uint8_t v = fetch_8(cpu, cpu->registers.hl);
         cpu_inc(cpu, &v);
-        write_8(cpu, cpu->registers.hl, v);
-        cpu->pc++; c = 12; break;
+        store_8(cpu, cpu->registers.hl, v);
+        cpu->pc++; c = 12; NEXT();
     }
-    case 0x35: {
-        uint8_t v = read_8(cpu, cpu->registers.hl);
+    OP(0x35) {
+        uint8_t v = fetch_8(cpu, cpu->registers.hl);
         cpu_dec(cpu, &v);
-        write_8(cpu, cpu->registers.hl, v);
-        cpu->pc++; c = 12; break;
+        store_8(cpu, cpu->registers.hl, v);
+        cpu->pc++; c = 12; NEXT();
     }
-    case 0x36: write_8(cpu, cpu->registers.hl, read_8(cpu, cpu->pc + 1)); cpu->pc += 2; c = 12; break;
-    case 0x37: cpu->registers.f = (cpu->registers.f & FLAG_Z) | FLAG_C; cpu->pc++; break;
-    case 0x38: {
-        int8_t o = (int8_t)read_8(cpu, cpu->pc + 1); cpu->pc += 2;
+    OP(0x36) store_8(cpu, cpu->registers.hl, IMM8); cpu->pc += 2; c = 12; NEXT();
+    OP(0x37) cpu->registers.f = (cpu->registers.f & FLAG_Z) | FLAG_C; cpu->pc++; NEXT();
+    OP(0x38) {
+        int8_t o = (int8_t)IMM8; cpu->pc += 2;
         if (cpu->registers.f & FLAG_C) { cpu->pc += o; c = 12; } else c = 8;
-        break;
+        NEXT();
     }
-    case 0x39: cpu_add_hl(cpu, cpu->sp); cpu->pc++; c = 8; break;
-    case 0x3A: cpu->registers.a = read_8(cpu, cpu->registers.hl--); cpu->pc++; c = 8; break;
-    case 0x3B: cpu->sp--; cpu->pc++; c = 8; break;
-    case 0x3C: cpu_inc(cpu, &cpu->registers.a); cpu->pc++; break;
-    case 0x3D: cpu_dec(cpu, &cpu->registers.a); cpu->pc++; break;
-    case 0x3E: cpu->registers.a = read_8(cpu, cpu->pc + 1); cpu->pc += 2; c = 8; break;
-    case 0x3F: {
+    OP(0x39) cpu_add_hl(cpu, cpu->sp); cpu->pc++; c = 8; NEXT();
+    OP(0x3A) cpu->registers.a = fetch_8(cpu, cpu->registers.hl--); cpu->pc++; c = 8; NEXT();
+    OP(0x3B) cpu->sp--; cpu->pc++; c = 8; NEXT();
+    OP(0x3C) cpu_inc(cpu, &cpu->registers.a); cpu->pc++; NEXT();
+    OP(0x3D) cpu_dec(cpu, &cpu->registers.a); cpu->pc++; NEXT();
+    OP(0x3E) cpu->registers.a = IMM8; cpu->pc += 2; c = 8; NEXT();
+    OP(0x3F) {
         uint8_t c_ = (cpu->registers.f & FLAG_C) ? 0 : FLAG_C;
         cpu->registers.f = (cpu->registers.f & FLAG_Z) | c_;
-        cpu->pc++; break;
+        cpu->pc++; NEXT();
     }
 
     // -- 0x40-0x7F: LD r,r and HALT --
-    case 0x40 ... 0x75: case 0x77 ... 0x7F: {
-        uint8_t *r[] = {
-            &cpu->registers.b, &cpu->registers.c,
-            &cpu->registers.d, &cpu->registers.e,
-            &cpu->registers.h, &cpu->registers.l,
-            NULL, &cpu->registers.a
-        };
-        int d = (op >> 3) & 7, s = op & 7;
-        if (d == 6)      { write_8(cpu, cpu->registers.hl, *r[s]); c = 8; }
-        else if (s == 6)  { *r[d] = read_8(cpu, cpu->registers.hl); c = 8; }
-        else              { *r[d] = *r[s]; }
-        cpu->pc++; break;
-    }
-    case 0x76:
+    LD_R_R(0x40, b, b)
+    LD_R_R(0x41, b, c)
+    LD_R_R(0x42, b, d)
+    LD_R_R(0x43, b, e)
+    LD_R_R(0x44, b, h)
+    LD_R_R(0x45, b, l)
+    LD_R_HL(0x46, b)
+    LD_R_R(0x47, b, a)
+    LD_R_R(0x48, c, b)
+    LD_R_R(0x49, c, c)
+    LD_R_R(0x4A, c, d)
+    LD_R_R(0x4B, c, e)
+    LD_R_R(0x4C, c, h)
+    LD_R_R(0x4D, c, l)
+    LD_R_HL(0x4E, c)
+    LD_R_R(0x4F, c, a)
+    LD_R_R(0x50, d, b)
+    LD_R_R(0x51, d, c)
+    LD_R_R(0x52, d, d)
+    LD_R_R(0x53, d, e)
+    LD_R_R(0x54, d, h)
+    LD_R_R(0x55, d, l)
+    LD_R_HL(0x56, d)
+    LD_R_R(0x57, d, a)
+    LD_R_R(0x58, e, b)
+    LD_R_R(0x59, e, c)
+    LD_R_R(0x5A, e, d)
+    LD_R_R(0x5B, e, e)
+    LD_R_R(0x5C, e, h)
+    LD_R_R(0x5D, e, l)
+    LD_R_HL(0x5E, e)
+    LD_R_R(0x5F, e, a)
+    LD_R_R(0x60, h, b)
+    LD_R_R(0x61, h, c)
+    LD_R_R(0x62, h, d)
+    LD_R_R(0x63, h, e)
+    LD_R_R(0x64, h, h)
+    LD_R_R(0x65, h, l)
+    LD_R_HL(0x66, h)
+    LD_R_R(0x67, h, a)
+    LD_R_R(0x68, l, b)
+    LD_R_R(0x69, l, c)
+    LD_R_R(0x6A, l, d)
+    LD_R_R(0x6B, l, e)
+    LD_R_R(0x6C, l, h)
+    LD_R_R(0x6D, l, l)
+    LD_R_HL(0x6E, l)
+    LD_R_R(0x6F, l, a)
+    LD_HL_R(0x70, b)
+    LD_HL_R(0x71, c)
+    LD_HL_R(0x72, d)
+    LD_HL_R(0x73, e)
+    LD_HL_R(0x74, h)
+    LD_HL_R(0x75, l)
+    OP(0x76)
         cpu->pc++;
-        if (!cpu->ime && (read_8(cpu, 0xFF0F) & read_8(cpu, 0xFFFF)))
+        if (!cpu->ime && (fetch_8(cpu, 0xFF0F) & fetch_8(cpu, 0xFFFF)))
             cpu->halt_bug = 1; // HALT bug: next opcode read twice
         else
             cpu->halted = 1;
-        break;
+        NEXT();
+
+    LD_HL_R(0x77, a)
+    LD_R_R(0x78, a, b)
+    LD_R_R(0x79, a, c)
+    LD_R_R(0x7A, a, d)
+    LD_R_R(0x7B, a, e)
+    LD_R_R(0x7C, a, h)
+    LD_R_R(0x7D, a, l)
+    LD_R_HL(0x7E, a)
+    LD_R_R(0x7F, a, a)
 
     // -- 0x80-0xBF: ALU ops --
-    case 0x80 ... 0xBF: {
-        uint8_t *r[] = {
-            &cpu->registers.b, &cpu->registers.c,
-            &cpu->registers.d, &cpu->registers.e,
-            &cpu->registers.h, &cpu->registers.l,
-            NULL, &cpu->registers.a
-        };
-        uint8_t v = ((op & 7) == 6) ? read_8(cpu, cpu->registers.hl) : *r[op & 7];
-        switch ((op >> 3) & 7) {
-            case 0: cpu_add(cpu, v); break;
-            case 1: cpu_adc(cpu, v); break;
-            case 2: cpu_sub(cpu, v); break;
-            case 3: cpu_sbc(cpu, v); break;
-            case 4: cpu_and(cpu, v); break;
-            case 5: cpu_xor(cpu, v); break;
-            case 6: cpu_or(cpu, v); break;
-            case 7: cpu_cp(cpu, v); break;
-        }
-        cpu->pc++;
-        c = ((op & 7) == 6) ? 8 : 4; break;
-    }
+    ALU_R(0x80, add, b)
+    ALU_R(0x81, add, c)
+    ALU_R(0x82, add, d)
+    ALU_R(0x83, add, e)
+    ALU_R(0x84, add, h)
+    ALU_R(0x85, add, l)
+    ALU_HL(0x86, add)
+    ALU_R(0x87, add, a)
+    ALU_R(0x88, adc, b)
+    ALU_R(0x89, adc, c)
+    ALU_R(0x8A, adc, d)
+    ALU_R(0x8B, adc, e)
+    ALU_R(0x8C, adc, h)
+    ALU_R(0x8D, adc, l)
+    ALU_HL(0x8E, adc)
+    ALU_R(0x8F, adc, a)
+    ALU_R(0x90, sub, b)
+    ALU_R(0x91, sub, c)
+    ALU_R(0x92, sub, d)
+    ALU_R(0x93, sub, e)
+    ALU_R(0x94, sub, h)
+    ALU_R(0x95, sub, l)
+    ALU_HL(0x96, sub)
+    ALU_R(0x97, sub, a)
+    ALU_R(0x98, sbc, b)
+    ALU_R(0x99, sbc, c)
+    ALU_R(0x9A, sbc, d)
+    ALU_R(0x9B, sbc, e)
+    ALU_R(0x9C, sbc, h)
+    ALU_R(0x9D, sbc, l)
+    ALU_HL(0x9E, sbc)
+    ALU_R(0x9F, sbc, a)
+    ALU_R(0xA0, and, b)
+    ALU_R(0xA1, and, c)
+    ALU_R(0xA2, and, d)
+    ALU_R(0xA3, and, e)
+    ALU_R(0xA4, and, h)
+    ALU_R(0xA5, and, l)
+    ALU_HL(0xA6, and)
+    ALU_R(0xA7, and, a)
+    ALU_R(0xA8, xor, b)
+    ALU_R(0xA9, xor, c)
+    ALU_R(0xAA, xor, d)
+    ALU_R(0xAB, xor, e)
+    ALU_R(0xAC, xor, h)
+    ALU_R(0xAD, xor, l)
+    ALU_HL(0xAE, xor)
+    ALU_R(0xAF, xor, a)
+    ALU_R(0xB0, or, b)
+    ALU_R(0xB1, or, c)
+    ALU_R(0xB2, or, d)
+    ALU_R(0xB3, or, e)
+    ALU_R(0xB4, or, h)
+    ALU_R(0xB5, or, l)
+    ALU_HL(0xB6, or)
+    ALU_R(0xB7, or, a)
+    ALU_R(0xB8, cp, b)
+    ALU_R(0xB9, cp, c)
+    ALU_R(0xBA, cp, d)
+    ALU_R(0xBB, cp, e)
+    ALU_R(0xBC, cp, h)
+    ALU_R(0xBD, cp, l)
+    ALU_HL(0xBE, cp)
+    ALU_R(0xBF, cp, a)
 
     // -- 0xC0-0xCF --
-    case 0xC0:
+    OP(0xC0)
         if (!(cpu->registers.f & FLAG_Z)) { cpu->pc = stack_pop16(cpu); c = 20; }
-        else { cpu->pc++; c = 8; } break;
-    case 0xC1: cpu->registers.bc = stack_pop16(cpu); cpu->pc++; c = 12; break;
-    case 0xC2:
-        if (!(cpu->registers.f & FLAG_Z)) { cpu->pc = read_16(cpu, cpu->pc + 1); c = 16; }
-        else { cpu->pc += 3; c = 12; } break;
-    case 0xC3: cpu->pc = read_16(cpu, cpu->pc + 1); c = 16; break;
-    case 0xC4:
-        if (!(cpu->registers.f & FLAG_Z)) { stack_push16(cpu, cpu->pc + 3); cpu->pc = read_16(cpu, cpu->pc + 1); c = 24; }
-        else { cpu->pc += 3; c = 12; } break;
-    case 0xC5: stack_push16(cpu, cpu->registers.bc); cpu->pc++; c = 16; break;
-    case 0xC6: cpu_add(cpu, read_8(cpu, cpu->pc + 1)); cpu->pc += 2; c = 8; break;
-    case 0xC7: stack_push16(cpu, cpu->pc + 1); cpu->pc = 0x0000; c = 16; break;
-    case 0xC8:
+        else { cpu->pc++; c = 8; } NEXT();
+    OP(0xC1) cpu->registers.bc = stack_pop16(cpu); cpu->pc++; c = 12; NEXT();
+    OP(0xC2)
+        if (!(cpu->registers.f & FLAG_Z)) { cpu->pc = IMM16; c = 16; }
+        else { cpu->pc += 3; c = 12; } NEXT();
+    OP(0xC3) cpu->pc = IMM16; c = 16; NEXT();
+    OP(0xC4)
+        if (!(cpu->registers.f & FLAG_Z)) { stack_push16(cpu, cpu->pc + 3); cpu->pc = IMM16; c = 24; }
+        else { cpu->pc += 3; c = 12; } NEXT();
+    OP(0xC5) stack_push16(cpu, cpu->registers.bc); cpu->pc++; c = 16; NEXT();
+    OP(0xC6) cpu_add(cpu, IMM8); cpu->pc += 2; c = 8; NEXT();
+    OP(0xC7) stack_push16(cpu, cpu->pc + 1); cpu->pc = 0x0000; c = 16; NEXT();
+    OP(0xC8)
         if (cpu->registers.f & FLAG_Z) { cpu->pc = stack_pop16(cpu); c = 20; }
-        else { cpu->pc++; c = 8; } break;
-    case 0xC9: cpu->pc = stack_pop16(cpu); c = 16; break;
-    case 0xCA:
-        if (cpu->registers.f & FLAG_Z) { cpu->pc = read_16(cpu, cpu->pc + 1); c = 16; }
-        else { cpu->pc += 3; c = 12; } break;
-    case 0xCB: execute_cb(cpu, read_8(cpu, cpu->pc + 1)); cpu->pc += 2; c = 8; break;
-    case 0xCC:
-        if (cpu->registers.f & FLAG_Z) { stack_push16(cpu, cpu->pc + 3); cpu->pc = read_16(cpu, cpu->pc + 1); c = 24; }
-        else { cpu->pc += 3; c = 12; } break;
-    case 0xCD: {
-        uint16_t t = read_16(cpu, cpu->pc + 1);
-        stack_push16(cpu, cpu->pc + 3); cpu->pc = t; c = 24; break;
+        else { cpu->pc++; c = 8; } NEXT();
+    OP(0xC9) cpu->pc = stack_pop16(cpu); c = 16; NEXT();
+    OP(0xCA)
+        if (cpu->registers.f & FLAG_Z) { cpu->pc = IMM16; c = 16; }
+        else { cpu->pc += 3; c = 12; } NEXT();
+    OP(0xCB) goto prefix_cb;
+    OP(0xCC)
+        if (cpu->registers.f & FLAG_Z) { stack_push16(cpu, cpu->pc + 3); cpu->pc = IMM16; c = 24; }
+        else { cpu->pc += 3; c = 12; } NEXT();
+    OP(0xCD) {
+        uint16_t t = IMM16;
+        stack_push16(cpu, cpu->pc + 3); cpu->pc = t; c = 24; NEXT();
     }
-    case 0xCE: cpu_adc(cpu, read_8(cpu, cpu->pc + 1)); cpu->pc += 2; c = 8; break;
-    case 0xCF: stack_push16(cpu, cpu->pc + 1); cpu->pc = 0x0008; c = 16; break;
+    OP(0xCE) cpu_adc(cpu, IMM8); cpu->pc += 2; c = 8; NEXT();
+    OP(0xCF) stack_push16(cpu, cpu->pc + 1); cpu->pc = 0x0008; c = 16; NEXT();
 
     // -- 0xD0-0xDF --
-    case 0xD0:
+    OP(0xD0)
         if (!(cpu->registers.f & FLAG_C)) { cpu->pc = stack_pop16(cpu); c = 20; }
-        else { cpu->pc++; c = 8; } break;
-    case 0xD1: cpu->registers.de = stack_pop16(cpu); cpu->pc++; c = 12; break;
-    case 0xD2:
-        if (!(cpu->registers.f & FLAG_C)) { cpu->pc = read_16(cpu, cpu->pc + 1); c = 16; }
-        else { cpu->pc += 3; c = 12; } break;
-    case 0xD4:
-        if (!(cpu->registers.f & FLAG_C)) { stack_push16(cpu, cpu->pc + 3); cpu->pc = read_16(cpu, cpu->pc + 1); c = 24; }
-        else { cpu->pc += 3; c = 12; } break;
-    case 0xD5: stack_push16(cpu, cpu->registers.de); cpu->pc++; c = 16; break;
-    case 0xD6: cpu_sub(cpu, read_8(cpu, cpu->pc + 1)); cpu->pc += 2; c = 8; break;
-    case 0xD7: stack_push16(cpu, cpu->pc + 1); cpu->pc = 0x0010; c = 16; break;
-    case 0xD8:
+        else { cpu->pc++; c = 8; } NEXT();
+    OP(0xD1) cpu->registers.de = stack_pop16(cpu); cpu->pc++; c = 12; NEXT();
+    OP(0xD2)
+        if (!(cpu->registers.f & FLAG_C)) { cpu->pc = IMM16; c = 16; }
+        else { cpu->pc += 3; c = 12; } NEXT();
+    OP(0xD4)
+        if (!(cpu->registers.f & FLAG_C)) { stack_push16(cpu, cpu->pc + 3); cpu->pc = IMM16; c = 24; }
+        else { cpu->pc += 3; c = 12; } NEXT();
+    OP(0xD5) stack_push16(cpu, cpu->registers.de); cpu->pc++; c = 16; NEXT();
+    OP(0xD6) cpu_sub(cpu, IMM8); cpu->pc += 2; c = 8; NEXT();
+    OP(0xD7) stack_push16(cpu, cpu->pc + 1); cpu->pc = 0x0010; c = 16; NEXT();
+    OP(0xD8)
         if (cpu->registers.f & FLAG_C) { cpu->pc = stack_pop16(cpu); c = 20; }
-        else { cpu->pc++; c = 8; } break;
-    case 0xD9: cpu->pc = stack_pop16(cpu); cpu->ime = 1; c = 16; break;
-    case 0xDA:
-        if (cpu->registers.f & FLAG_C) { cpu->pc = read_16(cpu, cpu->pc + 1); c = 16; }
-        else { cpu->pc += 3; c = 12; } break;
-    case 0xDC:
-        if (cpu->registers.f & FLAG_C) { stack_push16(cpu, cpu->pc + 3); cpu->pc = read_16(cpu, cpu->pc + 1); c = 24; }
-        else { cpu->pc += 3; c = 12; } break;
-    case 0xDE: cpu_sbc(cpu, read_8(cpu, cpu->pc + 1)); cpu->pc += 2; c = 8; break;
-    case 0xDF: stack_push16(cpu, cpu->pc + 1); cpu->pc = 0x0018; c = 16; break;
+        else { cpu->pc++; c = 8; } NEXT();
+    OP(0xD9) cpu->pc = stack_pop16(cpu); cpu->ime = 1; c = 16; NEXT();
+    OP(0xDA)
+        if (cpu->registers.f & FLAG_C) { cpu->pc = IMM16; c = 16; }
+        else { cpu->pc += 3; c = 12; } NEXT();
+    OP(0xDC)
+        if (cpu->registers.f & FLAG_C) { stack_push16(cpu, cpu->pc + 3); cpu->pc = IMM16; c = 24; }
+        else { cpu->pc += 3; c = 12; } NEXT();
+    OP(0xDE) cpu_sbc(cpu, IMM8); cpu->pc += 2; c = 8; NEXT();
+    OP(0xDF) stack_push16(cpu, cpu->pc + 1); cpu->pc = 0x0018; c = 16; NEXT();
 
     // -- 0xE0-0xEF --
-    case 0xE0: write_8(cpu, 0xFF00 + read_8(cpu, cpu->pc + 1), cpu->registers.a); cpu->pc += 2; c = 12; break;
-    case 0xE1: cpu->registers.hl = stack_pop16(cpu); cpu->pc++; c = 12; break;
-    case 0xE2: write_8(cpu, 0xFF00 + cpu->registers.c, cpu->registers.a); cpu->pc++; c = 8; break;
-    case 0xE5: stack_push16(cpu, cpu->registers.hl); cpu->pc++; c = 16; break;
-    case 0xE6:
-        cpu->registers.a &= read_8(cpu, cpu->pc + 1);
+    OP(0xE0) store_8(cpu, 0xFF00 + IMM8, cpu->registers.a); cpu->pc += 2; c = 12; NEXT();
+    OP(0xE1) cpu->registers.hl = stack_pop16(cpu); cpu->pc++; c = 12; NEXT();
+    OP(0xE2) store_8(cpu, 0xFF00 + cpu->registers.c, cpu->registers.a); cpu->pc++; c = 8; NEXT();
+    OP(0xE5) stack_push16(cpu, cpu->registers.hl); cpu->pc++; c = 16; NEXT();
+    OP(0xE6)
+        cpu->registers.a &= IMM8;
         cpu->registers.f = (cpu->registers.a == 0 ? FLAG_Z : 0) | FLAG_H;
-        cpu->pc += 2; c = 8; break;
-    case 0xE7: stack_push16(cpu, cpu->pc + 1); cpu->pc = 0x0020; c = 16; break;
-    case 0xE8: {
-        int8_t o = (int8_t)read_8(cpu, cpu->pc + 1);
+        cpu->pc += 2; c = 8; NEXT();
+    OP(0xE7) stack_push16(cpu, cpu->pc + 1); cpu->pc = 0x0020; c = 16; NEXT();
+    OP(0xE8) {
+        int8_t o = (int8_t)IMM8;
         cpu->registers.f = (((cpu->sp & 0xF) + (o & 0xF) > 0xF) << 5)
                          | (((cpu->sp & 0xFF) + (o & 0xFF) > 0xFF) << 4);
         cpu->sp += o;
-        cpu->pc += 2; c = 16; break;
+        cpu->pc += 2; c = 16; NEXT();
     }
-    case 0xE9: cpu->pc = cpu->registers.hl; break;
-    case 0xEA: write_8(cpu, read_16(cpu, cpu->pc + 1), cpu->registers.a); cpu->pc += 3; c = 16; break;
-    case 0xEE: cpu_xor(cpu, read_8(cpu, cpu->pc + 1)); cpu->pc += 2; c = 8; break;
-    case 0xEF: stack_push16(cpu, cpu->pc + 1); cpu->pc = 0x0028; c = 16; break;
+    OP(0xE9) cpu->pc = cpu->registers.hl; NEXT();
+    OP(0xEA) store_8(cpu, IMM16, cpu->registers.a); cpu->pc += 3; c = 16; NEXT();
+    OP(0xEE) cpu_xor(cpu, IMM8); cpu->pc += 2; c = 8; NEXT();
+    OP(0xEF) stack_push16(cpu, cpu->pc + 1); cpu->pc = 0x0028; c = 16; NEXT();
 
     // -- 0xF0-0xFF --
-    case 0xF0: cpu->registers.a = read_8(cpu, 0xFF00 + read_8(cpu, cpu->pc + 1)); cpu->pc += 2; c = 12; break;
-    case 0xF1: cpu->registers.af = stack_pop16(cpu) & 0xFFF0; cpu->pc++; c = 12; break;
-    case 0xF2: cpu->registers.a = read_8(cpu, 0xFF00 + cpu->registers.c); cpu->pc++; c = 8; break;
-    case 0xF3: cpu->ime = 0; cpu->pc++; break;
-    case 0xF5: stack_push16(cpu, cpu->registers.af); cpu->pc++; c = 16; break;
-    case 0xF6: cpu_or(cpu, read_8(cpu, cpu->pc + 1)); cpu->pc += 2; c = 8; break;
-    case 0xF7: stack_push16(cpu, cpu->pc + 1); cpu->pc = 0x0030; c = 16; break;
-    case 0xF8: {
-        int8_t o = (int8_t)read_8(cpu, cpu->pc + 1);
+    OP(0xF0) cpu->registers.a = fetch_8(cpu, 0xFF00 + IMM8); cpu->pc += 2; c = 12; NEXT();
+    OP(0xF1) cpu->registers.af = stack_pop16(cpu) & 0xFFF0; cpu->pc++; c = 12; NEXT();
+    OP(0xF2) cpu->registers.a = fetch_8(cpu, 0xFF00 + cpu->registers.c); cpu->pc++; c = 8; NEXT();
+    OP(0xF3) cpu->ime = 0; cpu->pc++; NEXT();
+    OP(0xF5) stack_push16(cpu, cpu->registers.af); cpu->pc++; c = 16; NEXT();
+    OP(0xF6) cpu_or(cpu, IMM8); cpu->pc += 2; c = 8; NEXT();
+    OP(0xF7) stack_push16(cpu, cpu->pc + 1); cpu->pc = 0x0030; c = 16; NEXT();
+    OP(0xF8) {
+        int8_t o = (int8_t)IMM8;
         cpu->registers.f = (((cpu->sp & 0xF) + (o & 0xF) > 0xF) << 5)
                          | (((cpu->sp & 0xFF) + (o & 0xFF) > 0xFF) << 4);
         cpu->registers.hl = cpu->sp + o;
-        cpu->pc += 2; c = 12; break;
+        cpu->pc += 2; c = 12; NEXT();
     }
-    case 0xF9: cpu->sp = cpu->registers.hl; cpu->pc++; c = 8; break;
-    case 0xFA: cpu->registers.a = read_8(cpu, read_16(cpu, cpu->pc + 1)); cpu->pc += 3; c = 16; break;
-    case 0xFB: cpu->ime_scheduled = 2; cpu->pc++; break;
-    case 0xFE: cpu_cp(cpu, read_8(cpu, cpu->pc + 1)); cpu->pc += 2; c = 8; break;
-    case 0xFF: stack_push16(cpu, cpu->pc + 1); cpu->pc = 0x0038; c = 16; break;
+    OP(0xF9) cpu->sp = cpu->registers.hl; cpu->pc++; c = 8; NEXT();
+    OP(0xFA) cpu->registers.a = fetch_8(cpu, IMM16); cpu->pc += 3; c = 16; NEXT();
+    OP(0xFB) cpu->ime_scheduled = 2; cpu->pc++; NEXT();
+    OP(0xFE) cpu_cp(cpu, IMM8); cpu->pc += 2; c = 8; NEXT();
+    OP(0xFF) stack_push16(cpu, cpu->pc + 1); cpu->pc = 0x0038; c = 16; NEXT();
 
-    default: c = 4; cpu->pc++; break;
+    OP_DEFAULT c = 4; cpu->pc++; NEXT();
     }
-    return c;
+
+prefix_cb:
+    cb = IMM8;
+    cb_idx = cb & 7;
+    v = (cb_idx == 6) ? fetch_8(cpu, cpu->registers.hl) : CB_REG(cpu, cb_idx);
+    cpu->pc += 2;
+    c = 8;
+    CB_DISPATCH(cb >> 3) {
+    CB_OP(rlc, 0) v = cpu_rlc(cpu, v); goto cb_store;
+    CB_OP(rrc, 1) v = cpu_rrc(cpu, v); goto cb_store;
+    CB_OP(rl, 2) v = cpu_rl(cpu, v); goto cb_store;
+    CB_OP(rr, 3) v = cpu_rr(cpu, v); goto cb_store;
+    CB_OP(sla, 4) v = cpu_sla(cpu, v); goto cb_store;
+    CB_OP(sra, 5) v = cpu_sra(cpu, v); goto cb_store;
+    CB_OP(swap, 6) v = cpu_swap(cpu, v); goto cb_store;
+    CB_OP(srl, 7) v = cpu_srl(cpu, v); goto cb_store;
+    CB_GROUP(bit, 8) cpu_bit(cpu, (cb >> 3) & 7, v); NEXT();
+    CB_GROUP(res, 16) v = cpu_res((cb >> 3) & 7, v); goto cb_store;
+    CB_GROUP(set, 24) v = cpu_set((cb >> 3) & 7, v); goto cb_store;
+    }
+cb_store:
+    if (cb_idx == 6)
+        store_8(cpu, cpu->registers.hl, v);
+    else
+        CB_REG(cpu, cb_idx) = v;
+    NEXT();
+
+#ifndef USE_COMPUTED_GOTO
+retire:
+    RETIRE();
+    FETCH();
+    goto decode;
+#endif
+}
+
+int execute_instruction(cpu_t *cpu)
+{
+    return cpu_run(cpu, 1);
 }
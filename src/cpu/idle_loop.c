@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include "cpu.h"
+
+static const char *idle_names[] = {"none", "poll", "delay", "delay16"};
+
+// Target of a block's final conditional branch, -1 for anything else
+static int branch_target(const decoded_op_t *op)
+{
+    switch (op->op) {
+        case 0x20: case 0x28: case 0x30: case 0x38:
+            return (uint16_t)(op->pc + 2 + (int8_t)op->imm);
+        case 0xC2: case 0xCA: case 0xD2: case 0xDA:
+            return op->imm;
+        default:
+            return -1;
+    }
+}
+
+// Loads into A, compares, AND/OR and BIT: after one pass A and F are a
+// fixed point of the body, so every later pass does exactly the same
+static int is_poll_op(const decoded_op_t *op)
+{
+    uint8_t o = op->op;
+
+    if (o == 0xF0 || o == 0xF2 || o == 0xFA || o == 0x7E || o == 0x0A || o == 0x1A)
+        return 1;
+    if (o == 0xFE || o == 0xE6 || (o >= 0xA0 && o <= 0xA7) || (o >= 0xB0 && o <= 0xBF))
+        return 1;
+    return o == 0xCB && (op->imm & 0xC0) == 0x40;
+}
+
+// DEC r, JR NZ back to the DEC
+static int is_delay8(const block_t *b)
+{
+    uint8_t o = b->ops[0].op;
+
+    return b->count == 2 && b->ops[1].op == 0x20
+        && (o & 0xC7) == 0x05 && o != 0x35;
+}
+
+// DEC rr, LD A,hi/lo, OR lo/hi, JR NZ back to the DEC
+static int is_delay16(const block_t *b)
+{
+    uint8_t dec = b->ops[0].op, ld = b->ops[1].op, alu = b->ops[2].op;
+    uint8_t hi = 0x78 + ((dec >> 4) & 3) * 2;
+
+    if (b->count != 4 || b->ops[3].op != 0x20 || (dec != 0x0B && dec != 0x1B && dec != 0x2B))
+        return 0;
+    return (ld == hi && alu == 0xB0 + (hi & 7) + 1)
+        || (ld == hi + 1 && alu == 0xB0 + (hi & 7));
+}
+
+static int register_loop(cpu_t *cpu, const block_t *b, uint8_t kind)
+{
+    block_cache_t *bc = cpu->blocks;
+    uint16_t pc = b->ops[0].pc;
+
+    for (int i = 0; i < bc->loop_count; i++) {
+        if (bc->loops[i].key == b->key && bc->loops[i].pc == pc)
+            return i;
+    }
+    if (bc->loop_count == IDLE_LOOP_MAX)
+        return -1;
+
+    idle_loop_t *l = &bc->loops[bc->loop_count];
+    l->key = b->key;
+    l->pc = pc;
+    l->kind = kind;
+    l->bank = 0xFFFF;
+    if (pc < 0x8000 && b->key >= cpu->rom && b->key < cpu->rom + cpu->rom_size)
+        l->bank = (b->key - cpu->rom) / 0x4000;
+    l->skips = 0;
+    l->cycles = 0;
+    return bc->loop_count++;
+}
+
+// Called on every freshly decoded block: flags the ones that branch back
+// to their own start and can be fast-forwarded
+void detect_idle_loop(cpu_t *cpu, block_t *b)
+{
+    uint8_t kind = IDLE_NONE;
+
+    b->idle = IDLE_NONE;
+    if (b->count < 2 || branch_target(&b->ops[b->count - 1]) != b->ops[0].pc)
+        return;
+    if (is_delay8(b)) {
+        kind = IDLE_DELAY;
+    } else if (is_delay16(b)) {
+        kind = IDLE_DELAY16;
+    } else {
+        for (int i = 0; i < b->count - 1; i++) {
+            if (!is_poll_op(&b->ops[i]))
+                return;
+        }
+        kind = IDLE_POLL;
+    }
+
+    int slot = register_loop(cpu, b, kind);
+    if (slot < 0)
+        return;
+    b->idle = kind;
+    b->idle_slot = slot;
+}
+
+// Memory a polling loop may watch: anything that only changes on a
+// scheduled event. DIV/TIMA tick on their own, the APU and RTC registers
+// are not evented.
+static int is_stable_address(uint16_t addr)
+{
+    if (addr >= 0xA000 && addr < 0xC000)
+        return 0;
+    if (addr >= 0xFF00 && addr < 0xFF80)
+        return addr != 0xFF04 && addr != 0xFF05 && !(addr >= 0xFF10 && addr <= 0xFF3F);
+    return 1;
+}
+
+static int poll_inputs_stable(cpu_t *cpu, const block_t *b)
+{
+    for (int i = 0; i < b->count - 1; i++) {
+        const decoded_op_t *op = &b->ops[i];
+        int addr = -1;
+
+        switch (op->op) {
+            case 0xF0: addr = 0xFF00 + (uint8_t)op->imm; break;
+            case 0xF2: addr = 0xFF00 + cpu->registers.c; break;
+            case 0xFA: addr = op->imm; break;
+            case 0x0A: addr = cpu->registers.bc; break;
+            case 0x1A: addr = cpu->registers.de; break;
+            case 0x7E: case 0xA6: case 0xB6: case 0xBE:
+                addr = cpu->registers.hl;
+                break;
+            case 0xCB:
+                if ((op->imm & 7) == 6)
+                    addr = cpu->registers.hl;
+                break;
+            default:
+                break;
+        }
+        if (addr >= 0 && !is_stable_address(addr))
+            return 0;
+    }
+    return 1;
+}
+
+// Skips whole passes of the loop get_block just entered, leaving the core
+// strictly before `budget` so the pass that reaches the next event (or the
+// loop exit) still runs instruction by instruction. Returns the cycles
+// skipped, already added to pending_cycles.
+int skip_idle_loop(cpu_t *cpu, int budget)
+{
+    block_cache_t *bc = cpu->blocks;
+    const block_t *b = bc->idle;
+    int pass = b->cycles + 4; // the branch back is taken
+    uint32_t n = (budget - 1) / pass;
+    uint8_t *reg;
+
+    if (cpu->ime_scheduled || n == 0)
+        return 0;
+
+    switch (b->idle) {
+        case IDLE_POLL:
+            if (!poll_inputs_stable(cpu, b))
+                return 0;
+            break;
+        case IDLE_DELAY: {
+            switch (b->ops[0].op >> 3) {
+                case 0: reg = &cpu->registers.b; break;
+                case 1: reg = &cpu->registers.c; break;
+                case 2: reg = &cpu->registers.d; break;
+                case 3: reg = &cpu->registers.e; break;
+                case 4: reg = &cpu->registers.h; break;
+                case 5: reg = &cpu->registers.l; break;
+                default: reg = &cpu->registers.a; break;
+            }
+            // Passes left including the final, untaken one
+            uint32_t left = *reg ? *reg : 256;
+            if (n > left - 1)
+                n = left - 1;
+            if (n == 0)
+                return 0;
+            *reg -= n;
+            cpu->registers.f = FLAG_N | (cpu->registers.f & FLAG_C)
+                | (((*reg & 0x0F) == 0x0F) ? FLAG_H : 0);
+            break;
+        }
+        case IDLE_DELAY16: {
+            uint16_t *rr = (b->ops[0].op == 0x0B) ? &cpu->registers.bc
+                : (b->ops[0].op == 0x1B) ? &cpu->registers.de : &cpu->registers.hl;
+            uint32_t left = *rr ? *rr : 0x10000;
+            if (n > left - 1)
+                n = left - 1;
+            if (n == 0)
+                return 0;
+            *rr -= n;
+            cpu->registers.a = (*rr >> 8) | (*rr & 0xFF);
+            cpu->registers.f = 0;
+            break;
+        }
+        default:
+            return 0;
+    }
+
+    int skipped = n * pass;
+    cpu->pending_cycles += skipped;
+    bc->loops[b->idle_slot].skips++;
+    bc->loops[b->idle_slot].cycles += skipped;
+    return skipped;
+}
+
+void print_idle_loops(cpu_t *cpu)
+{
+    block_cache_t *bc = cpu->blocks;
+
+    if (!bc)
+        return;
+    printf("Idle loops: %d\n", bc->loop_count);
+    for (int i = 0; i < bc->loop_count; i++) {
+        const idle_loop_t *l = &bc->loops[i];
+        if (l->bank == 0xFFFF)
+            printf("  RAM:%04X", l->pc);
+        else
+            printf("  %03X:%04X", l->bank, l->pc);
+        printf(" %-7s %llu skips, %llu cycles\n", idle_names[l->kind],
+            (unsigned long long)l->skips, (unsigned long long)l->cycles);
+    }
+    fflush(stdout);
+}
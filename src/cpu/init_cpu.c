@@ -0,0 +1,28 @@
+#include "cpu.h"
+
+// Register state the boot ROM leaves behind
+void init_cpu(cpu_t *cpu)
+{
+    cpu->pc = 0x0100;
+    cpu->sp = 0xFFFE;
+    cpu->registers.f = 0x80;
+    cpu->registers.b = 0x00;
+    cpu->registers.c = 0x13;
+    cpu->registers.d = 0x00;
+    cpu->registers.e = 0xD8;
+    cpu->registers.h = 0x01;
+    cpu->registers.l = 0x4D;
+
+    if (cpu->cgb_mode) {
+        cpu->registers.a = 0x11; // CGB boot leaves A=0x11
+    } else {
+        cpu->registers.a = 0x01;
+    }
+
+    write_8(cpu, 0xFF04, 0x00);
+    write_8(cpu, 0xFF05, 0x00);
+    write_8(cpu, 0xFF06, 0x00);
+    write_8(cpu, 0xFF07, 0x00);
+    write_8(cpu, 0xFF40, 0x91);
+    write_8(cpu, 0xFF47, 0xFC);
+}
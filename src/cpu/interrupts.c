@@ -0,0 +1,29 @@
+#include "cpu.h"
+
+void handle_interrupts(cpu_t *cpu)
+{
+    if (!cpu->ime || cpu->halted)
+        return;
+
+    uint8_t pending = read_8(cpu, 0xFF0F) & read_8(cpu, 0xFFFF);
+    uint8_t vectors[] = {0x40, 0x48, 0x50, 0x58, 0x60};
+
+    for (int i = 0; i < 5; i++) {
+        if (pending & (1 << i)) {
+            cpu->ime = 0;
+            write_8(cpu, 0xFF0F, read_8(cpu, 0xFF0F) & ~(1 << i));
+            stack_push16(cpu, cpu->pc);
+            cpu->pc = vectors[i];
+            return;
+        }
+    }
+}
+
+// Replace the held buttons (bit 0-3 right/left/up/down, 4-7 A/B/select/start);
+// any newly pressed one requests the joypad interrupt
+void set_joypad(cpu_t *cpu, uint8_t buttons)
+{
+    if (buttons & ~cpu->joypad_state)
+        write_8(cpu, 0xFF0F, read_8(cpu, 0xFF0F) | 0x10);
+    cpu->joypad_state = buttons;
+}
@@ -0,0 +1,136 @@
+#include <SDL2/SDL.h>
+#include <stdatomic.h>
+#include <string.h>
+#include "cpu.h"
+
+// Frames go from the emulation thread to the main thread through three
+// buffers: the core fills `back`, the presenter shows `front`, and `ready`
+// holds the latest complete frame. Both sides only ever swap their own
+// buffer with `ready`, so the core never waits on the presenter.
+// The window, renderer and texture are only touched on the main thread,
+// which is the only one SDL supports video on everywhere; emulation and
+// its pacing run on a thread of their own (see main.c).
+#define FRAME_FRESH 4 // set in `ready` until the presenter takes it
+#define REFRESH_MS 17
+
+static SDL_Window *window = NULL;
+static SDL_Renderer *renderer = NULL;
+static SDL_Texture *texture = NULL;
+static SDL_sem *frame_posted = NULL;
+
+static uint32_t buffers[3][160 * 144];
+static int back = 0;
+static int front = 1;
+static atomic_int ready = 2;
+
+static atomic_uint frames_presented = 0;
+static atomic_uint frames_dropped = 0;
+static atomic_uint frames_repeated = 0;
+
+// Window title waiting to be set by the main thread
+static SDL_mutex *title_lock = NULL;
+static char title[256];
+static int title_changed = 0;
+
+// Shows the latest complete frame, or the current one again when nothing
+// new came in. Returns 0 if there was nothing new to show.
+static int present_frame(int repeat)
+{
+    if (atomic_load(&ready) & FRAME_FRESH) {
+        front = atomic_exchange(&ready, front) & 3;
+        SDL_UpdateTexture(texture, NULL, buffers[front], 160 * sizeof(uint32_t));
+        atomic_fetch_add(&frames_presented, 1);
+    } else if (repeat) {
+        atomic_fetch_add(&frames_repeated, 1);
+    } else {
+        return 0;
+    }
+    SDL_RenderClear(renderer);
+    SDL_RenderCopy(renderer, texture, NULL, NULL);
+    SDL_RenderPresent(renderer);
+    return 1;
+}
+
+void init_display(void)
+{
+    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER | SDL_INIT_AUDIO) < 0)
+        THROW("Couldn't start SDL", INVALID_FILE);
+    window = SDL_CreateWindow("GameBoy Emulator",
+        SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+        160 * 4, 144 * 4, SDL_WINDOW_SHOWN);
+    if (!window)
+        THROW("Couldn't create the window", INVALID_FILE);
+    renderer = SDL_CreateRenderer(window, -1,
+        SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+    if (!renderer)
+        THROW("Couldn't create the renderer", INVALID_FILE);
+    texture = SDL_CreateTexture(renderer,
+        SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, 160, 144);
+    if (!texture)
+        THROW("Couldn't create the screen texture", INVALID_FILE);
+    frame_posted = SDL_CreateSemaphore(0);
+    title_lock = SDL_CreateMutex();
+    if (!frame_posted || !title_lock)
+        THROW("Couldn't create the frame handoff", INVALID_FILE);
+}
+
+// Publish the frame the PPU has drawn line by line during modes 3/0. A
+// frame still waiting in `ready` is overwritten and counted as dropped.
+void update_display(cpu_t *cpu)
+{
+    if (!(IO(cpu, 0xFF40) & 0x80))
+        return;
+    memcpy(buffers[back], cpu->framebuffer, sizeof(buffers[back]));
+    int old = atomic_exchange(&ready, back | FRAME_FRESH);
+    if (old & FRAME_FRESH)
+        atomic_fetch_add(&frames_dropped, 1);
+    back = old & 3;
+    SDL_SemPost(frame_posted);
+}
+
+// Main thread: waits up to a refresh for a frame and shows it, or shows
+// the last one again. Blocking on vsync here never holds up the core.
+void present_display(void)
+{
+    // A post with no fresh frame is left over from a dropped one
+    int posted = SDL_SemWaitTimeout(frame_posted, REFRESH_MS) == 0;
+
+    present_frame(!posted);
+    SDL_LockMutex(title_lock);
+    if (title_changed) {
+        SDL_SetWindowTitle(window, title);
+        title_changed = 0;
+    }
+    SDL_UnlockMutex(title_lock);
+}
+
+// Any thread: the title is set on the next present
+void set_display_title(const char *text)
+{
+    SDL_LockMutex(title_lock);
+    snprintf(title, sizeof(title), "%s", text);
+    title_changed = 1;
+    SDL_UnlockMutex(title_lock);
+}
+
+void get_display_stats(display_stats_t *stats)
+{
+    stats->presented = atomic_load(&frames_presented);
+    stats->dropped = atomic_load(&frames_dropped);
+    stats->repeated = atomic_load(&frames_repeated);
+}
+
+// Main thread, once the core has stopped posting frames
+void cleanup_display(void)
+{
+    if (!window)
+        return;
+    // The last frame the core finished
+    present_frame(0);
+    SDL_DestroyTexture(texture);
+    SDL_DestroyRenderer(renderer);
+    SDL_DestroyWindow(window);
+    SDL_DestroySemaphore(frame_posted);
+    SDL_DestroyMutex(title_lock);
+    window = NULL;
+}
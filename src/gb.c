@@ -0,0 +1,176 @@
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+#include "gb.h"
+
+// libgb: the core behind an opaque handle, for embedding and for running
+// many consoles in one process. Everything an instance touches hangs off
+// its cpu_t; the only globals it reads are tables built at load time.
+
+#define AUDIO_RING_FRAMES 8192 // about 186ms
+
+struct gb_s {
+    cpu_t cpu;
+    uint8_t rom_owned;
+    uint8_t last_ly;
+    // Mixed audio waiting for gb_get_audio
+    audio_sink_t *audio;
+};
+
+gb_t *gb_create(void)
+{
+    // The CPU struct starts on a cache line
+    gb_t *gb = aligned_alloc(alignof(gb_t), sizeof(gb_t));
+
+    if (!gb)
+        return NULL;
+    memset(gb, 0, sizeof(gb_t));
+    gb->audio = create_memory_sink(AUDIO_RING_FRAMES);
+    if (!gb->audio) {
+        free(gb);
+        return NULL;
+    }
+    init_apu(&gb->cpu);
+    add_audio_sink(&gb->cpu, gb->audio);
+    return gb;
+}
+
+void gb_destroy(gb_t *gb)
+{
+    if (!gb)
+        return;
+    if (gb->rom_owned)
+        free(gb->cpu.rom);
+    close_rom(&gb->cpu);
+    free(gb->cpu.external_ram);
+    free(gb->cpu.blocks);
+    free(gb->cpu.tiles);
+    free(gb->cpu.apu);
+    destroy_audio_sink(gb->audio);
+    free(gb);
+}
+
+int gb_load_rom_shared(gb_t *gb, const void *data, size_t size)
+{
+    cpu_t *cpu = &gb->cpu;
+    struct block_cache_s *blocks = cpu->blocks;
+    struct tile_cache_s *tiles = cpu->tiles;
+    struct apu_s *apu = cpu->apu;
+    FILE *serial_out = cpu->serial_out;
+    uint8_t color_correction = cpu->color_correction;
+
+    // Back to power-on, keeping the allocations that don't depend on the ROM
+    if (gb->rom_owned)
+        free(cpu->rom);
+    close_rom(cpu);
+    free(cpu->external_ram);
+    memset(cpu, 0, sizeof(*cpu));
+    cpu->blocks = blocks;
+    cpu->tiles = tiles;
+    cpu->apu = apu;
+    cpu->serial_out = serial_out;
+    cpu->color_correction = color_correction;
+    gb->rom_owned = 0;
+    gb->last_ly = 0;
+    clear_memory_sink(gb->audio);
+
+    if (load_rom_data(cpu, data, size) != 0)
+        return -1;
+    init_cpu(cpu);
+    init_apu(cpu);
+    reschedule_events(cpu);
+    return 0;
+}
+
+int gb_load_rom_from_memory(gb_t *gb, const void *data, size_t size)
+{
+    uint8_t *copy = malloc(size);
+
+    if (!copy)
+        return -1;
+    memcpy(copy, data, size);
+    if (gb_load_rom_shared(gb, copy, size) != 0) {
+        free(copy);
+        return -1;
+    }
+    gb->rom_owned = 1;
+    return 0;
+}
+
+int gb_load_rom_file(gb_t *gb, const char *path)
+{
+    const rom_image_t *image = open_rom_image(path);
+
+    if (!image)
+        return -1;
+    if (gb_load_rom_shared(gb, image->data, image->size) != 0) {
+        close_rom_image(image);
+        return -1;
+    }
+    gb->cpu.rom_image = image;
+    return 0;
+}
+
+uint64_t gb_run_frame(gb_t *gb)
+{
+    if (!gb->cpu.rom)
+        return 0;
+    return run_frame(&gb->cpu, &gb->last_ly);
+}
+
+void gb_set_input(gb_t *gb, uint8_t buttons)
+{
+    if (gb->cpu.rom)
+        set_joypad(&gb->cpu, buttons);
+}
+
+const uint32_t *gb_get_framebuffer(gb_t *gb)
+{
+    return gb->cpu.framebuffer;
+}
+
+size_t gb_get_audio(gb_t *gb, int16_t *out, size_t max_frames)
+{
+    return read_memory_sink(gb->audio, out, max_frames);
+}
+
+void gb_set_audio_mode(gb_t *gb, gb_audio_mode_t mode)
+{
+    static const audio_mode_t modes[] = {
+        [GB_AUDIO_OFF] = AUDIO_OFF,
+        [GB_AUDIO_REGISTERS] = AUDIO_REGISTERS,
+        [GB_AUDIO_FULL] = AUDIO_FULL
+    };
+
+    if ((unsigned)mode <= GB_AUDIO_FULL)
+        set_audio_mode(&gb->cpu, modes[mode]);
+}
+
+void gb_set_audio_mute(gb_t *gb, uint8_t mask)
+{
+    set_audio_mute(&gb->cpu, mask);
+}
+
+size_t gb_serialize(gb_t *gb, void *buf, size_t size)
+{
+    return serialize_state(&gb->cpu, buf, size);
+}
+
+int gb_deserialize(gb_t *gb, const void *buf, size_t size)
+{
+    if (!gb->cpu.rom || deserialize_state(&gb->cpu, buf, size) != 0)
+        return -1;
+    gb->last_ly = IO(&gb->cpu, 0xFF44);
+    return 0;
+}
+
+uint8_t *gb_get_sram(gb_t *gb, size_t *size)
+{
+    *size = gb->cpu.external_ram ? gb->cpu.ram_size : 0;
+    return gb->cpu.external_ram;
+}
+
+void gb_set_serial_output(gb_t *gb, FILE *out)
+{
+    gb->cpu.serial_out = out;
+}
@@ -0,0 +1,234 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "cpu.h"
+#include "gb.h"
+
+// gb_vec: many bare cpu_t sharing one ROM image, stepped in lockstep on the
+// thread pool. Each step is one pool run with one task per instance, which
+// writes straight into the caller's buffers. Nothing is allocated per step.
+
+typedef struct {
+    cpu_t *cpu;
+    uint8_t last_ly;
+    uint64_t episode_frames;
+    uint8_t index_frame[160 * 144];
+} vec_env_t;
+
+struct gb_vec_s {
+    gb_vec_config_t config;
+    uint16_t *reward_addresses;
+    vec_env_t *envs;
+    thread_pool_t *pool;
+    uint8_t *reset_state;
+    size_t reset_size;
+
+    // Arguments of the step in progress
+    const uint8_t *actions;
+    const gb_vec_output_t *out;
+};
+
+static uint8_t luma(uint32_t argb)
+{
+    return (((argb >> 16) & 0xFF) * 77 + ((argb >> 8) & 0xFF) * 150 + (argb & 0xFF) * 29) >> 8;
+}
+
+static void write_observation(gb_vec_t *vec, int i, const gb_vec_output_t *out)
+{
+    int d = vec->config.downsample;
+    int width = 160 / d, height = 144 / d;
+    ptrdiff_t pitch = out->obs_pitch ? out->obs_pitch : width;
+    uint8_t *dst = out->obs + i * out->obs_stride;
+    vec_env_t *env = &vec->envs[i];
+
+    if (vec->config.format == GB_OBS_PALETTE) {
+        // Indices can't be averaged, so each block keeps its top-left pixel
+        for (int y = 0; y < height; y++) {
+            const uint8_t *src = env->index_frame + y * d * 160;
+            for (int x = 0; x < width; x++)
+                dst[y * pitch + x] = src[x * d];
+        }
+        return;
+    }
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            const uint32_t *src = env->cpu->framebuffer + (y * 160 + x) * d;
+            int sum = 0;
+            for (int by = 0; by < d; by++) {
+                for (int bx = 0; bx < d; bx++)
+                    sum += luma(src[by * 160 + bx]);
+            }
+            dst[y * pitch + x] = sum / (d * d);
+        }
+    }
+}
+
+// Back to the reset state, then one frame so the observation is current
+static void reset_env(gb_vec_t *vec, int i)
+{
+    vec_env_t *env = &vec->envs[i];
+
+    deserialize_state(env->cpu, vec->reset_state, vec->reset_size);
+    init_apu(env->cpu);
+    env->last_ly = IO(env->cpu, 0xFF44);
+    env->episode_frames = 0;
+    set_joypad(env->cpu, 0);
+    run_frame(env->cpu, &env->last_ly);
+}
+
+static int episode_done(gb_vec_t *vec, vec_env_t *env)
+{
+    const gb_vec_config_t *c = &vec->config;
+
+    if (c->max_episode_frames && env->episode_frames >= c->max_episode_frames)
+        return 1;
+    return c->done_address && read_8(env->cpu, c->done_address) == c->done_value;
+}
+
+static void step_task(void *ctx, int i, int worker)
+{
+    gb_vec_t *vec = ctx;
+    vec_env_t *env = &vec->envs[i];
+    const gb_vec_output_t *out = vec->out;
+
+    (void)worker;
+    set_joypad(env->cpu, vec->actions[i]);
+    for (int f = 0; f < vec->config.frame_skip; f++)
+        run_frame(env->cpu, &env->last_ly);
+    env->episode_frames += vec->config.frame_skip;
+
+    if (out->rewards) {
+        for (int r = 0; r < vec->config.reward_count; r++)
+            out->rewards[i * out->reward_stride + r] = read_8(env->cpu, vec->reward_addresses[r]);
+    }
+    int done = episode_done(vec, env);
+    if (out->done)
+        out->done[i] = done;
+    if (done)
+        reset_env(vec, i);
+    if (out->obs)
+        write_observation(vec, i, out);
+}
+
+static void reset_task(void *ctx, int i, int worker)
+{
+    gb_vec_t *vec = ctx;
+    const gb_vec_output_t *out = vec->out;
+
+    (void)worker;
+    reset_env(vec, i);
+    if (out->rewards)
+        memset(out->rewards + i * out->reward_stride, 0, vec->config.reward_count);
+    if (out->done)
+        out->done[i] = 0;
+    if (out->obs)
+        write_observation(vec, i, out);
+}
+
+static int valid_config(const gb_vec_config_t *c)
+{
+    return c->count > 0 && c->frame_skip >= 0 && c->reward_count >= 0
+        && (c->reward_count == 0 || c->reward_addresses)
+        && c->downsample > 0 && 16 % c->downsample == 0
+        && (c->format == GB_OBS_GRAY || c->format == GB_OBS_PALETTE);
+}
+
+gb_vec_t *gb_vec_create(const void *rom, size_t size, const gb_vec_config_t *config)
+{
+    gb_vec_t *vec;
+
+    if (!valid_config(config) || !(vec = calloc(1, sizeof(gb_vec_t))))
+        return NULL;
+    vec->config = *config;
+    if (vec->config.frame_skip == 0)
+        vec->config.frame_skip = 1;
+    if (vec->config.threads <= 0)
+        vec->config.threads = sysconf(_SC_NPROCESSORS_ONLN);
+    vec->reward_addresses = malloc((config->reward_count + 1) * sizeof(uint16_t));
+    vec->envs = calloc(config->count, sizeof(vec_env_t));
+    if (!vec->reward_addresses || !vec->envs) {
+        gb_vec_destroy(vec);
+        return NULL;
+    }
+    if (config->reward_count)
+        memcpy(vec->reward_addresses, config->reward_addresses, config->reward_count * sizeof(uint16_t));
+
+    for (int i = 0; i < config->count; i++) {
+        vec_env_t *env = &vec->envs[i];
+        env->cpu = aligned_alloc(alignof(cpu_t), sizeof(cpu_t));
+        if (env->cpu)
+            memset(env->cpu, 0, sizeof(cpu_t));
+        if (!env->cpu || load_rom_data(env->cpu, rom, size) != 0) {
+            gb_vec_destroy(vec);
+            return NULL;
+        }
+        if (config->format == GB_OBS_PALETTE)
+            env->cpu->index_frame = env->index_frame;
+        init_cpu(env->cpu);
+        init_apu(env->cpu);
+        reschedule_events(env->cpu);
+    }
+
+    // Episodes start from power-on until a state is given
+    vec->reset_size = serialize_state(vec->envs[0].cpu, NULL, 0);
+    vec->reset_state = malloc(vec->reset_size);
+    vec->pool = create_thread_pool(vec->config.threads);
+    if (!vec->reset_state || !vec->pool) {
+        gb_vec_destroy(vec);
+        return NULL;
+    }
+    serialize_state(vec->envs[0].cpu, vec->reset_state, vec->reset_size);
+    return vec;
+}
+
+void gb_vec_destroy(gb_vec_t *vec)
+{
+    if (!vec)
+        return;
+    destroy_thread_pool(vec->pool);
+    for (int i = 0; vec->envs && i < vec->config.count; i++) {
+        cpu_t *cpu = vec->envs[i].cpu;
+        if (!cpu)
+            continue;
+        free(cpu->external_ram);
+        free(cpu->blocks);
+        free(cpu->tiles);
+        free(cpu->apu);
+        free(cpu);
+    }
+    free(vec->envs);
+    free(vec->reward_addresses);
+    free(vec->reset_state);
+    free(vec);
+}
+
+void gb_vec_obs_size(const gb_vec_t *vec, int *width, int *height)
+{
+    *width = 160 / vec->config.downsample;
+    *height = 144 / vec->config.downsample;
+}
+
+int gb_vec_set_reset_state(gb_vec_t *vec, const void *state, size_t size)
+{
+    uint8_t *copy;
+
+    if (size != vec->reset_size || !(copy = malloc(size)))
+        return -1;
+    memcpy(copy, state, size);
+    free(vec->reset_state);
+    vec->reset_state = copy;
+    return 0;
+}
+
+void gb_vec_reset(gb_vec_t *vec, const gb_vec_output_t *out)
+{
+    vec->out = out;
+    run_thread_pool(vec->pool, vec->config.count, reset_task, vec);
+}
+
+void gb_vec_step(gb_vec_t *vec, const uint8_t *actions, const gb_vec_output_t *out)
+{
+    vec->actions = actions;
+    vec->out = out;
+    run_thread_pool(vec->pool, vec->config.count, step_task, vec);
+}
@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cpu.h"
+
+// Runs a ROM with no window, audio device or event polling, as fast as the
+// core goes, then reports the speed and dumps what was asked for. Nothing
+// here touches SDL, so emulator-headless is built without it.
+
+#define DEFAULT_FRAMES 3600
+
+typedef struct {
+    const char *rom;
+    uint64_t frames;
+    uint64_t cycles;
+    const char *input;
+    const char *frame_path;
+    const char *sram_path;
+    const char *serial_path;
+    const char *audio_path;
+    audio_mode_t audio;
+} headless_options_t;
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "usage: %s [options] rom\n"
+        "  --frames N          stop after N frames (default %d)\n"
+        "  --cycles N          stop after N CPU cycles\n"
+        "  --input FILE        scripted input, lines of \"<frame> <buttons>\"\n"
+        "                      with buttons joined by '+', or '-' for none\n"
+        "  --dump-frame FILE   write the last frame as a PPM image\n"
+        "  --dump-sram FILE    write the cartridge RAM\n"
+        "  --dump-serial FILE  write link port output there, not to stdout\n"
+        "  --dump-audio FILE   write everything mixed, as WAV if FILE ends in\n"
+        "                      .wav and raw 16-bit stereo otherwise\n"
+        "  --audio MODE        'registers' (default) keeps the sound registers\n"
+        "                      right, 'off' doesn't clock the APU at all;\n"
+        "                      --dump-audio mixes everything regardless\n",
+        name, DEFAULT_FRAMES);
+}
+
+static void write_file(const char *path, const void *data, size_t size)
+{
+    FILE *f = fopen(path, "wb");
+
+    if (!f)
+        THROW("Couldn't write the dump.", INVALID_FILE);
+    fwrite(data, 1, size, f);
+    fclose(f);
+}
+
+static void dump_frame(cpu_t *cpu, const char *path)
+{
+    uint8_t rgb[160 * 144 * 3];
+    char header[32];
+    int len = snprintf(header, sizeof(header), "P6\n160 144\n255\n");
+    FILE *f = fopen(path, "wb");
+
+    if (!f)
+        THROW("Couldn't write the dump.", INVALID_FILE);
+    for (int i = 0; i < 160 * 144; i++) {
+        rgb[i * 3] = cpu->framebuffer[i] >> 16;
+        rgb[i * 3 + 1] = cpu->framebuffer[i] >> 8;
+        rgb[i * 3 + 2] = cpu->framebuffer[i];
+    }
+    fwrite(header, 1, len, f);
+    fwrite(rgb, 1, sizeof(rgb), f);
+    fclose(f);
+}
+
+static int parse_options(int argc, char **argv, headless_options_t *opt)
+{
+    memset(opt, 0, sizeof(*opt));
+    opt->audio = AUDIO_REGISTERS;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+        if (arg[0] != '-') {
+            opt->rom = arg;
+            continue;
+        }
+        if (!value)
+            return 0;
+        if (strcmp(arg, "--frames") == 0)
+            opt->frames = strtoull(value, NULL, 10);
+        else if (strcmp(arg, "--cycles") == 0)
+            opt->cycles = strtoull(value, NULL, 10);
+        else if (strcmp(arg, "--input") == 0)
+            opt->input = value;
+        else if (strcmp(arg, "--dump-frame") == 0)
+            opt->frame_path = value;
+        else if (strcmp(arg, "--dump-sram") == 0)
+            opt->sram_path = value;
+        else if (strcmp(arg, "--dump-serial") == 0)
+            opt->serial_path = value;
+        else if (strcmp(arg, "--dump-audio") == 0)
+            opt->audio_path = value;
+        else if (strcmp(arg, "--audio") == 0 && strcmp(value, "off") == 0)
+            opt->audio = AUDIO_OFF;
+        else if (strcmp(arg, "--audio") == 0 && strcmp(value, "registers") == 0)
+            opt->audio = AUDIO_REGISTERS;
+        else
+            return 0;
+        i++;
+    }
+    if (!opt->frames && !opt->cycles)
+        opt->frames = DEFAULT_FRAMES;
+    if (opt->audio_path)
+        opt->audio = AUDIO_FULL;
+    return opt->rom != NULL;
+}
+
+int run_headless(int argc, char **argv)
+{
+    headless_options_t opt;
+    input_step_t *steps = NULL;
+    int step_count = 0, next_step = 0;
+    FILE *serial = stdout;
+    audio_sink_t *audio = NULL;
+
+    if (!parse_options(argc, argv, &opt)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (opt.input) {
+        steps = load_input_script(opt.input, &step_count);
+        if (step_count < 0)
+            return 1;
+    }
+    if (opt.serial_path) {
+        serial = fopen(opt.serial_path, "wb");
+        if (!serial)
+            THROW("Couldn't write the dump.", INVALID_FILE);
+    }
+
+    cpu_t *cpu = aligned_alloc(alignof(cpu_t), sizeof(cpu_t));
+    if (!cpu)
+        THROW("Failed to allocate the CPU", INVALID_FILE);
+    memset(cpu, 0, sizeof(cpu_t));
+    cpu->serial_out = serial;
+    read_rom(opt.rom, cpu);
+    init_cpu(cpu);
+    init_apu(cpu);
+    set_audio_mode(cpu, opt.audio);
+    if (opt.audio_path) {
+        size_t len = strlen(opt.audio_path);
+        audio = create_file_sink(opt.audio_path,
+            len >= 4 && strcmp(opt.audio_path + len - 4, ".wav") == 0);
+        if (!audio)
+            THROW("Couldn't write the dump.", INVALID_FILE);
+        add_audio_sink(cpu, audio);
+    }
+    reschedule_events(cpu);
+
+    uint64_t frames = 0;
+    uint8_t last_ly = 0;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (;;) {
+        // Frame boundaries are where scripted input changes and where the
+        // frame budget is checked, as in the windowed loop
+        while (next_step < step_count && steps[next_step].frame <= frames)
+            set_joypad(cpu, steps[next_step++].buttons);
+        if ((opt.frames && frames >= opt.frames) || (opt.cycles && cpu->cycles >= opt.cycles))
+            break;
+
+        run_to_next_event(cpu);
+        uint8_t ly = read_8(cpu, 0xFF44);
+        if (ly == 144 && last_ly != 144)
+            frames++;
+        last_ly = ly;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "%llu frames, %llu cycles in %.3fs: %.0f FPS (%.1fx)\n",
+        (unsigned long long)frames, (unsigned long long)cpu->cycles, seconds,
+        frames / seconds, frames / seconds / 59.73);
+
+    if (audio) {
+        remove_audio_sink(cpu, audio);
+        destroy_audio_sink(audio);
+    }
+    if (opt.frame_path)
+        dump_frame(cpu, opt.frame_path);
+    if (opt.sram_path && cpu->external_ram)
+        write_file(opt.sram_path, cpu->external_ram, cpu->ram_size);
+    if (serial != stdout)
+        fclose(serial);
+    free(steps);
+    return 0;
+}
@@ -0,0 +1,6 @@
+#include "cpu.h"
+
+int main(int argc, char **argv)
+{
+    return run_headless(argc, argv);
+}
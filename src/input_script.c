@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+
+// Input scripts: lines of "<frame> <buttons>", buttons joined by '+' or '-'
+// for none, '#' starting a comment. Each step holds its buttons from its
+// frame until the next step.
+
+static const char *button_names[] = {
+    "right", "left", "up", "down", "a", "b", "select", "start"
+};
+
+static int parse_buttons(char *list, uint8_t *buttons)
+{
+    *buttons = 0;
+    if (strcmp(list, "-") == 0)
+        return 1;
+    for (char *save, *name = strtok_r(list, "+", &save); name; name = strtok_r(NULL, "+", &save)) {
+        int i = 0;
+        while (i < 8 && strcmp(name, button_names[i]) != 0)
+            i++;
+        if (i == 8)
+            return 0;
+        *buttons |= 1 << i;
+    }
+    return 1;
+}
+
+// Returns the steps, or NULL with *count set to -1 after reporting what is
+// wrong with the file
+input_step_t *load_input_script(const char *path, int *count)
+{
+    FILE *f = fopen(path, "r");
+    input_step_t *steps = NULL;
+    char buf[256], list[200];
+    int line = 0;
+    unsigned long long frame;
+
+    *count = 0;
+    if (!f) {
+        fprintf(stderr, "%s: couldn't read the input script\n", path);
+        *count = -1;
+        return NULL;
+    }
+    while (fgets(buf, sizeof(buf), f)) {
+        line++;
+        if (buf[0] == '#' || buf[0] == '\n')
+            continue;
+        input_step_t step;
+        if (sscanf(buf, "%llu %199s", &frame, list) != 2 || !parse_buttons(list, &step.buttons)) {
+            fprintf(stderr, "%s:%d: expected \"<frame> <buttons>\"\n", path, line);
+            free(steps);
+            fclose(f);
+            *count = -1;
+            return NULL;
+        }
+        step.frame = frame;
+        input_step_t *grown = realloc(steps, (*count + 1) * sizeof(input_step_t));
+        if (!grown)
+            THROW("Failed to allocate the input script", INVALID_FILE);
+        steps = grown;
+        steps[(*count)++] = step;
+    }
+    fclose(f);
+    return steps;
+}
@@ -1,35 +1,9 @@
 #include <SDL2/SDL.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <string.h>
 #include "cpu.h"
 
-static uint8_t turbo_mode = 0;
-
-static void init_cpu(cpu_t *cpu)
-{
-    cpu->pc = 0x0100;
-    cpu->sp = 0xFFFE;
-    cpu->registers.f = 0x80;
-    cpu->registers.b = 0x00;
-    cpu->registers.c = 0x13;
-    cpu->registers.d = 0x00;
-    cpu->registers.e = 0xD8;
-    cpu->registers.h = 0x01;
-    cpu->registers.l = 0x4D;
-
-    if (cpu->cgb_mode) {
-        cpu->registers.a = 0x11; // CGB boot leaves A=0x11
-    } else {
-        cpu->registers.a = 0x01;
-    }
-
-    write_8(cpu, 0xFF04, 0x00);
-    write_8(cpu, 0xFF05, 0x00);
-    write_8(cpu, 0xFF06, 0x00);
-    write_8(cpu, 0xFF07, 0x00);
-    write_8(cpu, 0xFF40, 0x91);
-    write_8(cpu, 0xFF47, 0xFC);
-}
-
 static void get_rom_title(cpu_t *cpu, char *buf, int len)
 {
     int i = 0;
@@ -41,82 +15,103 @@ static void get_rom_title(cpu_t *cpu, char *buf, int len)
     buf[i] = '\0';
 }
 
-void set_turbo(uint8_t on) { turbo_mode = on; }
-uint8_t get_turbo(void) { return turbo_mode; }
+// Emulation and its pacing run here, off the main thread, which keeps the
+// window, input and presentation: a vsync wait or a slow compositor there
+// never holds up the core, and SDL's video calls stay on the thread every
+// backend supports them on
+static atomic_int running = 1;
+
+static int run_emulation(void *data)
+{
+    cpu_t *cpu = data;
+    char rom_title[17];
+    get_rom_title(cpu, rom_title, sizeof(rom_title));
+
+    uint8_t last_ly = 0;
+    int frame_count = 0;
+    uint32_t fps_timer = SDL_GetTicks();
+
+    // Frames are paced on emulated time, which is also the clock the audio
+    // is mixed against; rate control in audio_sdl.c absorbs the difference
+    // between the host's timer and its sound card
+    uint64_t perf_freq = SDL_GetPerformanceFrequency();
+    uint64_t deadline = SDL_GetPerformanceCounter();
+
+    while (atomic_load(&running)) {
+        uint64_t cycles = run_frame(cpu, &last_ly) >> cpu->double_speed;
+
+        update_display(cpu);
+        apply_input(cpu);
+        frame_count++;
+
+        // Update title every second
+        uint32_t now = SDL_GetTicks();
+        if (now - fps_timer >= 1000) {
+            char title[256];
+            block_stats_t stats;
+            display_stats_t display;
+            audio_stats_t audio;
+            get_block_stats(cpu, &stats);
+            get_display_stats(&display);
+            get_audio_stats(&audio);
+            double hit_rate = stats.lookups ?
+                100.0 * stats.hits / stats.lookups : 0.0;
+            snprintf(title, sizeof(title),
+                "%s | %d FPS | %u blocks %.1f%% hits | %u dropped %u repeated"
+                " | audio %ums %u under %u over%s",
+                rom_title, frame_count, stats.blocks, hit_rate,
+                display.dropped, display.repeated,
+                audio.fill * 1000 / AUDIO_SAMPLE_RATE, audio.underruns,
+                audio.overruns, get_turbo() ? " | TURBO" : "");
+            set_display_title(title);
+            frame_count = 0;
+            fps_timer = now;
+        }
+
+        deadline += cycles * perf_freq / APU_CLOCK;
+        uint64_t counter = SDL_GetPerformanceCounter();
+        // Fast-forward, or a stall long enough to be noticed, starts the
+        // schedule over instead of racing to catch up
+        if (get_turbo() || counter > deadline + perf_freq / 10)
+            deadline = counter;
+        else if (counter < deadline)
+            SDL_Delay((uint32_t)((deadline - counter) * 1000 / perf_freq));
+    }
+    return 0;
+}
 
 int main(int argc, char **argv)
 {
     cpu_t cpu = {0};
+
+    if (argc > 1 && strcmp(argv[1], "--headless") == 0)
+        return run_headless(argc - 1, argv + 1);
+
     char *path = (argc > 1) ? argv[1] : "./assets/pokemongold.gbc";
 
+    cpu.serial_out = stdout;
     read_rom(path, &cpu);
     init_cpu(&cpu);
     init_display();
-    init_apu();
+    init_apu(&cpu);
+    init_audio_device(&cpu);
     init_save(path, &cpu);
+    reschedule_events(&cpu);
 
     char rom_title[17];
     get_rom_title(&cpu, rom_title, sizeof(rom_title));
     printf("Loaded: %s\n", rom_title);
 
-    uint8_t last_ly = 0;
-    int frame_count = 0;
-    uint32_t fps_timer = SDL_GetTicks();
-
-    double target_frame_time = 1000.0 / 59.73;
-    uint64_t perf_freq = SDL_GetPerformanceFrequency();
-    uint64_t frame_start = SDL_GetPerformanceCounter();
-
-    for (;;) {
-        if (cpu.ime_scheduled > 0) {
-            if (cpu.ime_scheduled == 1) cpu.ime = 1;
-            cpu.ime_scheduled--;
-        }
-
-        int c = 4;
-
-        if (cpu.halted) {
-            if (read_8(&cpu, 0xFF0F) & read_8(&cpu, 0xFFFF))
-                cpu.halted = 0;
-        } else {
-            c = execute_instruction(&cpu);
-            if (cpu.halt_bug) {
-                cpu.pc--;
-                cpu.halt_bug = 0;
-            }
-        }
-
-        update_timers(&cpu, c);
-        int gpu_cycles = cpu.double_speed ? c / 2 : c;
-        update_graphics(&cpu, gpu_cycles);
-        update_audio(gpu_cycles);
-        handle_interrupts(&cpu);
-
-        uint8_t ly = read_8(&cpu, 0xFF44);
-        if (ly == 144 && last_ly != 144) {
-            update_display(&cpu);
-            update_input(&cpu);
-            frame_count++;
-
-            // Update title every second
-            uint32_t now = SDL_GetTicks();
-            if (now - fps_timer >= 1000) {
-                char title[128];
-                snprintf(title, sizeof(title), "%s | %d FPS%s",
-                    rom_title, frame_count, turbo_mode ? " | TURBO" : "");
-                SDL_SetWindowTitle(SDL_GetWindowFromID(1), title);
-                frame_count = 0;
-                fps_timer = now;
-            }
-
-            if (!turbo_mode) {
-                uint64_t frame_end = SDL_GetPerformanceCounter();
-                double elapsed = (double)(frame_end - frame_start) * 1000.0 / perf_freq;
-                if (elapsed < target_frame_time)
-                    SDL_Delay((uint32_t)(target_frame_time - elapsed));
-            }
-            frame_start = SDL_GetPerformanceCounter();
-        }
-        last_ly = ly;
-    }
-}
\ No newline at end of file
+    SDL_Thread *emulation = SDL_CreateThread(run_emulation, "emulation", &cpu);
+    if (!emulation)
+        THROW("Couldn't start the emulation thread", INVALID_FILE);
+    while (update_input())
+        present_display();
+
+    atomic_store(&running, 0);
+    SDL_WaitThread(emulation, NULL);
+    write_save(&cpu);
+    cleanup_display();
+    cleanup_audio_device(&cpu);
+    return 0;
+}
@@ -0,0 +1,250 @@
+#include "cpu.h"
+#include <string.h>
+#include <time.h>
+
+static void switch_rom(cpu_t *cpu, uint32_t bank0, uint32_t bank)
+{
+    uint32_t count = cpu->rom_size / 0x4000;
+
+    if (count == 0)
+        count = 1;
+    cpu->rom_offset[0] = (bank0 % count) * 0x4000;
+    cpu->rom_offset[1] = (bank % count) * 0x4000;
+    map_rom(cpu);
+}
+
+static void switch_sram(cpu_t *cpu, int mapped, uint32_t bank)
+{
+    cpu->sram_mapped = mapped && cpu->ram_enabled && cpu->external_ram;
+    cpu->sram_offset = (cpu->ram_size > 0x2000) ? (bank * 0x2000) % cpu->ram_size : 0;
+    map_sram(cpu);
+}
+
+static uint8_t ram_open_bus(cpu_t *cpu, uint16_t addr)
+{
+    (void)cpu;
+    (void)addr;
+    return 0xFF;
+}
+
+static void ram_ignore(cpu_t *cpu, uint16_t addr, uint8_t val)
+{
+    (void)cpu;
+    (void)addr;
+    (void)val;
+}
+
+// -- ROM only (optionally with RAM, always enabled) --
+
+static void none_write(cpu_t *cpu, uint16_t addr, uint8_t val)
+{
+    (void)cpu;
+    (void)addr;
+    (void)val;
+}
+
+// -- MBC1 / MBC1M --
+// rom_bank holds the 5-bit BANK1 register, ram_bank the 2-bit BANK2 register
+
+static void mbc1_update(cpu_t *cpu)
+{
+    int shift = cpu->mbc->multicart ? 4 : 5;
+    uint32_t low = cpu->rom_bank & (cpu->mbc->multicart ? 0x0F : 0x1F);
+    uint32_t high = cpu->ram_bank << shift;
+
+    switch_rom(cpu, cpu->banking_mode ? high : 0, high | low);
+    switch_sram(cpu, 1, cpu->banking_mode ? cpu->ram_bank : 0);
+}
+
+static void mbc1_write(cpu_t *cpu, uint16_t addr, uint8_t val)
+{
+    if (addr < 0x2000) {
+        cpu->ram_enabled = ((val & 0x0F) == 0x0A);
+    } else if (addr < 0x4000) {
+        cpu->rom_bank = val & 0x1F;
+        if (cpu->rom_bank == 0) cpu->rom_bank = 1;
+    } else if (addr < 0x6000) {
+        cpu->ram_bank = val & 0x03;
+    } else {
+        cpu->banking_mode = val & 0x01;
+    }
+    mbc1_update(cpu);
+}
+
+// -- MBC2: 512x4-bit built-in RAM, mirrored across 0xA000-0xBFFF --
+
+static void mbc2_write(cpu_t *cpu, uint16_t addr, uint8_t val)
+{
+    if (addr >= 0x4000)
+        return;
+    if (addr & 0x0100) {
+        cpu->rom_bank = val & 0x0F;
+        if (cpu->rom_bank == 0) cpu->rom_bank = 1;
+        switch_rom(cpu, 0, cpu->rom_bank);
+    } else {
+        cpu->ram_enabled = ((val & 0x0F) == 0x0A);
+    }
+}
+
+static uint8_t mbc2_read_ram(cpu_t *cpu, uint16_t addr)
+{
+    if (!cpu->ram_enabled || !cpu->external_ram)
+        return 0xFF;
+    return cpu->external_ram[addr & 0x01FF] | 0xF0;
+}
+
+static void mbc2_write_ram(cpu_t *cpu, uint16_t addr, uint8_t val)
+{
+    if (cpu->ram_enabled && cpu->external_ram)
+        cpu->external_ram[addr & 0x01FF] = val & 0x0F;
+}
+
+// -- MBC3 + RTC --
+// rtc[] = seconds, minutes, hours, day low, day high (bit 0 day 8, bit 6 halt, bit 7 carry)
+
+static void rtc_update(cpu_t *cpu)
+{
+    int64_t now = (int64_t)time(NULL);
+    int64_t elapsed = now - cpu->rtc_time;
+
+    cpu->rtc_time = now;
+    if ((cpu->rtc[4] & 0x40) || elapsed <= 0)
+        return;
+
+    uint32_t days = ((cpu->rtc[4] & 0x01) << 8) | cpu->rtc[3];
+    int64_t secs = cpu->rtc[0] + cpu->rtc[1] * 60 + cpu->rtc[2] * 3600
+        + (int64_t)days * 86400 + elapsed;
+
+    cpu->rtc[0] = secs % 60;
+    cpu->rtc[1] = (secs / 60) % 60;
+    cpu->rtc[2] = (secs / 3600) % 24;
+    days = secs / 86400;
+    if (days > 0x1FF)
+        cpu->rtc[4] |= 0x80;
+    cpu->rtc[3] = days & 0xFF;
+    cpu->rtc[4] = (cpu->rtc[4] & 0xFE) | ((days >> 8) & 0x01);
+}
+
+static void mbc3_write(cpu_t *cpu, uint16_t addr, uint8_t val)
+{
+    if (addr < 0x2000) {
+        cpu->ram_enabled = ((val & 0x0F) == 0x0A);
+    } else if (addr < 0x4000) {
+        cpu->rom_bank = val & 0x7F;
+        if (cpu->rom_bank == 0) cpu->rom_bank = 1;
+        switch_rom(cpu, 0, cpu->rom_bank);
+        return;
+    } else if (addr < 0x6000) {
+        cpu->ram_bank = val & 0x0F;
+    } else {
+        if (cpu->rtc_latch == 0 && val == 1) {
+            rtc_update(cpu);
+            memcpy(cpu->rtc_latched, cpu->rtc, sizeof(cpu->rtc));
+        }
+        cpu->rtc_latch = val;
+        return;
+    }
+    // Banks 0x08-0x0C select an RTC register instead of RAM
+    switch_sram(cpu, cpu->ram_bank < 0x08, cpu->ram_bank);
+}
+
+static uint8_t mbc3_read_ram(cpu_t *cpu, uint16_t addr)
+{
+    (void)addr;
+    if (!cpu->ram_enabled || cpu->ram_bank < 0x08 || cpu->ram_bank > 0x0C)
+        return 0xFF;
+    return cpu->rtc_latched[cpu->ram_bank - 0x08];
+}
+
+static void mbc3_write_ram(cpu_t *cpu, uint16_t addr, uint8_t val)
+{
+    static const uint8_t masks[5] = {0x3F, 0x3F, 0x1F, 0xFF, 0xC1};
+
+    (void)addr;
+    if (!cpu->ram_enabled || cpu->ram_bank < 0x08 || cpu->ram_bank > 0x0C)
+        return;
+    rtc_update(cpu);
+    cpu->rtc[cpu->ram_bank - 0x08] = val & masks[cpu->ram_bank - 0x08];
+    cpu->rtc_latched[cpu->ram_bank - 0x08] = cpu->rtc[cpu->ram_bank - 0x08];
+}
+
+// -- MBC5 (+ rumble: RAM bank bit 3 drives the motor) --
+
+static void mbc5_write(cpu_t *cpu, uint16_t addr, uint8_t val)
+{
+    if (addr < 0x2000) {
+        cpu->ram_enabled = ((val & 0x0F) == 0x0A);
+    } else if (addr < 0x3000) {
+        cpu->rom_bank = (cpu->rom_bank & 0x100) | val;
+        switch_rom(cpu, 0, cpu->rom_bank);
+        return;
+    } else if (addr < 0x4000) {
+        cpu->rom_bank = (cpu->rom_bank & 0xFF) | ((val & 0x01) << 8);
+        switch_rom(cpu, 0, cpu->rom_bank);
+        return;
+    } else if (addr < 0x6000) {
+        if (cpu->mbc->rumble) {
+            cpu->rumble = (val >> 3) & 0x01;
+            cpu->ram_bank = val & 0x07;
+        } else {
+            cpu->ram_bank = val & 0x0F;
+        }
+    } else {
+        return;
+    }
+    switch_sram(cpu, 1, cpu->ram_bank);
+}
+
+static const mbc_t mbc_none = {"ROM", 0, 0, none_write, ram_open_bus, ram_ignore};
+static const mbc_t mbc_mbc1 = {"MBC1", 0, 0, mbc1_write, ram_open_bus, ram_ignore};
+static const mbc_t mbc_mbc1m = {"MBC1M", 1, 0, mbc1_write, ram_open_bus, ram_ignore};
+static const mbc_t mbc_mbc2 = {"MBC2", 0, 0, mbc2_write, mbc2_read_ram, mbc2_write_ram};
+static const mbc_t mbc_mbc3 = {"MBC3", 0, 0, mbc3_write, mbc3_read_ram, mbc3_write_ram};
+static const mbc_t mbc_mbc5 = {"MBC5", 0, 0, mbc5_write, ram_open_bus, ram_ignore};
+static const mbc_t mbc_mbc5_rumble = {"MBC5+RUMBLE", 0, 1, mbc5_write, ram_open_bus, ram_ignore};
+
+// MBC1 multicarts are 1MB boards with a second Nintendo logo at bank 0x10
+static int is_mbc1_multicart(cpu_t *cpu)
+{
+    if (cpu->rom_size != 0x100000)
+        return 0;
+    return memcmp(cpu->rom + 0x0104, cpu->rom + 0x40104, 0x30) == 0;
+}
+
+const mbc_t *get_mbc(cpu_t *cpu)
+{
+    switch (cpu->cartridge_type) {
+        case 0x01: case 0x02: case 0x03:
+            return is_mbc1_multicart(cpu) ? &mbc_mbc1m : &mbc_mbc1;
+        case 0x05: case 0x06:
+            return &mbc_mbc2;
+        case 0x0F: case 0x10: case 0x11: case 0x12: case 0x13:
+            return &mbc_mbc3;
+        case 0x19: case 0x1A: case 0x1B:
+            return &mbc_mbc5;
+        case 0x1C: case 0x1D: case 0x1E:
+            return &mbc_mbc5_rumble;
+        default:
+            return &mbc_none;
+    }
+}
+
+void init_mbc(cpu_t *cpu)
+{
+    cpu->mbc = get_mbc(cpu);
+    cpu->rom_bank = 1;
+    cpu->ram_bank = 0;
+    cpu->banking_mode = 0;
+    cpu->rumble = 0;
+    cpu->rtc_latch = 0xFF;
+    cpu->rtc_time = (int64_t)time(NULL);
+    memset(cpu->rtc, 0, sizeof(cpu->rtc));
+    memset(cpu->rtc_latched, 0, sizeof(cpu->rtc_latched));
+
+    // Plain ROM+RAM boards have no enable register
+    cpu->ram_enabled = (cpu->mbc == &mbc_none);
+    cpu->rom_offset[0] = 0;
+    cpu->rom_offset[1] = (cpu->rom_size > 0x4000) ? 0x4000 : 0;
+    cpu->sram_offset = 0;
+    cpu->sram_mapped = cpu->ram_enabled && cpu->external_ram;
+}
@@ -0,0 +1,90 @@
+#include "cpu.h"
+#include <string.h>
+
+// Page backing reads of unmapped ROM/SRAM (open bus)
+static uint8_t open_bus[0x100] = {[0 ... 0xFF] = 0xFF};
+
+static void map_pages(uint8_t **map, int first, int count, uint8_t *base)
+{
+    for (int i = 0; i < count; i++)
+        map[first + i] = base ? base + (i * 0x100) : NULL;
+}
+
+static void map_rom_bank(cpu_t *cpu, int first, uint32_t offset)
+{
+    for (int i = 0; i < 0x40; i++, offset += 0x100) {
+        if (offset + 0x100 <= cpu->rom_size)
+            cpu->read_map[first + i] = cpu->rom + offset;
+        else
+            cpu->read_map[first + i] = open_bus;
+    }
+}
+
+void map_rom(cpu_t *cpu)
+{
+    map_rom_bank(cpu, 0x00, cpu->rom_offset[0]);
+    map_rom_bank(cpu, 0x40, cpu->rom_offset[1]);
+}
+
+// Pages the MBC can't expose directly stay NULL and go through its handlers
+void map_sram(cpu_t *cpu)
+{
+    for (int i = 0; i < 0x20; i++) {
+        uint8_t *page = NULL;
+
+        if (cpu->sram_mapped && cpu->ram_size >= 0x100)
+            page = cpu->external_ram + ((cpu->sram_offset + (i * 0x100)) % cpu->ram_size);
+        cpu->read_map[0xA0 + i] = page;
+        cpu->write_map[0xA0 + i] = page;
+    }
+}
+
+void map_vram(cpu_t *cpu)
+{
+    uint8_t *vram = cpu->vram[cpu->vram_bank];
+
+    map_pages(cpu->read_map, 0x80, 0x20, vram);
+    // Tile data stores go through write_8 to dirty the tile cache, the
+    // tile maps can be written directly
+    map_pages(cpu->write_map, 0x98, 0x08, vram + 0x1800);
+    for (int i = 0x80; i < 0x98; i++)
+        cpu->write_map[i] = NULL;
+}
+
+void map_wram(cpu_t *cpu)
+{
+    uint8_t *bank0 = cpu->wram[0];
+    uint8_t *bankn = cpu->wram[cpu->wram_bank];
+
+    map_pages(cpu->read_map, 0xC0, 0x10, bank0);
+    map_pages(cpu->write_map, 0xC0, 0x10, bank0);
+    map_pages(cpu->read_map, 0xD0, 0x10, bankn);
+    map_pages(cpu->write_map, 0xD0, 0x10, bankn);
+
+    // Echo RAM (0xE000-0xFDFF) mirrors 0xC000-0xDDFF
+    map_pages(cpu->read_map, 0xE0, 0x10, bank0);
+    map_pages(cpu->write_map, 0xE0, 0x10, bank0);
+    map_pages(cpu->read_map, 0xF0, 0x0E, bankn);
+    map_pages(cpu->write_map, 0xF0, 0x0E, bankn);
+
+    // Stores to pages with cached code must go through write_8
+    for (int i = 0xC0; i < 0xFE; i++) {
+        if (page_has_code(cpu, cpu->write_map[i]))
+            cpu->write_map[i] = NULL;
+    }
+}
+
+void init_memory_map(cpu_t *cpu)
+{
+    memset(cpu->read_map, 0, sizeof(cpu->read_map));
+    memset(cpu->write_map, 0, sizeof(cpu->write_map));
+
+    map_rom(cpu);
+    map_vram(cpu);
+    map_sram(cpu);
+    map_wram(cpu);
+
+    // OAM and the unusable area behind it are plain memory
+    cpu->read_map[0xFE] = &IO(cpu, 0xFE00);
+    cpu->write_map[0xFE] = &IO(cpu, 0xFE00);
+}
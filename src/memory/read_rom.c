@@ -1,36 +1,18 @@
 #include "cpu.h"
 #include <stdlib.h>
-#include <stdio.h>
 
-void read_rom(const char *path, cpu_t *cpu)
+// Sets the cartridge up from a ROM image already in memory. The image is
+// used in place and never written, so several consoles can share one; it
+// must outlive the CPU. Returns -1 without touching anything if it is too
+// small to hold a header.
+int load_rom_data(cpu_t *cpu, const uint8_t *data, size_t size)
 {
-    FILE *f = fopen(path, "rb");
-
-    if (f == NULL)
-        THROW("Couldn't read that file.", INVALID_FILE);
-
-    fseek(f, 0, SEEK_END);
-    cpu->rom_size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-
-    cpu->rom = malloc(cpu->rom_size);
-    if (!cpu->rom)
-        THROW("Failed to allocate memory for ROM", INVALID_FILE);
-
-    fread(cpu->rom, 1, cpu->rom_size, f);
-    fclose(f);
-
-    // Initial memory map (Bank 0)
-    for (int i = 0; i < 0x8000 && i < cpu->rom_size; i++) {
-        cpu->memory[i] = cpu->rom[i];
-    }
+    if (size < 0x150)
+        return -1;
+    cpu->rom = (uint8_t *)data;
+    cpu->rom_size = size;
 
     cpu->cartridge_type = cpu->rom[0x0147];
-    cpu->mbc1_bank_low = 1;
-    cpu->mbc1_bank_high = 0;
-    cpu->mbc1_rom_bank_high = 0;
-    cpu->ram_enabled = 0;
-    cpu->banking_mode = 0;
 
     // Detect CGB mode
     uint8_t cgb_flag = cpu->rom[0x0143];
@@ -48,9 +30,31 @@ void read_rom(const char *path, cpu_t *cpu)
         case 0x04: ram_size = 131072; break; // 128KB
         case 0x05: ram_size = 65536; break; // 64KB
     }
+    // MBC2 has 512 half-bytes of RAM built into the mapper
+    if (cpu->cartridge_type == 0x05 || cpu->cartridge_type == 0x06)
+        ram_size = 512;
     if (ram_size > 0) {
         cpu->external_ram = calloc(1, ram_size);
     } else {
         cpu->external_ram = NULL;
     }
-}
\ No newline at end of file
+    cpu->ram_size = ram_size;
+
+    init_mbc(cpu);
+    init_block_cache(cpu);
+    init_tile_cache(cpu);
+    init_memory_map(cpu);
+    update_palettes(cpu);
+    return 0;
+}
+
+void read_rom(const char *path, cpu_t *cpu)
+{
+    const rom_image_t *image = open_rom_image(path);
+
+    if (image == NULL)
+        THROW("Couldn't read that file.", INVALID_FILE);
+    if (load_rom_data(cpu, image->data, image->size) != 0)
+        THROW("Couldn't load that ROM.", INVALID_FILE);
+    cpu->rom_image = image;
+}
@@ -0,0 +1,120 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "cpu.h"
+
+// ROM images are mapped read-only and shared by every console in the
+// process that opens the same file. An entry is found again by path, inode
+// and modification time. The mapping follows the file, so a ROM has to be
+// replaced by renaming a new file over it: instances running the old inode
+// keep it, and the next open gets the new one. Rewriting the file in place
+// (cp over it, dd, a linker writing straight to it) changes the code under
+// running instances, and truncating it makes their next ROM read SIGBUS.
+static rom_image_t *images = NULL;
+static pthread_mutex_t images_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int same_file(const rom_image_t *image, const char *path, const struct stat *st)
+{
+    return image->ino == st->st_ino && image->dev == st->st_dev
+        && image->mtime.tv_sec == st->st_mtim.tv_sec
+        && image->mtime.tv_nsec == st->st_mtim.tv_nsec
+        && strcmp(image->path, path) == 0;
+}
+
+// Pipes, and filesystems that can't map, are read into memory instead
+static int load_image(rom_image_t *image, int fd)
+{
+    void *map = mmap(NULL, image->size, PROT_READ, MAP_SHARED, fd, 0);
+
+    if (map != MAP_FAILED) {
+        image->data = map;
+        image->mapped = 1;
+        return 1;
+    }
+    uint8_t *data = malloc(image->size);
+    size_t done = 0;
+    while (data && done < image->size) {
+        ssize_t n = read(fd, data + done, image->size - done);
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    if (!data || done < image->size) {
+        free(data);
+        return 0;
+    }
+    image->data = data;
+    return 1;
+}
+
+const rom_image_t *open_rom_image(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    rom_image_t *image = NULL;
+
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&images_lock);
+    for (image = images; image && !same_file(image, path, &st); image = image->next);
+    if (image) {
+        image->refs++;
+    } else if ((image = calloc(1, sizeof(rom_image_t)))) {
+        image->path = strdup(path);
+        image->dev = st.st_dev;
+        image->ino = st.st_ino;
+        image->mtime = st.st_mtim;
+        image->size = st.st_size;
+        image->refs = 1;
+        if (!image->path || !load_image(image, fd)) {
+            free(image->path);
+            free(image);
+            image = NULL;
+        } else {
+            image->next = images;
+            images = image;
+        }
+    }
+    pthread_mutex_unlock(&images_lock);
+    close(fd);
+    return image;
+}
+
+void close_rom_image(const rom_image_t *image)
+{
+    rom_image_t **link;
+
+    if (!image)
+        return;
+    pthread_mutex_lock(&images_lock);
+    for (link = &images; *link && *link != image; link = &(*link)->next);
+    if (*link && --(*link)->refs == 0) {
+        rom_image_t *last = *link;
+        *link = last->next;
+        if (last->mapped)
+            munmap(last->data, last->size);
+        else
+            free(last->data);
+        free(last->path);
+        free(last);
+    }
+    pthread_mutex_unlock(&images_lock);
+}
+
+// Drops the CPU's reference to the ROM it was loaded with by read_rom
+void close_rom(cpu_t *cpu)
+{
+    close_rom_image(cpu->rom_image);
+    cpu->rom_image = NULL;
+    cpu->rom = NULL;
+    cpu->rom_size = 0;
+}
@@ -0,0 +1,93 @@
+#include "cpu.h"
+
+// DMG shades, lightest first
+const uint32_t palette[4] = {
+    0xFFFFFFFF,
+    0xFF8BAC0F,
+    0xFF306230,
+    0xFF0F380F
+};
+
+// Every RGB555 colour -> ARGB8888, plain and with the CGB LCD colour
+// correction, so the correction costs nothing per pixel. Shared by all
+// instances and filled at load time, before any thread can start.
+static uint32_t color_luts[2][0x8000];
+
+static uint32_t convert_color(int c, int correct)
+{
+    int r = c & 0x1F, g = (c >> 5) & 0x1F, b = (c >> 10) & 0x1F;
+    int r8 = r << 3, g8 = g << 3, b8 = b << 3;
+
+    if (correct) {
+        // Channel mixing of the CGB screen, washed out toward grey
+        r8 = r * 26 + g * 4 + b * 2;
+        g8 = g * 24 + b * 8;
+        b8 = r * 6 + g * 4 + b * 22;
+        r8 = (r8 > 960 ? 960 : r8) >> 2;
+        g8 = (g8 > 960 ? 960 : g8) >> 2;
+        b8 = (b8 > 960 ? 960 : b8) >> 2;
+    }
+    return 0xFF000000 | (r8 << 16) | (g8 << 8) | b8;
+}
+
+__attribute__((constructor))
+static void build_color_luts(void)
+{
+    for (int c = 0; c < 0x8000; c++) {
+        color_luts[0][c] = convert_color(c, 0);
+        color_luts[1][c] = convert_color(c, 1);
+    }
+}
+
+// One colour of the CGB palette data after a BCPD/OCPD write to `index`
+static void resolve_cgb_color(cpu_t *cpu, const uint8_t *data, uint32_t colors[8][4], int index)
+{
+    int i = index & 0x3E;
+    const uint32_t *lut = color_luts[cpu->color_correction ? 1 : 0];
+
+    colors[i / 8][(i / 2) % 4] = lut[(data[i] | (data[i + 1] << 8)) & 0x7FFF];
+}
+
+static void resolve_dmg_palette(uint8_t reg, uint32_t colors[4])
+{
+    for (int i = 0; i < 4; i++)
+        colors[i] = palette[(reg >> (i * 2)) & 0x03];
+}
+
+void update_cgb_palette(cpu_t *cpu, uint16_t address, uint8_t index)
+{
+    if (address == 0xFF69)
+        resolve_cgb_color(cpu, cpu->bg_palette_data, cpu->bg_colors, index);
+    else
+        resolve_cgb_color(cpu, cpu->obj_palette_data, cpu->obj_colors, index);
+}
+
+// BGP, OBP0, OBP1
+void update_dmg_palette(cpu_t *cpu, uint16_t address)
+{
+    if (address == 0xFF47)
+        resolve_dmg_palette(IO(cpu, 0xFF47), cpu->bg_colors[0]);
+    else
+        resolve_dmg_palette(IO(cpu, address), cpu->obj_colors[address - 0xFF48]);
+}
+
+// Resolve everything again: after loading a ROM or a state, or switching
+// colour correction
+void update_palettes(cpu_t *cpu)
+{
+    if (cpu->cgb_mode) {
+        for (int i = 0; i < 64; i += 2) {
+            resolve_cgb_color(cpu, cpu->bg_palette_data, cpu->bg_colors, i);
+            resolve_cgb_color(cpu, cpu->obj_palette_data, cpu->obj_colors, i);
+        }
+        return;
+    }
+    for (uint16_t address = 0xFF47; address <= 0xFF49; address++)
+        update_dmg_palette(cpu, address);
+}
+
+void set_color_correction(cpu_t *cpu, int on)
+{
+    cpu->color_correction = on ? 1 : 0;
+    update_palettes(cpu);
+}
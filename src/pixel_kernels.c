@@ -0,0 +1,203 @@
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+    #define HAVE_X86_KERNELS 1
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+    #include <arm_neon.h>
+    #define HAVE_NEON_KERNELS 1
+#endif
+
+// The scalar path the renderer always had: one shift and mask per bit
+static void decode_tile_scalar(const uint8_t *data, uint8_t rows[2][8][8])
+{
+    for (int row = 0; row < 8; row++) {
+        uint8_t byte1 = data[row * 2], byte2 = data[row * 2 + 1];
+        for (int col = 0; col < 8; col++) {
+            int bit = 7 - col;
+            uint8_t color_id = ((byte2 >> bit) & 1) << 1 | ((byte1 >> bit) & 1);
+            rows[0][row][col] = color_id;
+            rows[1][row][7 - col] = color_id;
+        }
+    }
+}
+
+static void expand_row_scalar(const uint8_t *pixels, const uint32_t *pal, uint32_t *out)
+{
+    for (int i = 0; i < 8; i++)
+        out[i] = pal[pixels[i]];
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// Each plane byte is broadcast over 8 lanes and tested against one bit
+// per lane; the masks pick the bit for each column, plain or reversed
+__attribute__((target("sse2")))
+static void decode_tile_sse2(const uint8_t *data, uint8_t rows[2][8][8])
+{
+    const __m128i bits = _mm_setr_epi8(-128, 64, 32, 16, 8, 4, 2, 1,
+        -128, 64, 32, 16, 8, 4, 2, 1);
+    const __m128i bits_flip = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+        1, 2, 4, 8, 16, 32, 64, -128);
+    const __m128i one = _mm_set1_epi8(1), two = _mm_set1_epi8(2);
+
+    // Two rows per vector
+    for (int row = 0; row < 8; row += 2) {
+        const uint8_t *d = data + row * 2;
+        __m128i lo = _mm_unpacklo_epi64(_mm_set1_epi8(d[0]), _mm_set1_epi8(d[2]));
+        __m128i hi = _mm_unpacklo_epi64(_mm_set1_epi8(d[1]), _mm_set1_epi8(d[3]));
+        __m128i plain = _mm_or_si128(
+            _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(lo, bits), bits), one),
+            _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(hi, bits), bits), two));
+        __m128i flip = _mm_or_si128(
+            _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(lo, bits_flip), bits_flip), one),
+            _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(hi, bits_flip), bits_flip), two));
+        _mm_storeu_si128((__m128i *)rows[0][row], plain);
+        _mm_storeu_si128((__m128i *)rows[1][row], flip);
+    }
+}
+
+// Four rows per vector: both 128-bit lanes hold the whole tile and a byte
+// shuffle broadcasts each lane's plane bytes
+__attribute__((target("avx2")))
+static void decode_tile_avx2(const uint8_t *data, uint8_t rows[2][8][8])
+{
+    const __m256i bits = _mm256_set1_epi64x(0x0102040810204080LL);
+    const __m256i bits_flip = _mm256_set1_epi64x((long long)0x8040201008040201ULL);
+    const __m256i one = _mm256_set1_epi8(1), two = _mm256_set1_epi8(2);
+    const __m256i tile = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)data));
+
+    for (int half = 0; half < 2; half++) {
+        // Low plane of rows 4*half + 0..3, one row per 8 lanes
+        const __m256i sel_lo = _mm256_setr_epi64x(
+            0x0101010101010101LL * (half * 8 + 0), 0x0101010101010101LL * (half * 8 + 2),
+            0x0101010101010101LL * (half * 8 + 4), 0x0101010101010101LL * (half * 8 + 6));
+        const __m256i sel_hi = _mm256_add_epi8(sel_lo, one);
+        __m256i lo = _mm256_shuffle_epi8(tile, sel_lo);
+        __m256i hi = _mm256_shuffle_epi8(tile, sel_hi);
+        __m256i plain = _mm256_or_si256(
+            _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(lo, bits), bits), one),
+            _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(hi, bits), bits), two));
+        __m256i flip = _mm256_or_si256(
+            _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(lo, bits_flip), bits_flip), one),
+            _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(hi, bits_flip), bits_flip), two));
+        _mm256_storeu_si256((__m256i *)rows[0][half * 4], plain);
+        _mm256_storeu_si256((__m256i *)rows[1][half * 4], flip);
+    }
+}
+
+// Palette in both lanes, one cross-lane permute for all 8 pixels
+__attribute__((target("avx2")))
+static void expand_row_avx2(const uint8_t *pixels, const uint32_t *pal, uint32_t *out)
+{
+    __m256i colors = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)pal));
+    __m256i idx = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)pixels));
+
+    _mm256_storeu_si256((__m256i *)out, _mm256_permutevar8x32_epi32(colors, idx));
+}
+
+#endif
+
+#ifdef HAVE_NEON_KERNELS
+
+static void decode_tile_neon(const uint8_t *data, uint8_t rows[2][8][8])
+{
+    static const uint8_t bit_table[16] = {0x80, 0x40, 0x20, 0x10, 8, 4, 2, 1,
+        1, 2, 4, 8, 16, 32, 64, 0x80};
+    const uint8x8_t bits = vld1_u8(bit_table);
+    const uint8x8_t bits_flip = vld1_u8(bit_table + 8);
+    const uint8x8_t one = vdup_n_u8(1), two = vdup_n_u8(2);
+
+    for (int row = 0; row < 8; row++) {
+        uint8x8_t lo = vdup_n_u8(data[row * 2]);
+        uint8x8_t hi = vdup_n_u8(data[row * 2 + 1]);
+        vst1_u8(rows[0][row], vorr_u8(vand_u8(vtst_u8(lo, bits), one),
+            vand_u8(vtst_u8(hi, bits), two)));
+        vst1_u8(rows[1][row], vorr_u8(vand_u8(vtst_u8(lo, bits_flip), one),
+            vand_u8(vtst_u8(hi, bits_flip), two)));
+    }
+}
+
+// The palette is a 16-byte table: each index becomes the 4 byte offsets
+// of its colour and a single table lookup gathers 4 pixels
+static void expand_row_neon(const uint8_t *pixels, const uint32_t *pal, uint32_t *out)
+{
+    const uint8x16_t table = vld1q_u8((const uint8_t *)pal);
+    const uint8x16_t lanes = vreinterpretq_u8_u32(vdupq_n_u32(0x03020100));
+    uint8x8_t offsets = vshl_n_u8(vld1_u8(pixels), 2);
+    uint8x8x2_t twice = vzip_u8(offsets, offsets);
+    uint8x16x2_t four = vzipq_u8(vcombine_u8(twice.val[0], twice.val[1]),
+        vcombine_u8(twice.val[0], twice.val[1]));
+
+    vst1q_u8((uint8_t *)out, vqtbl1q_u8(table, vaddq_u8(four.val[0], lanes)));
+    vst1q_u8((uint8_t *)(out + 4), vqtbl1q_u8(table, vaddq_u8(four.val[1], lanes)));
+}
+
+#endif
+
+static const pixel_kernels_t all_kernels[] = {
+    {"scalar", decode_tile_scalar, expand_row_scalar},
+#ifdef HAVE_X86_KERNELS
+    // No variable permute before AVX2, and selecting each palette entry by
+    // compare loses to the plain lookups, so SSE2 only decodes
+    {"sse2", decode_tile_sse2, expand_row_scalar},
+    {"avx2", decode_tile_avx2, expand_row_avx2},
+#endif
+#ifdef HAVE_NEON_KERNELS
+    {"neon", decode_tile_neon, expand_row_neon},
+#endif
+};
+
+const pixel_kernels_t *pixel_kernels = &all_kernels[0];
+
+static int kernels_supported(const pixel_kernels_t *k)
+{
+#ifdef HAVE_X86_KERNELS
+    if (k->decode_tile == decode_tile_sse2)
+        return __builtin_cpu_supports("sse2");
+    if (k->decode_tile == decode_tile_avx2)
+        return __builtin_cpu_supports("avx2");
+#endif
+    (void)k;
+    return 1;
+}
+
+// Every implementation this CPU can run, scalar first; used to pick the
+// default and by the benchmark
+int get_pixel_kernels(const pixel_kernels_t **list, int max)
+{
+    int count = 0;
+
+    for (size_t i = 0; i < sizeof(all_kernels) / sizeof(all_kernels[0]); i++) {
+        if (count < max && kernels_supported(&all_kernels[i]))
+            list[count++] = &all_kernels[i];
+    }
+    return count;
+}
+
+// Picks the last (widest) supported set, or the one named by
+// GB_PIXEL_KERNELS when it is available. Runs once at load time so
+// instances on other threads only ever read the choice.
+__attribute__((constructor))
+static void init_pixel_kernels(void)
+{
+    const pixel_kernels_t *list[8];
+    int count;
+    const char *want;
+
+#ifdef HAVE_X86_KERNELS
+    // Constructors can run before the one that fills in the CPU model,
+    // which __builtin_cpu_supports reads
+    __builtin_cpu_init();
+#endif
+    count = get_pixel_kernels(list, 8);
+    want = getenv("GB_PIXEL_KERNELS");
+    pixel_kernels = list[count - 1];
+    for (int i = 0; want && i < count; i++) {
+        if (strcmp(list[i]->name, want) == 0)
+            pixel_kernels = list[i];
+    }
+}
@@ -1,38 +1,53 @@
 #include <SDL2/SDL.h>
-#include <string.h>
+#include <stdatomic.h>
 #include "cpu.h"
 
-static SDL_Window *window = NULL;
-static SDL_Renderer *renderer = NULL;
-static SDL_Texture *texture = NULL;
-static uint32_t screen_pixels[160 * 144];
+static uint8_t turbo_mode = 0;
+static audio_mode_t mode_before_turbo;
 
-extern void set_turbo(uint8_t on);
-extern uint8_t get_turbo(void);
-
-void init_display(void)
+// Fast-forward has no use for sound, so the APU drops to keeping its
+// registers right and the device is paused until normal speed resumes
+void set_turbo(cpu_t *cpu, uint8_t on)
 {
-    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER | SDL_INIT_AUDIO) < 0)
+    if (on == turbo_mode)
         return;
-    window = SDL_CreateWindow("GameBoy Emulator",
-        SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
-        160 * 4, 144 * 4, SDL_WINDOW_SHOWN);
-    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
-    texture = SDL_CreateTexture(renderer,
-        SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, 160, 144);
-    memset(screen_pixels, 0, sizeof(screen_pixels));
+    if (on) {
+        mode_before_turbo = get_audio_mode(cpu);
+        if (mode_before_turbo == AUDIO_FULL)
+            set_audio_mode(cpu, AUDIO_REGISTERS);
+        pause_audio_device();
+    } else {
+        set_audio_mode(cpu, mode_before_turbo);
+    }
+    turbo_mode = on;
 }
 
-void update_input(cpu_t *cpu)
+uint8_t get_turbo(void) { return turbo_mode; }
+
+// Input is read on the main thread, which owns the window, and applied by
+// the emulation thread between frames: held buttons and turbo as they are,
+// key presses as requests it picks up once
+enum {
+    REQUEST_SAVE = 1,
+    REQUEST_LOAD = 2,
+    REQUEST_IDLE_LOOPS = 4,
+    REQUEST_COLOR_CORRECTION = 8
+};
+
+static atomic_uint held_buttons = 0;
+static atomic_uint turbo_held = 0;
+static atomic_uint requests = 0;
+
+// Main thread. Returns 0 once the window has been closed.
+int update_input(void)
 {
     SDL_Event e;
     while (SDL_PollEvent(&e)) {
-        if (e.type == SDL_QUIT) {
-            write_save(cpu);
-            cleanup_apu();
-            exit(0);
-        }
+        if (e.type == SDL_QUIT)
+            return 0;
         if (e.type == SDL_KEYDOWN || e.type == SDL_KEYUP) {
+            int down = e.type == SDL_KEYDOWN;
+            unsigned int request = 0;
             uint8_t bit = 0xFF;
             switch (e.key.keysym.sym) {
                 case SDLK_RIGHT:  bit = 0; break;
@@ -43,61 +58,43 @@ void update_input(cpu_t *cpu)
                 case SDLK_s:      bit = 5; break;
                 case SDLK_SPACE:  bit = 6; break;
                 case SDLK_RETURN: bit = 7; break;
-                case SDLK_TAB:
-                    set_turbo(e.type == SDL_KEYDOWN);
-                    break;
-                case SDLK_F5:
-                    if (e.type == SDL_KEYDOWN) {
-                        save_state(cpu);
-                        write_save(cpu);
-                    }
-                    break;
-                case SDLK_F8:
-                    if (e.type == SDL_KEYDOWN)
-                        load_state(cpu);
-                    break;
+                case SDLK_TAB:    atomic_store(&turbo_held, down); break;
+                case SDLK_F5:     request = REQUEST_SAVE; break;
+                case SDLK_F8:     request = REQUEST_LOAD; break;
+                case SDLK_F9:     request = REQUEST_IDLE_LOOPS; break;
+                case SDLK_F10:    request = REQUEST_COLOR_CORRECTION; break;
                 default: break;
             }
+            if (request && down)
+                atomic_fetch_or(&requests, request);
             if (bit != 0xFF) {
-                if (e.type == SDL_KEYDOWN) {
-                    cpu->joypad_state |= (1 << bit);
-                    write_8(cpu, 0xFF0F, read_8(cpu, 0xFF0F) | 0x10);
-                } else {
-                    cpu->joypad_state &= ~(1 << bit);
-                }
+                if (down)
+                    atomic_fetch_or(&held_buttons, 1 << bit);
+                else
+                    atomic_fetch_and(&held_buttons, ~(1u << bit));
             }
         }
     }
+    return 1;
 }
 
-void handle_interrupts(cpu_t *cpu)
+// Emulation thread, between frames
+void apply_input(cpu_t *cpu)
 {
-    if (!cpu->ime || cpu->halted)
-        return;
-
-    uint8_t pending = read_8(cpu, 0xFF0F) & read_8(cpu, 0xFFFF);
-    uint8_t vectors[] = {0x40, 0x48, 0x50, 0x58, 0x60};
+    uint8_t buttons = atomic_load(&held_buttons);
+    unsigned int todo = atomic_exchange(&requests, 0);
 
-    for (int i = 0; i < 5; i++) {
-        if (pending & (1 << i)) {
-            cpu->ime = 0;
-            write_8(cpu, 0xFF0F, read_8(cpu, 0xFF0F) & ~(1 << i));
-            stack_push16(cpu, cpu->pc);
-            cpu->pc = vectors[i];
-            return;
-        }
+    if (buttons != cpu->joypad_state)
+        set_joypad(cpu, buttons);
+    set_turbo(cpu, atomic_load(&turbo_held));
+    if (todo & REQUEST_SAVE) {
+        save_state(cpu);
+        write_save(cpu);
     }
+    if (todo & REQUEST_LOAD)
+        load_state(cpu);
+    if (todo & REQUEST_IDLE_LOOPS)
+        print_idle_loops(cpu);
+    if (todo & REQUEST_COLOR_CORRECTION)
+        set_color_correction(cpu, !cpu->color_correction);
 }
-
-void update_display(cpu_t *cpu)
-{
-    if (!(cpu->memory[0xFF40] & 0x80))
-        return;
-    render_background(cpu, screen_pixels);
-    render_window(cpu, screen_pixels);
-    render_sprites(cpu, screen_pixels);
-    SDL_UpdateTexture(texture, NULL, screen_pixels, 160 * sizeof(uint32_t));
-    SDL_RenderClear(renderer);
-    SDL_RenderCopy(renderer, texture, NULL, NULL);
-    SDL_RenderPresent(renderer);
-}
\ No newline at end of file
@@ -1,23 +1,8 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "cpu.h"
 
-static char sav_path[512];
-static char state_path[512];
-static uint32_t ram_size_for_cart = 0;
-
-static uint32_t get_ram_size(uint8_t ram_byte)
-{
-    switch (ram_byte) {
-        case 0x01: return 2048;
-        case 0x02: return 8192;
-        case 0x03: return 32768;
-        case 0x04: return 131072;
-        case 0x05: return 65536;
-        default:   return 0;
-    }
-}
-
 static int cart_has_battery(uint8_t type)
 {
     return type == 0x03 || type == 0x06 || type == 0x09 ||
@@ -26,27 +11,31 @@ static int cart_has_battery(uint8_t type)
         type == 0x22 || type == 0xFF;
 }
 
-void init_save(const char *rom_path, cpu_t *cpu)
+// ROM path with its extension replaced, e.g. game.gb -> game.sav
+static int get_save_path(cpu_t *cpu, const char *ext, char *path, size_t size)
 {
-    ram_size_for_cart = get_ram_size(cpu->rom[0x0149]);
-
-    // Build .sav path from ROM path
-    strncpy(sav_path, rom_path, sizeof(sav_path) - 5);
-    char *dot = strrchr(sav_path, '.');
+    if (!cpu->rom_path)
+        return 0;
+    strncpy(path, cpu->rom_path, size - 8);
+    path[size - 8] = '\0';
+    char *dot = strrchr(path, '.');
     if (dot) *dot = '\0';
-    strcat(sav_path, ".sav");
+    strcat(path, ext);
+    return 1;
+}
 
-    // Build .state path
-    strncpy(state_path, rom_path, sizeof(state_path) - 7);
-    dot = strrchr(state_path, '.');
-    if (dot) *dot = '\0';
-    strcat(state_path, ".state");
+void init_save(const char *rom_path, cpu_t *cpu)
+{
+    char sav_path[512];
+
+    cpu->rom_path = rom_path;
 
     // Load existing save
-    if (cart_has_battery(cpu->cartridge_type) && cpu->external_ram && ram_size_for_cart > 0) {
+    if (cart_has_battery(cpu->cartridge_type) && cpu->external_ram && cpu->ram_size > 0
+        && get_save_path(cpu, ".sav", sav_path, sizeof(sav_path))) {
         FILE *f = fopen(sav_path, "rb");
         if (f) {
-            fread(cpu->external_ram, 1, ram_size_for_cart, f);
+            fread(cpu->external_ram, 1, cpu->ram_size, f);
             fclose(f);
         }
     }
@@ -54,47 +43,88 @@ void init_save(const char *rom_path, cpu_t *cpu)
 
 void write_save(cpu_t *cpu)
 {
-    if (!cart_has_battery(cpu->cartridge_type) || !cpu->external_ram || ram_size_for_cart == 0)
+    char sav_path[512];
+
+    if (!cart_has_battery(cpu->cartridge_type) || !cpu->external_ram || cpu->ram_size == 0)
+        return;
+    if (!get_save_path(cpu, ".sav", sav_path, sizeof(sav_path)))
         return;
     FILE *f = fopen(sav_path, "wb");
     if (f) {
-        fwrite(cpu->external_ram, 1, ram_size_for_cart, f);
+        fwrite(cpu->external_ram, 1, cpu->ram_size, f);
         fclose(f);
     }
 }
 
-// Save state: dump the entire CPU struct + external RAM
-void save_state(cpu_t *cpu)
-{
-    FILE *f = fopen(state_path, "wb");
-    if (!f) return;
+// A state is the emulated part of the CPU struct, everything before the
+// framebuffer, followed by the external RAM. No host pointer comes before
+// the framebuffer. Returns the size it needs, and only writes it if `size`
+// is enough.
+#define STATE_SIZE offsetof(cpu_t, framebuffer)
 
-    fwrite(cpu, sizeof(cpu_t), 1, f);
-    if (cpu->external_ram && ram_size_for_cart > 0)
-        fwrite(cpu->external_ram, 1, ram_size_for_cart, f);
+size_t serialize_state(cpu_t *cpu, void *buf, size_t size)
+{
+    size_t needed = STATE_SIZE + cpu->ram_size;
 
-    fclose(f);
+    if (buf && size >= needed) {
+        memcpy(buf, cpu, STATE_SIZE);
+        if (cpu->external_ram && cpu->ram_size > 0)
+            memcpy((uint8_t *)buf + STATE_SIZE, cpu->external_ram, cpu->ram_size);
+    }
+    return needed;
 }
 
-void load_state(cpu_t *cpu)
+int deserialize_state(cpu_t *cpu, const void *buf, size_t size)
 {
-    FILE *f = fopen(state_path, "rb");
-    if (!f) return;
+    if (size != STATE_SIZE + cpu->ram_size)
+        return -1;
+
+    memcpy(cpu, buf, STATE_SIZE);
+    if (cpu->external_ram && cpu->ram_size > 0)
+        memcpy(cpu->external_ram, (const uint8_t *)buf + STATE_SIZE, cpu->ram_size);
+
+    // The page tables still point at the old banks, and the RAM behind
+    // any cached code or tiles has just been replaced
+    init_block_cache(cpu);
+    init_tile_cache(cpu);
+    init_memory_map(cpu);
+    update_palettes(cpu);
+    reschedule_events(cpu);
+    return 0;
+}
 
-    // Save pointers that can't be serialized
-    uint8_t *rom = cpu->rom;
-    uint32_t rom_size = cpu->rom_size;
-    uint8_t *ext_ram = cpu->external_ram;
+void save_state(cpu_t *cpu)
+{
+    char state_path[512];
+    size_t size = serialize_state(cpu, NULL, 0);
+    void *buf = malloc(size);
 
-    fread(cpu, sizeof(cpu_t), 1, f);
+    if (!buf || !get_save_path(cpu, ".state", state_path, sizeof(state_path))) {
+        free(buf);
+        return;
+    }
+    serialize_state(cpu, buf, size);
+    FILE *f = fopen(state_path, "wb");
+    if (f) {
+        fwrite(buf, 1, size, f);
+        fclose(f);
+    }
+    free(buf);
+}
 
-    // Restore pointers
-    cpu->rom = rom;
-    cpu->rom_size = rom_size;
-    cpu->external_ram = ext_ram;
+void load_state(cpu_t *cpu)
+{
+    char state_path[512];
 
-    if (cpu->external_ram && ram_size_for_cart > 0)
-        fread(cpu->external_ram, 1, ram_size_for_cart, f);
+    if (!get_save_path(cpu, ".state", state_path, sizeof(state_path)))
+        return;
+    FILE *f = fopen(state_path, "rb");
+    if (!f) return;
 
+    size_t size = serialize_state(cpu, NULL, 0);
+    void *buf = malloc(size);
+    if (buf && fread(buf, 1, size, f) == size)
+        deserialize_state(cpu, buf, size);
+    free(buf);
     fclose(f);
 }
@@ -0,0 +1,171 @@
+#include <limits.h>
+#include <string.h>
+#include "cpu.h"
+
+// Apply the cycles the CPU has run since the last sync to the peripherals
+void sync_cycles(cpu_t *cpu)
+{
+    int c = cpu->pending_cycles;
+
+    if (c == 0)
+        return;
+    cpu->pending_cycles = 0;
+    cpu->cycles += c;
+    update_serial(cpu, c);
+    int gpu_cycles = cpu->double_speed ? c / 2 : c;
+    update_graphics(cpu, gpu_cycles);
+    update_audio(cpu, gpu_cycles);
+}
+
+void cancel_event(cpu_t *cpu, event_type_t type)
+{
+    for (int i = 0; i < cpu->event_count; i++) {
+        if (cpu->events[i].type != type)
+            continue;
+        cpu->event_count--;
+        memmove(&cpu->events[i], &cpu->events[i + 1],
+            (cpu->event_count - i) * sizeof(event_t));
+        return;
+    }
+}
+
+// Insert into the sorted queue, replacing any pending event of that type
+void schedule_event(cpu_t *cpu, event_type_t type, uint64_t when)
+{
+    int i;
+
+    cancel_event(cpu, type);
+    for (i = cpu->event_count; i > 0 && cpu->events[i - 1].when > when; i--)
+        cpu->events[i] = cpu->events[i - 1];
+    cpu->events[i].when = when;
+    cpu->events[i].type = type;
+    cpu->event_count++;
+}
+
+// Deadlines are recomputed from the caught-up peripheral state, so an
+// event firing just means "sync and look again"
+static void schedule_ppu(cpu_t *cpu)
+{
+    int next = ppu_cycles_to_event(cpu);
+
+    if (cpu->double_speed)
+        next *= 2;
+    schedule_event(cpu, EVENT_PPU, cpu->cycles + cpu->pending_cycles + next);
+}
+
+static void schedule_timer(cpu_t *cpu)
+{
+    int next = timer_cycles_to_event(cpu);
+
+    if (next == INT_MAX)
+        cancel_event(cpu, EVENT_TIMER);
+    else
+        schedule_event(cpu, EVENT_TIMER, cpu->cycles + cpu->pending_cycles + next);
+}
+
+static void schedule_serial(cpu_t *cpu)
+{
+    if (cpu->serial_timer > 0)
+        schedule_event(cpu, EVENT_SERIAL, cpu->cycles + cpu->pending_cycles + cpu->serial_timer);
+    else
+        cancel_event(cpu, EVENT_SERIAL);
+}
+
+static void (*const event_handlers[EVENT_COUNT])(cpu_t *) = {
+    [EVENT_PPU] = schedule_ppu,
+    [EVENT_TIMER] = schedule_timer,
+    [EVENT_SERIAL] = schedule_serial,
+};
+
+// After loading a ROM or a state, or a CPU speed switch
+void reschedule_events(cpu_t *cpu)
+{
+    cpu->event_count = 0;
+    for (int i = 0; i < EVENT_COUNT; i++)
+        event_handlers[i](cpu);
+}
+
+// Register writes that can move a deadline; the write has already synced
+void reschedule_io(cpu_t *cpu, uint16_t address)
+{
+    if (address >= 0xFF04 && address <= 0xFF07)
+        schedule_timer(cpu);
+    else if (address >= 0xFF40 && address <= 0xFF45)
+        schedule_ppu(cpu);
+    else if (address == 0xFF02)
+        schedule_serial(cpu);
+}
+
+// Catch the peripherals up, then fire every event that is due
+void run_events(cpu_t *cpu)
+{
+    sync_cycles(cpu);
+    while (cpu->event_count && cpu->events[0].when <= cpu->cycles)
+        event_handlers[cpu->events[0].type](cpu);
+}
+
+// Cycles a halted CPU waits before checking IF again. Only an event can
+// raise an interrupt, so skip to the next one in whole 4-cycle steps,
+// unless an EI delay still has to be stepped.
+int halt_cycles(cpu_t *cpu)
+{
+    if (!cpu->halted || cpu->ime_scheduled)
+        return 4;
+    int next = cycles_to_next_event(cpu);
+    if (next > HALT_SKIP_MAX)
+        next = HALT_SKIP_MAX;
+    return (next + 3) & ~3;
+}
+
+// CPU cycles the core may run before the earliest event
+int cycles_to_next_event(cpu_t *cpu)
+{
+    uint64_t now = cpu->cycles + cpu->pending_cycles;
+
+    if (!cpu->event_count)
+        return INT_MAX;
+    if (cpu->events[0].when <= now)
+        return 1;
+    uint64_t next = cpu->events[0].when - now;
+    return next < INT_MAX ? (int)next : INT_MAX;
+}
+
+// One pass of the main loop: run the CPU (or wait in HALT) up to the next
+// event, fire it and dispatch any interrupt it raised
+void run_to_next_event(cpu_t *cpu)
+{
+    if (cpu->halted) {
+        if (cpu->ime_scheduled > 0) {
+            if (cpu->ime_scheduled == 1) cpu->ime = 1;
+            cpu->ime_scheduled--;
+        }
+        if (read_8(cpu, 0xFF0F) & read_8(cpu, 0xFFFF))
+            cpu->halted = 0;
+        cpu->pending_cycles += halt_cycles(cpu);
+    } else {
+        cpu_run(cpu, cycles_to_next_event(cpu));
+    }
+
+    run_events(cpu);
+    handle_interrupts(cpu);
+}
+
+// Runs until LY reaches 144, the end of a frame, or for a frame's worth of
+// cycles when the LCD is off and that never happens. LY is read through
+// read_8 so the peripherals are synced just as in the frontend loop; the
+// caller keeps `last_ly` between frames. Returns the cycles it took.
+uint64_t run_frame(cpu_t *cpu, uint8_t *last_ly)
+{
+    uint64_t start = cpu->cycles;
+    uint64_t limit = (uint64_t)HALT_SKIP_MAX << cpu->double_speed;
+
+    while (cpu->cycles - start < limit) {
+        run_to_next_event(cpu);
+        uint8_t ly = read_8(cpu, 0xFF44);
+        int frame_done = ly == 144 && *last_ly != 144;
+        *last_ly = ly;
+        if (frame_done)
+            break;
+    }
+    return cpu->cycles - start;
+}
@@ -0,0 +1,40 @@
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+
+void init_tile_cache(cpu_t *cpu)
+{
+    if (!cpu->tiles) {
+        cpu->tiles = malloc(sizeof(tile_cache_t));
+        if (!cpu->tiles)
+            THROW("Failed to allocate the tile cache", INVALID_FILE);
+    }
+    // Nothing decoded yet
+    memset(cpu->tiles->dirty, 0xFF, sizeof(cpu->tiles->dirty));
+}
+
+// Called for every store to 0x8000-0x97FF (CPU, GDMA and HDMA alike)
+void mark_tile_dirty(cpu_t *cpu, uint16_t address)
+{
+    int bank = cpu->cgb_mode ? cpu->vram_bank : 0;
+    int tile = (address - 0x8000) >> 4;
+
+    cpu->tiles->dirty[bank][tile >> 3] |= 1 << (tile & 7);
+}
+
+static void decode_tile(cpu_t *cpu, int bank, int tile)
+{
+    const uint8_t *vram = cpu->vram[bank];
+
+    pixel_kernels->decode_tile(vram + tile * 16, cpu->tiles->rows[bank][tile]);
+    cpu->tiles->dirty[bank][tile >> 3] &= ~(1 << (tile & 7));
+}
+
+// 8 colour indices for one row of a tile, left to right as drawn. Bank 1
+// is only ever asked for in CGB mode.
+const uint8_t *get_tile_row(cpu_t *cpu, int bank, int tile, int row, int flip)
+{
+    if (cpu->tiles->dirty[bank][tile >> 3] & (1 << (tile & 7)))
+        decode_tile(cpu, bank, tile);
+    return cpu->tiles->rows[bank][tile][flip ? 1 : 0][row];
+}
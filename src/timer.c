@@ -1,44 +1,93 @@
+#include <limits.h>
 #include "cpu.h"
 
-void update_timers(cpu_t *cpu, int cycles)
+// TAC clock select -> divider bit whose falling edge clocks TIMA
+static const int bit_table[] = {9, 3, 5, 7};
+
+static uint64_t timer_now(cpu_t *cpu)
 {
-    uint8_t tac = cpu->memory[0xFF07];
-    if (tac & 0x04) {
-        static const int bit_table[] = {9, 3, 5, 7};
-        int bit = bit_table[tac & 0x03];
-        uint16_t prev = cpu->div_counter;
-        uint16_t next = prev + (uint16_t)cycles;
-
-        /* Count falling edges of the selected bit in [prev+1, next] */
-        int edges;
-        if (next >= prev) {
-            edges = (next >> (bit + 1)) - (prev >> (bit + 1));
-        } else {
-            /* uint16_t wraparound */
-            edges = ((0x10000 >> (bit + 1)) - (prev >> (bit + 1)))
-                  + (next >> (bit + 1));
-        }
-        for (int i = 0; i < edges; i++) {
-            uint8_t tima = cpu->memory[0xFF05];
-            if (tima == 0xFF) {
-                cpu->memory[0xFF05] = cpu->memory[0xFF06];
-                cpu->memory[0xFF0F] |= 0x04;
-            } else {
-                cpu->memory[0xFF05] = tima + 1;
-            }
-        }
+    return cpu->cycles + cpu->pending_cycles;
+}
+
+// Clock TIMA `edges` times, reloading from TMA and requesting the
+// interrupt on overflow
+static void tima_add(cpu_t *cpu, uint64_t edges)
+{
+    uint64_t left = 0x100 - IO(cpu, 0xFF05);
+
+    if (edges < left) {
+        IO(cpu, 0xFF05) += edges;
+        return;
     }
+    edges -= left;
+    IO(cpu, 0xFF05) = IO(cpu, 0xFF06) + edges % (0x100 - IO(cpu, 0xFF06));
+    IO(cpu, 0xFF0F) |= 0x04;
+}
 
-    cpu->div_counter += cycles;
-    cpu->memory[0xFF04] = (cpu->div_counter >> 8);
+// Bring TIMA up to the current cycle by counting the falling edges of the
+// selected divider bit since the last update
+void update_timers(cpu_t *cpu)
+{
+    uint64_t now = timer_now(cpu);
+    uint8_t tac = IO(cpu, 0xFF07);
 
+    if ((tac & 0x04) && now > cpu->tima_cycle) {
+        int shift = bit_table[tac & 0x03] + 1;
+        uint64_t edges = ((now - cpu->div_base) >> shift)
+            - ((cpu->tima_cycle - cpu->div_base) >> shift);
+        if (edges)
+            tima_add(cpu, edges);
+    }
+    cpu->tima_cycle = now;
+}
+
+uint8_t read_timer(cpu_t *cpu, uint16_t address)
+{
+    if (address == 0xFF04)
+        return (timer_now(cpu) - cpu->div_base) >> 8;
+    update_timers(cpu);
+    return IO(cpu, address);
+}
+
+void write_timer(cpu_t *cpu, uint16_t address, uint8_t value)
+{
+    uint64_t now = timer_now(cpu);
+    uint8_t tac = IO(cpu, 0xFF07);
+
+    update_timers(cpu);
+    if (address == 0xFF04) {
+        // Resetting the divider while the selected bit is high is a
+        // falling edge, so TIMA ticks once more
+        if ((tac & 0x04) && (((now - cpu->div_base) >> bit_table[tac & 0x03]) & 1))
+            tima_add(cpu, 1);
+        cpu->div_base = now;
+        return;
+    }
+    IO(cpu, address) = value;
+}
+
+void update_serial(cpu_t *cpu, int cycles)
+{
     if (cpu->serial_timer > 0) {
         cpu->serial_timer -= cycles;
         if (cpu->serial_timer <= 0) {
             cpu->serial_timer = 0;
-            cpu->memory[0xFF02] &= 0x7F;
-            cpu->memory[0xFF01] = 0xFF;
-            cpu->memory[0xFF0F] |= 0x08;
+            IO(cpu, 0xFF02) &= 0x7F;
+            IO(cpu, 0xFF01) = 0xFF;
+            IO(cpu, 0xFF0F) |= 0x08;
         }
     }
-}
\ No newline at end of file
+}
+
+// Cycles until TIMA overflows and requests the timer interrupt
+int timer_cycles_to_event(cpu_t *cpu)
+{
+    uint8_t tac = IO(cpu, 0xFF07);
+
+    if (!(tac & 0x04))
+        return INT_MAX;
+    update_timers(cpu);
+    int period = 1 << (bit_table[tac & 0x03] + 1);
+    int next_edge = period - ((timer_now(cpu) - cpu->div_base) & (period - 1));
+    return next_edge + (0xFF - IO(cpu, 0xFF05)) * period;
+}
@@ -0,0 +1,256 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cpu.h"
+
+// Audio benchmark and offline quality check.
+//   ./bench_audio [-s seconds] rom...
+// runs each ROM in every audio mode, and mixed with all channels muted,
+// and reports the CPU time each takes per emulated second and how much
+// faster than full mixing it runs. The same goes first for the APU on its
+// own with all four channels playing, where the difference isn't buried
+// under the rest of the emulation. The runs take turns, REPEATS rounds of
+// them, and the fastest of each is kept, so a busy machine skews them less.
+//   ./bench_audio -w out.wav
+// drives channel 2 directly through its registers, renders one second of
+// each test tone to a WAV file and reports how far each is above its
+// aliasing. Every tone divides the 4 MHz clock and the output rate evenly,
+// so its harmonics and their aliases land on exact 1 Hz DFT bins.
+
+#define TONE_SKIP (AUDIO_SAMPLE_RATE / 10) // let the output settle first
+#define REPEATS 5
+
+typedef struct {
+    audio_sink_t sink;
+    int16_t *samples;
+    size_t count;
+    size_t capacity;
+} capture_t;
+
+static void discard_samples(audio_sink_t *sink, const int16_t *samples, int frames)
+{
+    (void)sink;
+    (void)samples;
+    (void)frames;
+}
+
+static audio_sink_t discard = {discard_samples, NULL, NULL};
+
+static void capture_samples(audio_sink_t *sink, const int16_t *samples, int frames)
+{
+    capture_t *cap = (capture_t *)sink;
+
+    if (cap->count + frames > cap->capacity)
+        frames = cap->capacity - cap->count;
+    memcpy(cap->samples + cap->count * 2, samples, frames * 2 * sizeof(int16_t));
+    cap->count += frames;
+}
+
+static double cpu_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// CPU seconds to emulate `seconds` of a ROM from power-on
+static double time_rom(const char *path, int seconds, audio_mode_t mode, uint8_t mute)
+{
+    cpu_t *cpu = aligned_alloc(alignof(cpu_t), sizeof(cpu_t));
+    uint8_t last_ly = 0;
+
+    if (!cpu)
+        THROW("Failed to allocate the CPU", INVALID_FILE);
+    memset(cpu, 0, sizeof(cpu_t));
+    read_rom(path, cpu);
+    init_cpu(cpu);
+    init_apu(cpu);
+    add_audio_sink(cpu, &discard);
+    set_audio_mode(cpu, mode);
+    set_audio_mute(cpu, mute);
+    reschedule_events(cpu);
+
+    int frames = (int64_t)seconds * APU_CLOCK / HALT_SKIP_MAX;
+    double start = cpu_seconds();
+    for (int f = 0; f < frames; f++)
+        run_frame(cpu, &last_ly);
+    double elapsed = cpu_seconds() - start;
+
+    close_rom(cpu);
+    free(cpu->external_ram);
+    free(cpu->blocks);
+    free(cpu->tiles);
+    free(cpu->apu);
+    free(cpu);
+    return elapsed;
+}
+
+// CPU seconds for the APU alone to play `seconds` of all four channels at
+// once: two pulses, a wave and the fastest noise, fed a scanline at a time
+static double time_channels(const char *path, int seconds, audio_mode_t mode, uint8_t mute)
+{
+    static const uint8_t writes[][2] = {
+        {0x26, 0x80}, {0x24, 0x77}, {0x25, 0xFF},
+        {0x11, 0x80}, {0x12, 0xF0}, {0x13, 0x00}, {0x14, 0x87},
+        {0x16, 0x40}, {0x17, 0xF0}, {0x18, 0x80}, {0x19, 0x87},
+        {0x30, 0x01}, {0x31, 0x23}, {0x32, 0x45}, {0x33, 0x67},
+        {0x34, 0x89}, {0x35, 0xAB}, {0x36, 0xCD}, {0x37, 0xEF},
+        {0x1A, 0x80}, {0x1C, 0x20}, {0x1D, 0x00}, {0x1E, 0x86},
+        {0x21, 0xF0}, {0x22, 0x00}, {0x23, 0x80},
+    };
+    cpu_t *cpu = aligned_alloc(alignof(cpu_t), sizeof(cpu_t));
+
+    (void)path;
+    if (!cpu)
+        THROW("Failed to allocate the CPU", INVALID_FILE);
+    memset(cpu, 0, sizeof(cpu_t));
+    init_apu(cpu);
+    add_audio_sink(cpu, &discard);
+    set_audio_mode(cpu, mode);
+    set_audio_mute(cpu, mute);
+    for (size_t i = 0; i < sizeof(writes) / sizeof(writes[0]); i++)
+        apu_write(cpu, 0xFF00 | writes[i][0], writes[i][1]);
+
+    int64_t lines = (int64_t)seconds * APU_CLOCK / 456;
+    double start = cpu_seconds();
+    for (int64_t l = 0; l < lines; l++)
+        update_audio(cpu, 456);
+    double elapsed = cpu_seconds() - start;
+
+    free(cpu->apu);
+    free(cpu);
+    return elapsed;
+}
+
+static void bench(const char *path, int seconds,
+    double (*run)(const char *, int, audio_mode_t, uint8_t))
+{
+    static const struct {
+        const char *name;
+        audio_mode_t mode;
+        uint8_t mute;
+    } runs[] = {
+        {"full", AUDIO_FULL, 0},
+        {"muted", AUDIO_FULL, 0xF},
+        {"registers", AUDIO_REGISTERS, 0},
+        {"off", AUDIO_OFF, 0},
+    };
+    int count = sizeof(runs) / sizeof(runs[0]);
+    double best[sizeof(runs) / sizeof(runs[0])];
+
+    for (int r = 0; r < REPEATS; r++) {
+        for (int i = 0; i < count; i++) {
+            double t = run(path, seconds, runs[i].mode, runs[i].mute);
+            if (r == 0 || t < best[i])
+                best[i] = t;
+        }
+    }
+    printf("%s\n", path);
+    for (int i = 0; i < count; i++)
+        printf("  %-10s %7.2f ms/s  %5.2fx\n", runs[i].name,
+            best[i] * 1000 / seconds, best[0] / best[i]);
+}
+
+// Power in the tone's harmonics against everything else but DC, in dB
+static double alias_ratio(const int16_t *samples, int count, int freq)
+{
+    double mean = 0, total = 0, harmonics = 0;
+
+    for (int i = 0; i < count; i++)
+        mean += samples[i * 2];
+    mean /= count;
+    for (int i = 0; i < count; i++)
+        total += (samples[i * 2] - mean) * (samples[i * 2] - mean);
+    for (int f = freq; f < AUDIO_SAMPLE_RATE / 2; f += freq) {
+        double re = 0, im = 0;
+        for (int i = 0; i < count; i++) {
+            double phase = 2 * M_PI * (double)f * i / count;
+            re += samples[i * 2] * cos(phase);
+            im -= samples[i * 2] * sin(phase);
+        }
+        harmonics += 2 * (re * re + im * im) / count;
+    }
+    if (harmonics >= total)
+        return INFINITY;
+    return 10 * log10(harmonics / (total - harmonics));
+}
+
+// Channel 2 at full volume with no envelope or length, on both sides
+static void render_tone(capture_t *cap, audio_sink_t *wav, int period_code, int duty)
+{
+    cpu_t *cpu = aligned_alloc(alignof(cpu_t), sizeof(cpu_t));
+    uint16_t freq = 2048 - period_code;
+
+    if (!cpu)
+        THROW("Failed to allocate the CPU", INVALID_FILE);
+    memset(cpu, 0, sizeof(cpu_t));
+    init_apu(cpu);
+    add_audio_sink(cpu, &cap->sink);
+    add_audio_sink(cpu, wav);
+    apu_write(cpu, 0xFF26, 0x80);
+    apu_write(cpu, 0xFF24, 0x77);
+    apu_write(cpu, 0xFF25, 0x22);
+    apu_write(cpu, 0xFF16, duty << 6);
+    apu_write(cpu, 0xFF17, 0xF0);
+    apu_write(cpu, 0xFF18, freq & 0xFF);
+    apu_write(cpu, 0xFF19, 0x80 | (freq >> 8));
+
+    size_t end = cap->count + TONE_SKIP + AUDIO_SAMPLE_RATE;
+    while (cap->count < end && cap->count < cap->capacity)
+        update_audio(cpu, 4096);
+    free(cpu->apu);
+    free(cpu);
+}
+
+static void render_tones(const char *path)
+{
+    // The pulse runs at 131072 / period_code Hz
+    static const int period_codes[] = {128, 64, 32, 16};
+    static const int duties[] = {2, 0};
+    int count = sizeof(period_codes) / sizeof(period_codes[0]) * 2;
+    capture_t cap = {.sink.write = capture_samples};
+    audio_sink_t *wav = create_file_sink(path, 1);
+
+    cap.capacity = (size_t)count * (TONE_SKIP + AUDIO_SAMPLE_RATE + AUDIO_BUFFER_SIZE);
+    cap.samples = malloc(cap.capacity * 2 * sizeof(int16_t));
+    if (!cap.samples || !wav)
+        THROW("Failed to set up the capture", INVALID_FILE);
+    for (int d = 0; d < 2; d++) {
+        for (int i = 0; i < count / 2; i++) {
+            size_t start = cap.count + TONE_SKIP;
+            render_tone(&cap, wav, period_codes[i], duties[d]);
+            printf("%5d Hz, duty %4.1f%%: %6.1f dB above aliasing\n",
+                131072 / period_codes[i], duties[d] == 2 ? 50.0 : 12.5,
+                alias_ratio(cap.samples + start * 2, AUDIO_SAMPLE_RATE, 131072 / period_codes[i]));
+        }
+    }
+    destroy_audio_sink(wav);
+    printf("wrote %s\n", path);
+    free(cap.samples);
+}
+
+int main(int argc, char **argv)
+{
+    int seconds = 10;
+    int i = 1;
+
+    if (argc == 3 && strcmp(argv[1], "-w") == 0) {
+        render_tones(argv[2]);
+        return 0;
+    }
+    if (argc > 2 && strcmp(argv[1], "-s") == 0) {
+        seconds = atoi(argv[2]);
+        i = 3;
+    }
+    if (i >= argc || seconds <= 0) {
+        fprintf(stderr, "usage: %s [-s seconds] rom...\n       %s -w out.wav\n", argv[0], argv[0]);
+        return 1;
+    }
+    bench("all four channels, APU alone", seconds, time_channels);
+    for (; i < argc; i++)
+        bench(argv[i], seconds, time_rom);
+    return 0;
+}
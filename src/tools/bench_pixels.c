@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cpu.h"
+
+// Times every pixel kernel set this CPU supports against the scalar one on
+// the VRAM a ROM has built up after running for a while, and checks they
+// all produce the same pixels.
+//   ./bench_pixels [-f frames] rom...
+
+#define MIN_NS 200000000ULL // per kernel and per measurement
+
+typedef struct {
+    uint8_t data[2][TILE_COUNT * 16];
+    uint8_t rows[2][TILE_COUNT][2][8][8];
+    uint32_t pal[4];
+    int banks;
+} vram_dump_t;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void run_frames(cpu_t *cpu, int frames)
+{
+    uint8_t last_ly = 0;
+
+    while (frames > 0) {
+        run_to_next_event(cpu);
+        uint8_t ly = read_8(cpu, 0xFF44);
+        if (ly == 144 && last_ly != 144)
+            frames--;
+        last_ly = ly;
+    }
+}
+
+static void dump_vram(const char *path, int frames, vram_dump_t *dump)
+{
+    cpu_t *cpu = aligned_alloc(alignof(cpu_t), sizeof(cpu_t));
+
+    if (!cpu)
+        THROW("Failed to allocate the CPU", INVALID_FILE);
+    memset(cpu, 0, sizeof(cpu_t));
+    read_rom(path, cpu);
+    init_cpu(cpu);
+    init_apu(cpu);
+    reschedule_events(cpu);
+    run_frames(cpu, frames);
+
+    dump->banks = cpu->cgb_mode ? 2 : 1;
+    for (int bank = 0; bank < dump->banks; bank++) {
+        const uint8_t *vram = cpu->vram[cpu->cgb_mode ? bank : 0];
+        memcpy(dump->data[bank], vram, TILE_COUNT * 16);
+    }
+    for (int i = 0; i < 4; i++)
+        dump->pal[i] = 0xFF000000 | (0x555555 * (3 - i));
+    close_rom(cpu);
+    free(cpu->apu);
+    free(cpu->tiles);
+    free(cpu->blocks);
+    free(cpu);
+}
+
+static double bench_decode(const pixel_kernels_t *k, vram_dump_t *dump)
+{
+    uint64_t start = now_ns(), elapsed;
+    uint64_t tiles = 0;
+
+    do {
+        for (int bank = 0; bank < dump->banks; bank++) {
+            for (int tile = 0; tile < TILE_COUNT; tile++)
+                k->decode_tile(dump->data[bank] + tile * 16, dump->rows[bank][tile]);
+        }
+        tiles += dump->banks * TILE_COUNT;
+        elapsed = now_ns() - start;
+    } while (elapsed < MIN_NS);
+    return (double)elapsed / tiles;
+}
+
+static double bench_expand(const pixel_kernels_t *k, vram_dump_t *dump, uint32_t *out)
+{
+    uint64_t start = now_ns(), elapsed;
+    uint64_t rows = 0;
+
+    do {
+        for (int bank = 0; bank < dump->banks; bank++) {
+            const uint8_t *pixels = dump->rows[bank][0][0][0];
+            for (int row = 0; row < TILE_COUNT * 8; row++)
+                k->expand_row(pixels + row * 8, dump->pal, out + (bank * TILE_COUNT * 8 + row) * 8);
+        }
+        rows += dump->banks * TILE_COUNT * 8;
+        elapsed = now_ns() - start;
+    } while (elapsed < MIN_NS);
+    return (double)elapsed / rows;
+}
+
+static int bench_rom(const char *path, int frames)
+{
+    static vram_dump_t dump;
+    static uint8_t ref_rows[sizeof(dump.rows)];
+    static uint32_t ref_out[2 * TILE_COUNT * 8 * 8], out[2 * TILE_COUNT * 8 * 8];
+    const pixel_kernels_t *list[8];
+    int count = get_pixel_kernels(list, 8);
+    double base_decode = 0, base_expand = 0;
+    int failed = 0;
+
+    dump_vram(path, frames, &dump);
+    printf("%s: %d tiles after %d frames\n", path, dump.banks * TILE_COUNT, frames);
+    printf("  %-8s %14s %14s\n", "kernels", "decode ns/tile", "expand ns/row");
+    for (int i = 0; i < count; i++) {
+        double decode = bench_decode(list[i], &dump);
+        double expand = bench_expand(list[i], &dump, out);
+
+        if (i == 0) {
+            memcpy(ref_rows, dump.rows, sizeof(ref_rows));
+            memcpy(ref_out, out, sizeof(ref_out));
+            base_decode = decode;
+            base_expand = expand;
+        } else if (memcmp(ref_rows, dump.rows, sizeof(ref_rows))
+            || memcmp(ref_out, out, sizeof(ref_out))) {
+            printf("  %-8s MISMATCH against scalar\n", list[i]->name);
+            failed = 1;
+            continue;
+        }
+        printf("  %-8s %8.2f (x%.1f) %8.2f (x%.1f)\n", list[i]->name,
+            decode, base_decode / decode, expand, base_expand / expand);
+    }
+    return failed;
+}
+
+int main(int argc, char **argv)
+{
+    int frames = 600;
+    int failed = 0;
+    int i = 1;
+
+    if (argc > 2 && strcmp(argv[1], "-f") == 0) {
+        frames = atoi(argv[2]);
+        i = 3;
+    }
+    if (i >= argc) {
+        fprintf(stderr, "usage: %s [-f frames] rom...\n", argv[0]);
+        return 1;
+    }
+    for (; i < argc; i++)
+        failed |= bench_rom(argv[i], frames);
+    return failed;
+}
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "gb.h"
+
+// Steps a gb_vec batch on random actions and reports env-steps per second.
+//   ./bench_vec [-n envs] [-j threads] [-k frame_skip] [-d downsample]
+//               [-s steps] [-p] rom
+// -p asks for palette-index observations instead of grayscale.
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *read_file(const char *path, size_t *size)
+{
+    FILE *f = fopen(path, "rb");
+    void *data;
+
+    if (!f)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    data = malloc(*size);
+    if (data && fread(data, 1, *size, f) != *size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    return data;
+}
+
+int main(int argc, char **argv)
+{
+    gb_vec_config_t config = {
+        .count = 16, .frame_skip = 4, .downsample = 2, .format = GB_OBS_GRAY,
+        .max_episode_frames = 3600
+    };
+    static const uint16_t rewards[] = {0xC000, 0xC001, 0xD000, 0xFF80};
+    int steps = 500;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:j:k:d:s:p")) != -1) {
+        switch (opt) {
+        case 'n': config.count = atoi(optarg); break;
+        case 'j': config.threads = atoi(optarg); break;
+        case 'k': config.frame_skip = atoi(optarg); break;
+        case 'd': config.downsample = atoi(optarg); break;
+        case 's': steps = atoi(optarg); break;
+        case 'p': config.format = GB_OBS_PALETTE; break;
+        default: optind = argc + 1;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-n envs] [-j threads] [-k frame_skip] [-d downsample] [-s steps] [-p] rom\n", argv[0]);
+        return 1;
+    }
+    config.reward_addresses = rewards;
+    config.reward_count = 4;
+
+    size_t size;
+    void *rom = read_file(argv[optind], &size);
+    gb_vec_t *vec = rom ? gb_vec_create(rom, size, &config) : NULL;
+    if (!vec) {
+        fprintf(stderr, "%s: couldn't start the batch\n", argv[optind]);
+        return 1;
+    }
+
+    int width, height;
+    gb_vec_obs_size(vec, &width, &height);
+    gb_vec_output_t out = {
+        .obs = malloc((size_t)config.count * width * height),
+        .obs_stride = width * height,
+        .rewards = malloc(config.count * 4),
+        .reward_stride = 4,
+        .done = malloc(config.count)
+    };
+    uint8_t *actions = malloc(config.count);
+    if (!out.obs || !out.rewards || !out.done || !actions)
+        return 1;
+
+    gb_vec_reset(vec, &out);
+    double start = now_seconds();
+    for (int s = 0; s < steps; s++) {
+        for (int i = 0; i < config.count; i++)
+            actions[i] = 1 << (rand() % 8);
+        gb_vec_step(vec, actions, &out);
+    }
+    double seconds = now_seconds() - start;
+    double env_steps = (double)steps * config.count;
+
+    printf("%d envs, %d steps of %d frames, %dx%d %s observations: "
+        "%.0f env-steps/s, %.0f frames/s in %.2fs\n",
+        config.count, steps, config.frame_skip ? config.frame_skip : 1,
+        width, height, config.format == GB_OBS_GRAY ? "gray" : "palette",
+        env_steps / seconds, env_steps * (config.frame_skip ? config.frame_skip : 1) / seconds,
+        seconds);
+    gb_vec_destroy(vec);
+    return 0;
+}
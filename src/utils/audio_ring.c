@@ -0,0 +1,120 @@
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu.h"
+
+// Single-producer single-consumer ring of stereo frames, for handing mixed
+// audio from the emulation thread to a device callback without a lock.
+// `head` and `tail` count frames read and written since the start and only
+// ever grow; each is stored by one side only, and the size is a power of
+// two so they index the ring with a mask even after wrapping around.
+
+struct audio_ring_s {
+    int16_t *data;
+    uint32_t mask;
+    alignas(64) atomic_uint head; // written by the consumer
+    alignas(64) atomic_uint tail; // written by the producer
+    alignas(64) atomic_uint underruns;
+    atomic_uint overruns;
+};
+
+audio_ring_t *create_audio_ring(int frames)
+{
+    audio_ring_t *ring = calloc(1, sizeof(audio_ring_t));
+    uint32_t size = 1;
+
+    if (!ring)
+        return NULL;
+    while (size < (uint32_t)frames)
+        size <<= 1;
+    ring->data = calloc(size * 2, sizeof(int16_t));
+    if (!ring->data) {
+        free(ring);
+        return NULL;
+    }
+    ring->mask = size - 1;
+    return ring;
+}
+
+void destroy_audio_ring(audio_ring_t *ring)
+{
+    if (!ring)
+        return;
+    free(ring->data);
+    free(ring);
+}
+
+// Copies `frames` between the ring at `start` and `samples`, in at most
+// two pieces where the ring wraps
+static void copy_frames(audio_ring_t *ring, uint32_t start, int16_t *samples, int frames, int to_ring)
+{
+    uint32_t at = start & ring->mask;
+    uint32_t first = ring->mask + 1 - at;
+
+    if (first > (uint32_t)frames)
+        first = frames;
+    for (int piece = 0; piece < 2; piece++) {
+        int16_t *slot = ring->data + at * 2;
+        if (to_ring)
+            memcpy(slot, samples, first * 2 * sizeof(int16_t));
+        else
+            memcpy(samples, slot, first * 2 * sizeof(int16_t));
+        samples += first * 2;
+        frames -= first;
+        at = 0;
+        first = frames;
+    }
+}
+
+// Producer side. Takes as many frames as fit and returns how many that
+// was; a block cut short counts as an overrun.
+int audio_ring_write(audio_ring_t *ring, const int16_t *samples, int frames)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint32_t room = ring->mask + 1 - (tail - head);
+
+    if ((uint32_t)frames > room) {
+        frames = room;
+        atomic_fetch_add_explicit(&ring->overruns, 1, memory_order_relaxed);
+    }
+    copy_frames(ring, tail, (int16_t *)samples, frames, 1);
+    atomic_store_explicit(&ring->tail, tail + frames, memory_order_release);
+    return frames;
+}
+
+// Consumer side. Always fills `frames`, padding with silence when the ring
+// runs dry, which counts as an underrun. Returns the frames that were real.
+int audio_ring_read(audio_ring_t *ring, int16_t *out, int frames)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    int count = tail - head < (uint32_t)frames ? (int)(tail - head) : frames;
+
+    copy_frames(ring, head, out, count, 0);
+    atomic_store_explicit(&ring->head, head + count, memory_order_release);
+    if (count < frames) {
+        memset(out + count * 2, 0, (frames - count) * 2 * sizeof(int16_t));
+        atomic_fetch_add_explicit(&ring->underruns, 1, memory_order_relaxed);
+    }
+    return count;
+}
+
+// Frames written but not read yet; exact from either side, a snapshot from
+// anywhere else
+int audio_ring_fill(audio_ring_t *ring)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    return tail - head;
+}
+
+void get_audio_ring_stats(audio_ring_t *ring, audio_stats_t *stats)
+{
+    stats->fill = audio_ring_fill(ring);
+    stats->size = ring->mask + 1;
+    stats->underruns = atomic_load_explicit(&ring->underruns, memory_order_relaxed);
+    stats->overruns = atomic_load_explicit(&ring->overruns, memory_order_relaxed);
+}
@@ -0,0 +1,207 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include "cpu.h"
+
+// Fork-join pool for running many independent consoles. Each run splits its
+// task indices into one contiguous range per worker; a worker takes from
+// the front of its own range and, once that is empty, steals from the back
+// of the others', so long tasks don't leave the rest of the pool idle. The
+// calling thread works as worker 0.
+
+typedef struct {
+    pthread_mutex_t lock;
+    int *items;
+    int capacity;
+    int head;
+    int tail;
+} task_queue_t;
+
+struct thread_pool_s {
+    int workers;
+    pthread_t *threads;
+    task_queue_t *queues;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    uint64_t generation;
+    int stop;
+
+    pool_task_t task;
+    void *ctx;
+    atomic_int remaining;
+};
+
+typedef struct {
+    thread_pool_t *pool;
+    int worker;
+} worker_arg_t;
+
+static int take_task(task_queue_t *q, int steal)
+{
+    int index = -1;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail)
+        index = steal ? q->items[--q->tail] : q->items[q->head++];
+    pthread_mutex_unlock(&q->lock);
+    return index;
+}
+
+static void work(thread_pool_t *pool, int worker)
+{
+    for (;;) {
+        int index = take_task(&pool->queues[worker], 0);
+
+        for (int i = 1; index < 0 && i < pool->workers; i++)
+            index = take_task(&pool->queues[(worker + i) % pool->workers], 1);
+        if (index < 0)
+            return;
+        pool->task(pool->ctx, index, worker);
+        if (atomic_fetch_sub(&pool->remaining, 1) == 1) {
+            pthread_mutex_lock(&pool->lock);
+            pthread_cond_broadcast(&pool->done);
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+}
+
+static void *worker_loop(void *data)
+{
+    worker_arg_t *arg = data;
+    thread_pool_t *pool = arg->pool;
+    uint64_t seen = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->generation == seen && !pool->stop)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        seen = pool->generation;
+        int stop = pool->stop;
+        pthread_mutex_unlock(&pool->lock);
+        if (stop)
+            break;
+        work(pool, arg->worker);
+    }
+    free(arg);
+    return NULL;
+}
+
+thread_pool_t *create_thread_pool(int workers)
+{
+    thread_pool_t *pool = calloc(1, sizeof(thread_pool_t));
+
+    if (!pool)
+        return NULL;
+    pool->workers = workers < 1 ? 1 : workers;
+    pool->threads = calloc(pool->workers, sizeof(pthread_t));
+    pool->queues = calloc(pool->workers, sizeof(task_queue_t));
+    if (!pool->threads || !pool->queues) {
+        free(pool->threads);
+        free(pool->queues);
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (int i = 0; i < pool->workers; i++)
+        pthread_mutex_init(&pool->queues[i].lock, NULL);
+
+    for (int i = 1; i < pool->workers; i++) {
+        worker_arg_t *arg = malloc(sizeof(worker_arg_t));
+        if (arg) {
+            arg->pool = pool;
+            arg->worker = i;
+        }
+        if (!arg || pthread_create(&pool->threads[i], NULL, worker_loop, arg) != 0) {
+            // Run with the threads that did start
+            free(arg);
+            pool->workers = i;
+            break;
+        }
+    }
+    return pool;
+}
+
+int thread_pool_size(thread_pool_t *pool)
+{
+    return pool->workers;
+}
+
+// Runs task(ctx, i, worker) for every i in [0, count) and returns once all
+// of them are done
+void run_thread_pool(thread_pool_t *pool, int count, pool_task_t task, void *ctx)
+{
+    if (count <= 0)
+        return;
+    if (pool->workers == 1 || count == 1) {
+        for (int i = 0; i < count; i++)
+            task(ctx, i, 0);
+        return;
+    }
+
+    // A worker still looking for work from the last run can take a task as
+    // soon as it is queued, so the task and counter go in first
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->ctx = ctx;
+    atomic_store(&pool->remaining, count);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int w = 0; w < pool->workers; w++) {
+        task_queue_t *q = &pool->queues[w];
+        int first = (int)((int64_t)count * w / pool->workers);
+        int last = (int)((int64_t)count * (w + 1) / pool->workers);
+
+        pthread_mutex_lock(&q->lock);
+        if (q->capacity < last - first) {
+            int *items = realloc(q->items, (last - first) * sizeof(int));
+            if (!items)
+                THROW("Failed to allocate the task queue", INVALID_FILE);
+            q->items = items;
+            q->capacity = last - first;
+        }
+        for (int i = first; i < last; i++)
+            q->items[i - first] = i;
+        q->head = 0;
+        q->tail = last - first;
+        pthread_mutex_unlock(&q->lock);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    work(pool, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (atomic_load(&pool->remaining) > 0)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void destroy_thread_pool(thread_pool_t *pool)
+{
+    if (!pool)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 1; i < pool->workers; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    for (int i = 0; i < pool->workers; i++) {
+        pthread_mutex_destroy(&pool->queues[i].lock);
+        free(pool->queues[i].items);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->done);
+    free(pool->queues);
+    free(pool->threads);
+    free(pool);
+}
@@ -1,272 +1,200 @@
+#include <stddef.h>
+#include <string.h>
 #include "cpu.h"
-#include <SDL2/SDL.h>
 
-uint32_t palette[4] = {
-    0xFFFFFFFF,
-    0xFF8BAC0F,
-    0xFF306230,
-    0xFF0F380F
-};
+#define SPRITES_PER_LINE 10
 
-// Convert CGB 15-bit color (RGB555) to ARGB8888
-static uint32_t cgb_to_argb(uint8_t lo, uint8_t hi)
+static const uint8_t *vram_bank(cpu_t *cpu, int bank)
 {
-    uint16_t rgb555 = lo | (hi << 8);
-    uint8_t r = (rgb555 & 0x1F) << 3;
-    uint8_t g = ((rgb555 >> 5) & 0x1F) << 3;
-    uint8_t b = ((rgb555 >> 10) & 0x1F) << 3;
-    return 0xFF000000 | (r << 16) | (g << 8) | b;
+    return cpu->vram[cpu->cgb_mode ? bank : 0];
 }
 
-static uint32_t get_cgb_bg_color(cpu_t *cpu, uint8_t pal_num, uint8_t color_id)
+// Draws screen pixels [x, 160) from one row of a tile map. map_x is the
+// map pixel column under screen pixel x, map_y the map pixel row. Tile
+// number and attributes are fetched once per tile, the pixels come
+// pre-decoded from the tile cache. `bg` gets each pixel's colour index and
+// CGB palette number (bits 2-4), with bit 7 set where the CGB attributes
+// put the tile above sprites.
+static void render_map_row(cpu_t *cpu, uint16_t map_base, uint8_t map_x,
+    uint8_t map_y, int x, uint32_t *line, uint8_t *bg)
 {
-    int idx = (pal_num * 8) + (color_id * 2);
-    return cgb_to_argb(cpu->bg_palette_data[idx], cpu->bg_palette_data[idx + 1]);
-}
-
-static uint32_t get_cgb_obj_color(cpu_t *cpu, uint8_t pal_num, uint8_t color_id)
-{
-    int idx = (pal_num * 8) + (color_id * 2);
-    return cgb_to_argb(cpu->obj_palette_data[idx], cpu->obj_palette_data[idx + 1]);
-}
-
-void render_background(cpu_t *cpu, uint32_t *pixels) {
-    uint8_t scy = cpu->memory[0xFF42];
-    uint8_t scx = cpu->memory[0xFF43];
-    uint8_t lcdc = cpu->memory[0xFF40];
-
-    if (!(lcdc & 0x80)) return;
-
-    if (!(lcdc & 0x01) && !cpu->cgb_mode) {
-        for (int i = 0; i < 160 * 144; i++) pixels[i] = palette[0];
-        return;
-    }
-
-    uint16_t map_base = (lcdc & 0x08) ? 0x9C00 : 0x9800;
-    uint16_t data_base = (lcdc & 0x10) ? 0x8000 : 0x8800;
-    int is_signed = !(lcdc & 0x10);
-
-    for (int y = 0; y < 144; y++) {
-        for (int x = 0; x < 160; x++) {
-            uint8_t bg_y = y + scy;
-            uint8_t bg_x = x + scx;
-
-            uint16_t tile_map_addr = map_base + ((bg_y / 8) * 32) + (bg_x / 8);
-            uint16_t map_offset = tile_map_addr - 0x8000;
-
-            int tile_id;
-            uint8_t attr = 0;
-            uint8_t tile_vram_bank = 0;
-            uint8_t cgb_pal = 0;
-            int x_flip = 0, y_flip = 0;
-
-            if (cpu->cgb_mode) {
-                tile_id = cpu->vram_banks[0][map_offset];
-                attr = cpu->vram_banks[1][map_offset];
-                cgb_pal = attr & 0x07;
-                tile_vram_bank = (attr >> 3) & 1;
-                x_flip = attr & 0x20;
-                y_flip = attr & 0x40;
-            } else {
-                tile_id = cpu->memory[tile_map_addr];
-            }
-            if (is_signed) tile_id = (int8_t)tile_id;
-
-            uint16_t tile_data_addr = is_signed ? (data_base + (tile_id + 128) * 16) : (data_base + tile_id * 16);
-            uint16_t data_offset = tile_data_addr - 0x8000;
-
-            int row = bg_y % 8;
-            if (y_flip) row = 7 - row;
-
-            uint8_t byte1, byte2;
-            if (cpu->cgb_mode) {
-                byte1 = cpu->vram_banks[tile_vram_bank][data_offset + row * 2];
-                byte2 = cpu->vram_banks[tile_vram_bank][data_offset + row * 2 + 1];
-            } else {
-                byte1 = cpu->memory[tile_data_addr + row * 2];
-                byte2 = cpu->memory[tile_data_addr + row * 2 + 1];
+    uint8_t lcdc = IO(cpu, 0xFF40);
+    const uint8_t *map = vram_bank(cpu, 0) + (map_base - 0x8000) + (map_y / 8) * 32;
+    const uint8_t *attrs = cpu->cgb_mode ? cpu->vram[1] + (map - cpu->vram[0]) : NULL;
+    int tile_x = map_x / 8;
+    int col = map_x % 8;
+
+    while (x < 160) {
+        uint8_t tile_id = map[tile_x];
+        uint8_t attr = attrs ? attrs[tile_x] : 0;
+        int row = (attr & 0x40) ? 7 - (map_y % 8) : map_y % 8;
+        int tile = (lcdc & 0x10) ? tile_id : 256 + (int8_t)tile_id;
+        const uint8_t *pixels = get_tile_row(cpu, (attr >> 3) & 1, tile, row, attr & 0x20);
+        const uint32_t *colors = cpu->bg_colors[attr & 0x07];
+        uint8_t tag = (attr & 0x80) | ((attr & 0x07) << 2);
+
+        // Whole tiles go through the vector kernel, the clipped ones at
+        // the edges pixel by pixel
+        if (col == 0 && x <= 160 - 8) {
+            pixel_kernels->expand_row(pixels, colors, line + x);
+            memcpy(bg + x, pixels, 8);
+            if (tag) {
+                for (int i = 0; i < 8; i++)
+                    bg[x + i] |= tag;
             }
-
-            int col = bg_x % 8;
-            int bit = x_flip ? col : (7 - col);
-            uint8_t color_id = ((byte2 >> bit) & 0x1) << 1 | ((byte1 >> bit) & 0x1);
-
-            if (cpu->cgb_mode) {
-                pixels[y * 160 + x] = get_cgb_bg_color(cpu, cgb_pal, color_id);
-            } else {
-                uint8_t bgp = cpu->memory[0xFF47];
-                uint8_t actual_color = (bgp >> (color_id * 2)) & 0x03;
-                pixels[y * 160 + x] = palette[actual_color];
+            x += 8;
+        } else {
+            for (; col < 8 && x < 160; col++, x++) {
+                line[x] = colors[pixels[col]];
+                bg[x] = pixels[col] | tag;
             }
         }
+        col = 0;
+        tile_x = (tile_x + 1) & 31;
     }
 }
 
-void render_window(cpu_t *cpu, uint32_t *pixels) {
-    uint8_t lcdc = cpu->memory[0xFF40];
-
-    if (!(lcdc & 0x20) || !(lcdc & 0x80)) return;
-
-    uint8_t wx = cpu->memory[0xFF4B];
-    uint8_t wy = cpu->memory[0xFF4A];
-
-    if (wx > 166 || wy > 143) return;
-
-    int wx_corrected = wx - 7;
-
-    uint16_t map_base = (lcdc & 0x40) ? 0x9C00 : 0x9800;
-    uint16_t data_base = (lcdc & 0x10) ? 0x8000 : 0x8800;
-    int is_signed = !(lcdc & 0x10);
-
-    for (int y = 0; y < 144; y++) {
-        if (y < wy) continue;
-
-        for (int x = 0; x < 160; x++) {
-            if (x < wx_corrected) continue;
-
-            uint8_t w_y = y - wy;
-            uint8_t w_x = x - wx_corrected;
-
-            uint16_t tile_map_addr = map_base + ((w_y / 8) * 32) + (w_x / 8);
-            uint16_t map_offset = tile_map_addr - 0x8000;
+static void render_background(cpu_t *cpu, int ly, uint32_t *line, uint8_t *bg)
+{
+    uint8_t lcdc = IO(cpu, 0xFF40);
+    uint8_t scy = IO(cpu, 0xFF42);
+    uint8_t scx = IO(cpu, 0xFF43);
 
-            int tile_id;
-            uint8_t attr = 0;
-            uint8_t tile_vram_bank = 0;
-            uint8_t cgb_pal = 0;
-            int x_flip = 0, y_flip = 0;
+    render_map_row(cpu, (lcdc & 0x08) ? 0x9C00 : 0x9800, scx, ly + scy, 0, line, bg);
+}
 
-            if (cpu->cgb_mode) {
-                tile_id = cpu->vram_banks[0][map_offset];
-                attr = cpu->vram_banks[1][map_offset];
-                cgb_pal = attr & 0x07;
-                tile_vram_bank = (attr >> 3) & 1;
-                x_flip = attr & 0x20;
-                y_flip = attr & 0x40;
-            } else {
-                tile_id = cpu->memory[tile_map_addr];
-            }
-            if (is_signed) tile_id = (int8_t)tile_id;
+// The window keeps its own line counter: it only advances on lines where
+// the window was actually drawn
+static void render_window(cpu_t *cpu, int ly, uint32_t *line, uint8_t *bg)
+{
+    uint8_t lcdc = IO(cpu, 0xFF40);
+    uint8_t wy = IO(cpu, 0xFF4A);
+    int wx = IO(cpu, 0xFF4B) - 7;
 
-            uint16_t tile_data_addr = is_signed ? (data_base + (tile_id + 128) * 16) : (data_base + tile_id * 16);
-            uint16_t data_offset = tile_data_addr - 0x8000;
+    if (!(lcdc & 0x20) || ly < wy || wx >= 160)
+        return;
+    render_map_row(cpu, (lcdc & 0x40) ? 0x9C00 : 0x9800, (wx < 0) ? -wx : 0,
+        cpu->window_line, (wx < 0) ? 0 : wx, line, bg);
+    cpu->window_line++;
+}
 
-            int row = w_y % 8;
-            if (y_flip) row = 7 - row;
+// The OAM scan of mode 2: the first 10 sprites covering the line, off
+// screen or not, in drawing priority order. On DMG the lower X wins, then
+// the lower OAM index; on CGB only the OAM index counts.
+static int scan_oam(cpu_t *cpu, int ly, int height, uint8_t *sprites)
+{
+    const uint8_t *oam = &IO(cpu, 0xFE00);
+    int count = 0;
+
+    for (int i = 0; i < 40 && count < SPRITES_PER_LINE; i++) {
+        int y = (int)oam[i * 4] - 16;
+        if (ly < y || ly >= y + height)
+            continue;
+        // Stable insertion by X keeps OAM order among equal X
+        int j = count++;
+        for (; !cpu->cgb_mode && j > 0 && oam[sprites[j - 1] * 4 + 1] > oam[i * 4 + 1]; j--)
+            sprites[j] = sprites[j - 1];
+        sprites[j] = i;
+    }
+    return count;
+}
 
-            uint8_t byte1, byte2;
-            if (cpu->cgb_mode) {
-                byte1 = cpu->vram_banks[tile_vram_bank][data_offset + row * 2];
-                byte2 = cpu->vram_banks[tile_vram_bank][data_offset + row * 2 + 1];
-            } else {
-                byte1 = cpu->memory[tile_data_addr + row * 2];
-                byte2 = cpu->memory[tile_data_addr + row * 2 + 1];
-            }
+// Sprites are drawn from the highest priority down and each screen pixel
+// goes to the first opaque sprite pixel over it. That pixel then hides
+// behind BG colours 1-3 if the sprite (attribute bit 7) or, on CGB, the
+// tile asks for it; LCDC bit 0 clear on CGB puts every sprite on top.
+// Visible sprite pixels are marked in `index` when there is one.
+static void render_sprites(cpu_t *cpu, int ly, uint32_t *line, const uint8_t *bg, uint8_t *index)
+{
+    uint8_t lcdc = IO(cpu, 0xFF40);
+    int height = (lcdc & 0x04) ? 16 : 8;
+    int bg_priority = !cpu->cgb_mode || (lcdc & 0x01);
+    uint8_t sprites[SPRITES_PER_LINE];
+    uint8_t taken[160] = {0};
 
-            int col = w_x % 8;
-            int bit = x_flip ? col : (7 - col);
-            uint8_t color_id = ((byte2 >> bit) & 0x1) << 1 | ((byte1 >> bit) & 0x1);
+    if (!(lcdc & 0x02))
+        return;
 
-            if (cpu->cgb_mode) {
-                pixels[y * 160 + x] = get_cgb_bg_color(cpu, cgb_pal, color_id);
-            } else {
-                uint8_t bgp = cpu->memory[0xFF47];
-                uint8_t actual_color = (bgp >> (color_id * 2)) & 0x03;
-                pixels[y * 160 + x] = palette[actual_color];
-            }
+    int count = scan_oam(cpu, ly, height, sprites);
+    for (int i = 0; i < count; i++) {
+        const uint8_t *oam = &IO(cpu, 0xFE00 + sprites[i] * 4);
+        int y = (int)oam[0] - 16;
+        int x = (int)oam[1] - 8;
+        uint8_t tile_id = oam[2];
+        uint8_t attributes = oam[3];
+
+        if (x <= -8 || x >= 160)
+            continue;
+        if (height == 16)
+            tile_id &= 0xFE;
+
+        int row = (attributes & 0x40) ? height - 1 - (ly - y) : ly - y;
+        // CGB: bit 0-2 = palette, bit 3 = vram bank. DMG: bit 4 = palette,
+        // and bit 3 is unused, so games leave it set at random
+        int bank = cpu->cgb_mode ? (attributes >> 3) & 1 : 0;
+        const uint8_t *pixels = get_tile_row(cpu, bank,
+            tile_id + row / 8, row % 8, attributes & 0x20);
+        int pal = cpu->cgb_mode ? attributes & 0x07 : (attributes >> 4) & 1;
+        const uint32_t *colors = cpu->obj_colors[pal];
+        uint8_t behind = attributes & 0x80;
+
+        for (int tx = (x < 0) ? -x : 0; tx < 8 && x + tx < 160; tx++) {
+            int draw_x = x + tx;
+            if (pixels[tx] == 0 || taken[draw_x])
+                continue;
+            taken[draw_x] = 1;
+            if (bg_priority && (bg[draw_x] & 0x03) && (behind || (bg[draw_x] & 0x80)))
+                continue;
+            line[draw_x] = colors[pixels[tx]];
+            if (index)
+                index[draw_x] = 0x20 | (pal << 2) | pixels[tx];
         }
     }
 }
 
-void render_sprites(cpu_t *cpu, uint32_t *pixels) {
-    if (!(cpu->memory[0xFF40] & 0x02)) return;
-
-    int use_8x16 = (cpu->memory[0xFF40] & 0x04);
-
-    for (int i = 0; i < 40; i++) {
-        uint16_t oam_addr = 0xFE00 + (i * 4);
-        int y = (int)cpu->memory[oam_addr] - 16;
-        int x = (int)cpu->memory[oam_addr + 1] - 8;
-        uint8_t tile_id = cpu->memory[oam_addr + 2];
-        uint8_t attributes = cpu->memory[oam_addr + 3];
-
-        if (use_8x16) tile_id &= 0xFE;
-
-        int height = use_8x16 ? 16 : 8;
-
-        if (y <= -height || y >= 144 || x <= -8 || x >= 160) continue;
-
-        uint16_t tile_data_addr = 0x8000 + (tile_id * 16);
-        uint16_t data_offset = tile_data_addr - 0x8000;
-        int x_flip = (attributes & 0x20);
-        int y_flip = (attributes & 0x40);
-
-        // CGB: bit 0-2 = palette, bit 3 = vram bank
-        uint8_t cgb_pal = attributes & 0x07;
-        uint8_t tile_vram_bank = (attributes >> 3) & 1;
-        // DMG: bit 4 = palette select
-        uint8_t obp = (attributes & 0x10) ? cpu->memory[0xFF49] : cpu->memory[0xFF48];
-
-        for (int ty = 0; ty < height; ty++) {
-            int draw_y = y + ty;
-            if (draw_y < 0 || draw_y >= 144) continue;
-
-            int line_in_tile = y_flip ? (height - 1 - ty) : ty;
-
-            uint16_t current_offset = data_offset;
-            if (line_in_tile >= 8) {
-                current_offset += 16;
-                line_in_tile -= 8;
-            }
-
-            uint8_t byte1, byte2;
-            if (cpu->cgb_mode) {
-                byte1 = cpu->vram_banks[tile_vram_bank][current_offset + line_in_tile * 2];
-                byte2 = cpu->vram_banks[tile_vram_bank][current_offset + line_in_tile * 2 + 1];
-            } else {
-                uint16_t current_tile_addr = tile_data_addr;
-                if (ty >= 8 || (y_flip && ty < height - 8)) current_tile_addr += (current_offset - data_offset);
-                byte1 = cpu->memory[current_offset + 0x8000 + line_in_tile * 2];
-                byte2 = cpu->memory[current_offset + 0x8000 + line_in_tile * 2 + 1];
-            }
-
-            for (int tx = 0; tx < 8; tx++) {
-                int draw_x = x + tx;
-                if (draw_x < 0 || draw_x >= 160) continue;
-
-                int bit = x_flip ? tx : (7 - tx);
-                uint8_t color_id = ((byte2 >> bit) & 0x1) << 1 | ((byte1 >> bit) & 0x1);
-                if (color_id == 0) continue;
+// Draws line `ly` of the frame from the registers as they are at the end
+// of its mode 3, so mid-frame scroll, palette and LCDC changes show up
+void render_scanline(cpu_t *cpu, int ly)
+{
+    uint8_t lcdc = IO(cpu, 0xFF40);
+    uint32_t *line = &cpu->framebuffer[ly * 160];
+    uint8_t *index = cpu->index_frame ? cpu->index_frame + ly * 160 : NULL;
+    uint8_t bg[160];
 
-                if (cpu->cgb_mode) {
-                    pixels[draw_y * 160 + draw_x] = get_cgb_obj_color(cpu, cgb_pal, color_id);
-                } else {
-                    uint8_t actual_color = (obp >> (color_id * 2)) & 0x03;
-                    pixels[draw_y * 160 + draw_x] = palette[actual_color];
-                }
-            }
-        }
+    // On DMG, LCDC bit 0 blanks both background and window
+    if (!(lcdc & 0x01) && !cpu->cgb_mode) {
+        for (int x = 0; x < 160; x++)
+            line[x] = palette[0];
+        memset(bg, 0, sizeof(bg));
+    } else {
+        render_background(cpu, ly, line, bg);
+        render_window(cpu, ly, line, bg);
+    }
+    if (index) {
+        for (int x = 0; x < 160; x++)
+            index[x] = bg[x] & 0x1F;
     }
+    render_sprites(cpu, ly, line, bg, index);
 }
 
 void update_graphics(cpu_t *cpu, int cycles)
 {
-    static int cycle_count = 0;
-    cycle_count += cycles;
-
-    if (!(read_8(cpu, 0xFF40) & 0x80)) {
-        while (cycle_count >= 456) {
-            cycle_count -= 456;
-            uint8_t current_ly = read_8(cpu, 0xFF44);
-            write_8(cpu, 0xFF44, current_ly + 1);
-            if (read_8(cpu, 0xFF44) > 153) write_8(cpu, 0xFF44, 0);
+
+    cpu->ppu_cycles += cycles;
+
+    if (!(IO(cpu, 0xFF40) & 0x80)) {
+        while (cpu->ppu_cycles >= 456) {
+            cpu->ppu_cycles -= 456;
+            IO(cpu, 0xFF44)++;
+            if (IO(cpu, 0xFF44) > 153) IO(cpu, 0xFF44) = 0;
         }
-        write_8(cpu, 0xFF41, (read_8(cpu, 0xFF41) & ~0x03) | 0x00);
+        IO(cpu, 0xFF41) &= ~0x03;
+        cpu->window_line = 0;
         return;
     }
 
-    uint8_t ly = cpu->memory[0xFF44];
-    uint8_t stat = cpu->memory[0xFF41];
+    uint8_t ly = IO(cpu, 0xFF44);
+    uint8_t stat = IO(cpu, 0xFF41);
     uint8_t old_mode = stat & 0x03;
     uint8_t new_mode = old_mode;
 
@@ -274,40 +202,67 @@ void update_graphics(cpu_t *cpu, int cycles)
     if (ly >= 144) {
         new_mode = 1; // Mode 1
     } else {
-        if (cycle_count <= 80) new_mode = 2; // Mode 2
-        else if (cycle_count <= 252) new_mode = 3; // Mode 3
+        if (cpu->ppu_cycles <= 80) new_mode = 2; // Mode 2
+        else if (cpu->ppu_cycles <= 252) new_mode = 3; // Mode 3
         else new_mode = 0; // Mode 0
     }
 
     // STAT Interrupt on mode change
     if (new_mode != old_mode) {
-        if (new_mode == 0 && (stat & 0x08)) write_8(cpu, 0xFF0F, read_8(cpu, 0xFF0F) | 0x02);
-        if (new_mode == 1 && (stat & 0x10)) write_8(cpu, 0xFF0F, read_8(cpu, 0xFF0F) | 0x02);
-        if (new_mode == 2 && (stat & 0x20)) write_8(cpu, 0xFF0F, read_8(cpu, 0xFF0F) | 0x02);
-        if (new_mode == 0) hdma_hblank_tick(cpu);
+        if (new_mode == 0 && (stat & 0x08)) IO(cpu, 0xFF0F) |= 0x02;
+        if (new_mode == 1 && (stat & 0x10)) IO(cpu, 0xFF0F) |= 0x02;
+        if (new_mode == 2 && (stat & 0x20)) IO(cpu, 0xFF0F) |= 0x02;
+        if (new_mode == 0) {
+            render_scanline(cpu, ly);
+            hdma_hblank_tick(cpu);
+        }
     }
 
     stat = (stat & ~0x03) | new_mode;
 
     // LYC == LY comparison
-    if (ly == read_8(cpu, 0xFF45)) {
+    if (ly == IO(cpu, 0xFF45)) {
         if (!(stat & 0x04)) {
             stat |= 0x04;
-            if (stat & 0x40) write_8(cpu, 0xFF0F, read_8(cpu, 0xFF0F) | 0x02); // STAT interrupt
+            if (stat & 0x40) IO(cpu, 0xFF0F) |= 0x02; // STAT interrupt
         }
     } else {
         stat &= ~0x04;
     }
 
-    write_8(cpu, 0xFF41, stat);
+    IO(cpu, 0xFF41) = stat;
 
-    while (cycle_count >= 456) {
-        cycle_count -= 456;
-        uint8_t current_ly = read_8(cpu, 0xFF44);
-        write_8(cpu, 0xFF44, current_ly + 1);
-        if (read_8(cpu, 0xFF44) > 153) write_8(cpu, 0xFF44, 0);
+    while (cpu->ppu_cycles >= 456) {
+        cpu->ppu_cycles -= 456;
+        IO(cpu, 0xFF44)++;
+        if (IO(cpu, 0xFF44) > 153) IO(cpu, 0xFF44) = 0;
 
-        if (read_8(cpu, 0xFF44) == 144)
-            write_8(cpu, 0xFF0F, read_8(cpu, 0xFF0F) | 0x01);
+        if (IO(cpu, 0xFF44) == 144) {
+            IO(cpu, 0xFF0F) |= 0x01;
+            cpu->window_line = 0;
+        }
     }
-}
\ No newline at end of file
+}
+
+// PPU cycles until update_graphics would change LY, the STAT mode or the
+// LYC flag. 1 when the registers are stale and the next update fixes them.
+int ppu_cycles_to_event(cpu_t *cpu)
+{
+    uint8_t ly = IO(cpu, 0xFF44);
+    uint8_t stat = IO(cpu, 0xFF41);
+    int cc = cpu->ppu_cycles;
+
+    if (!(IO(cpu, 0xFF40) & 0x80))
+        return (stat & 0x03) ? 1 : 456 - cc;
+
+    uint8_t mode = (ly >= 144) ? 1 : (cc <= 80) ? 2 : (cc <= 252) ? 3 : 0;
+    if ((stat & 0x03) != mode || !(stat & 0x04) != (ly != IO(cpu, 0xFF45)))
+        return 1;
+    if (ly >= 144)
+        return 456 - cc;
+    if (cc <= 80)
+        return 81 - cc;
+    if (cc <= 252)
+        return 253 - cc;
+    return 456 - cc;
+}